@@ -101,6 +101,18 @@ IRrecv irrecv(IR_RECV);
 
 #define RPI_LED_POWER 11
 long rpi_off_time = 0;
+// a repeat code after a longer gap belongs to a key we didn't decode
+#define IR_REPEAT_GAP 250
+long lastIrTime = 0;
+unsigned long lastIrCode = 0;
+
+// input event frame, between text lines, little endian:
+// SOH, sequence, flags, IR code (4), millis() (4), xor of the 10 bytes
+// from the sequence on
+#define IR_FRAME_SOH 0x01
+#define IR_FRAME_LEN 12
+#define IR_FLAG_REPEAT 0x01
+byte irSeq = 0;
 
 typedef enum {
    S_WAITING,
@@ -159,6 +171,27 @@ void setup()
   serialFlush();
 }
 
+void sendIrEvent(unsigned long code, byte flags, unsigned long at)
+{
+  byte frame[IR_FRAME_LEN];
+  byte i;
+
+  frame[0] = IR_FRAME_SOH;
+  frame[1] = irSeq++;
+  frame[2] = flags;
+  for(i=0;i<4;i++)
+  {
+    frame[3 + i] = (code >> (8 * i)) & 0xFF;
+    frame[7 + i] = (at >> (8 * i)) & 0xFF;
+  }
+  frame[11] = 0;
+  for(i=1;i<11;i++)
+  {
+    frame[11] ^= frame[i];
+  }
+  Serial.write(frame, IR_FRAME_LEN);
+}
+
 void loop()
 {
   long now;
@@ -177,82 +210,44 @@ void loop()
   }
   if(ir_ok && results.decode_type == NEC)
   {
-    switch(results.value){
-      case 0x1FE48B7:
-        if(!rpi)
-        {
-          stopRadio();
-        }
-        Serial.println("IR: POWER");
-        rpi = true;
-        break;
-      case 0x1FE58A7:
-        Serial.println("IR: UP");
-        break;
-      case 0x1FE7887:
-        Serial.println("IR: SETUP");
-        break;
-      case 0x1FE807F:
-        Serial.println("IR: LEFT");
-        break;
-      case 0x1FE40BF:
-        Serial.println("IR: ENTER");
-        break;
-      case 0x1FEC03F:
-        Serial.println("IR: RIGHT");
-        break;
-      case 0x1FE20DF:
-        Serial.println("IR: CARD");
-        break;
-      case 0x1FEA05F:
-        Serial.println("IR: DOWN");
-        break;
-      case 0x1FE609F:
-        Serial.println("IR: ROTATE");
-        break;
-      case 0x1FEE01F:
-        if(!rpi)
-        {
-          station = (station+1) % STATIONS_LENGTH;
-          saveStation(station);
-          gotoStation();          
-        }
-        Serial.println("IR: PHOTO");
-        break;
-      case 0x1FE10EF:
-        Serial.println("IR: SLIDE");
-        break;
-      case 0x1FE906F:
-        Serial.println("IR: STOP");
-        break;
-      case 0x1FE50AF:
-        Serial.println("IR: MUSIC");
-        break;
-      case 0x1FED827:
-        Serial.println("IR: EXIT");
-        if(rpi)
-        {
-          initRadio();
-          rpi = false;
-        }
-        break;
-      case 0x1FEF807:
-        Serial.println("IR: VOL+");
-        break;
-      case 0x1FE30CF:
-        Serial.println("IR: VIDEO");
-        break;
-      case 0x1FEB04F:
-        Serial.println("IR: ZOOM");
-      case 0x1FE708F:
-        Serial.println("IR: VOL-");
-        break;
-      case 0xFFFFFFFF:
-        break;
-      default:
-        Serial.print(results.value, HEX);
-        Serial.println();
+    if(results.value == 0xFFFFFFFF)
+    {
+      // NEC repeat code, sent every 110ms while the key is held
+      if(now - lastIrTime < IR_REPEAT_GAP)
+      {
+        sendIrEvent(lastIrCode, IR_FLAG_REPEAT, now);
+      }
+    }
+    else
+    {
+      switch(results.value){
+        case 0x1FE48B7: // POWER
+          if(!rpi)
+          {
+            stopRadio();
+          }
+          rpi = true;
+          break;
+        case 0x1FEE01F: // PHOTO
+          if(!rpi)
+          {
+            station = (station+1) % STATIONS_LENGTH;
+            saveStation(station);
+            gotoStation();
+          }
+          break;
+        case 0x1FED827: // EXIT
+          if(rpi)
+          {
+            initRadio();
+            rpi = false;
+          }
+          break;
+      }
+      sendIrEvent(results.value, 0, now);
+      lastIrCode = results.value;
     }
+    lastIrTime = now;
   }
   
   serialEvent();
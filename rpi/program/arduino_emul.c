@@ -0,0 +1,891 @@
+/* arduino_emul.c
+   Copyright 2015 Eric Le Lay
+   This file is part of LecteurAudio.
+
+    LecteurAudio is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LecteurAudio is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LecteurAudio.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The fm_LCD_IR_PI firmware on a pseudo-terminal, to run la with
+   magneto_arduino_serial.o on any machine:
+
+     ./arduino_emul -l /tmp/la-arduino &
+     LA_SERIAL=/tmp/la-arduino ./la_serial
+
+   Like the firmware, one command is executed and acked per 100ms loop,
+   with at most 20 commands (10 strings) waiting, ACK UNFREEZE after 5s
+   without command and a 64 bytes receive buffer that overflows if the
+   line is busy for a whole loop. Both directions are paced at the baud
+   rate.
+
+   The display is printed on stdout whenever it changes. Remote keys
+   (POWER, UP, SETUP, ENTER, ...) are read from stdin, one per line, and
+   sent as input event frames; REPEAT lines after a key emulate holding
+   it.
+   Counters are printed on SIGUSR1 and on exit. The FM radio isn't
+   emulated.
+
+   usage: arduino_emul [-l link] [-b baud] [-t loop_ms] [-q]
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// from fm_LCD_IR_PI.ino
+#define CMD_BUF_LEN 20
+#define CMD_BUF_STR_LEN 10
+#define UNFREEZE_MS 5000
+#define RPI_OFF_MS 10000
+// HardwareSerial buffers
+#define RX_BUFFER 64
+#define TX_BUFFER 64
+#define IR_REPEAT_GAP 250
+#define IR_REPEAT_CODE 0xFFFFFFFF
+#define IR_FRAME_SOH 0x01
+#define IR_FRAME_LEN 12
+#define IR_FLAG_REPEAT 0x01
+// HD44780 memory per row, 16 are visible
+#define LCD_DDRAM 40
+#define LCD_COLS 16
+
+#define TX_QUEUE 4096
+#define IR_QUEUE 16
+
+typedef enum {
+	CLEAR,
+	GO,
+	PC,
+	PS,
+	OFF
+} Cmd;
+
+typedef enum {
+	S_WAITING,
+	S_PI,
+	S_PRINT_CHAR,
+	S_PRINT_STRING,
+	S_GO,
+	S_CLEAR,
+	S_CHAR,
+	S_OFF,
+	S_D_1_1,
+	S_D_1_2,
+	S_D_2_1,
+	S_D_2_2,
+	S_ERROR
+} SerialState;
+
+typedef struct {
+	char c;
+	char row;
+	Cmd cmd;
+	// for the stats only
+	long valid_us;
+} Command;
+
+typedef struct {
+	unsigned long loops;
+	unsigned long commands;
+	unsigned long acks;
+	unsigned long unfreezes;
+	unsigned long rejected;
+	unsigned long overruns;
+	unsigned long ir;
+	unsigned long bytes_in;
+	unsigned long bytes_out;
+	unsigned long max_pending;
+	long ack_wait_us;
+	long max_ack_wait_us;
+} EmulStats;
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t stats_flag = 0;
+
+static int master = -1;
+static long byte_us;
+static long loop_us = 100000;
+static bool quiet = false;
+static EmulStats stats;
+
+// wire and HardwareSerial
+static unsigned char rx_buf[RX_BUFFER];
+static size_t rx_read = 0, rx_len = 0;
+static long rx_last_us = 0;
+static bool rx_busy = false;
+static char tx_buf[TX_QUEUE];
+static size_t tx_len = 0;
+static long tx_last_us = 0;
+
+// firmware
+static Command cmd_buf[CMD_BUF_LEN];
+static int cmd_buf_read = 0, cmd_buf_write = 0;
+static bool cmd_buf_full = false;
+static char cmd_buf_str[CMD_BUF_STR_LEN][LCD_DDRAM + 1];
+static int cmd_buf_str_avail = CMD_BUF_STR_LEN;
+static int cmd_buf_str_write = 0;
+static SerialState serial_state = S_WAITING;
+static long last_acked_us = 0;
+static long rpi_off_us = 0;
+static bool rpi = false;
+
+typedef struct {
+	const char* name;
+	uint32_t code;
+} IrKey;
+
+static const IrKey* ir_queue[IR_QUEUE];
+static bool keys_open = true;
+static size_t ir_read = 0, ir_len = 0;
+
+static char ddram[2][LCD_DDRAM];
+static int lcd_col = 0, lcd_row = 0;
+static bool lcd_dirty = true;
+static long start_us;
+
+static const IrKey keys[] = {
+	{"POWER", 0x1FE48B7}, {"UP", 0x1FE58A7}, {"SETUP", 0x1FE7887},
+	{"LEFT", 0x1FE807F}, {"ENTER", 0x1FE40BF}, {"RIGHT", 0x1FEC03F},
+	{"CARD", 0x1FE20DF}, {"DOWN", 0x1FEA05F}, {"ROTATE", 0x1FE609F},
+	{"PHOTO", 0x1FEE01F}, {"SLIDE", 0x1FE10EF}, {"STOP", 0x1FE906F},
+	{"MUSIC", 0x1FE50AF}, {"EXIT", 0x1FED827}, {"VOL+", 0x1FEF807},
+	{"VIDEO", 0x1FE30CF}, {"ZOOM", 0x1FEB04F}, {"VOL-", 0x1FE708F},
+	// the NEC repeat code of a held key
+	{"REPEAT", IR_REPEAT_CODE},
+	{NULL, 0}
+};
+static long last_ir_ms = 0;
+static uint32_t last_ir_code = 0;
+static uint8_t ir_seq = 0;
+
+static long
+now_us()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+static void
+on_signal(int sig)
+{
+	if(sig == SIGUSR1)
+	{
+		stats_flag = 1;
+	}
+	else
+	{
+		running = 0;
+	}
+}
+
+static void
+serial_print(const char* format, ...)
+{
+	va_list args;
+	int len;
+
+	va_start(args, format);
+	len = vsnprintf(tx_buf + tx_len, sizeof(tx_buf) - tx_len, format, args);
+	va_end(args);
+	if(len >= sizeof(tx_buf) - tx_len)
+	{
+		// la isn't reading at all
+		len = sizeof(tx_buf) - tx_len - 1;
+	}
+	tx_len += len;
+}
+
+static void
+lcd_print(const char* str, size_t len)
+{
+	size_t i;
+
+	for(i=0;i<len;i++)
+	{
+		// the address counter goes from the end of a row to the other one
+		if(lcd_col >= LCD_DDRAM)
+		{
+			lcd_col = 0;
+			lcd_row = !lcd_row;
+		}
+		ddram[lcd_row][lcd_col++] = str[i];
+	}
+	lcd_dirty = true;
+}
+
+static void
+lcd_clear()
+{
+	memset(ddram, ' ', sizeof(ddram));
+	lcd_col = lcd_row = 0;
+	lcd_dirty = true;
+}
+
+static void
+lcd_render(long now)
+{
+	char rows[2][LCD_COLS + 1];
+	int r, c;
+
+	if(quiet || !lcd_dirty)
+	{
+		return;
+	}
+	for(r=0;r<2;r++)
+	{
+		for(c=0;c<LCD_COLS;c++)
+		{
+			rows[r][c] = (ddram[r][c] >= ' ' && ddram[r][c] < 127) ? ddram[r][c] : '?';
+		}
+		rows[r][LCD_COLS] = '\0';
+	}
+	printf("%9.3f |%s|%s|\n", (now - start_us) / 1000000.0, rows[0], rows[1]);
+	fflush(stdout);
+	lcd_dirty = false;
+}
+
+static void
+print_stats(FILE* f)
+{
+	fprintf(f, "loops: %lu\n", stats.loops);
+	fprintf(f, "commands: %lu\n", stats.commands);
+	fprintf(f, "acks: %lu\n", stats.acks);
+	fprintf(f, "unfreezes: %lu\n", stats.unfreezes);
+	fprintf(f, "rejected: %lu\n", stats.rejected);
+	fprintf(f, "rx overruns: %lu\n", stats.overruns);
+	fprintf(f, "ir: %lu\n", stats.ir);
+	fprintf(f, "bytes in: %lu\n", stats.bytes_in);
+	fprintf(f, "bytes out: %lu\n", stats.bytes_out);
+	fprintf(f, "max pending: %lu\n", stats.max_pending);
+	fprintf(f, "ack wait avg: %.1fms\n", stats.acks ? stats.ack_wait_us / 1000.0 / stats.acks : 0.0);
+	fprintf(f, "ack wait max: %.1fms\n", stats.max_ack_wait_us / 1000.0);
+	fflush(f);
+}
+
+// bytes come from the pty at the line speed, into the 64 bytes buffer
+static void
+rx_pump(long now)
+{
+	unsigned char in[256];
+	long credit;
+	ssize_t len;
+	ssize_t i;
+
+	if(!rx_busy)
+	{
+		// poll() woke up on the first byte of a burst
+		rx_last_us = now - byte_us;
+	}
+	credit = (now - rx_last_us) / byte_us;
+	if(credit <= 0)
+	{
+		return;
+	}
+	if(credit > sizeof(in))
+	{
+		credit = sizeof(in);
+	}
+
+	len = read(master, in, credit);
+	if(len <= 0)
+	{
+		// idle line
+		rx_busy = false;
+		return;
+	}
+	rx_busy = len == credit;
+	rx_last_us += len * byte_us;
+
+	stats.bytes_in += len;
+	for(i=0;i<len;i++)
+	{
+		if(rx_len == RX_BUFFER)
+		{
+			stats.overruns++;
+			continue;
+		}
+		rx_buf[(rx_read + rx_len) % RX_BUFFER] = in[i];
+		rx_len++;
+	}
+}
+
+static void
+tx_pump(long now)
+{
+	long credit;
+	ssize_t len;
+
+	if(tx_len == 0)
+	{
+		tx_last_us = now;
+		return;
+	}
+	credit = (now - tx_last_us) / byte_us;
+	if(credit <= 0)
+	{
+		return;
+	}
+	if(credit > tx_len)
+	{
+		credit = tx_len;
+	}
+
+	len = write(master, tx_buf, credit);
+	if(len <= 0)
+	{
+		// la isn't there: the bytes are lost like on the real line
+		len = credit;
+	}
+	else
+	{
+		stats.bytes_out += len;
+	}
+	memmove(tx_buf, tx_buf + len, tx_len - len);
+	tx_len -= len;
+	tx_last_us += len * byte_us;
+}
+
+static void
+valid_cmd(long now)
+{
+	size_t pending;
+
+	serial_print("%i VALID %i\r\n", cmd_buf_write, cmd_buf[cmd_buf_write].cmd);
+	cmd_buf[cmd_buf_write].valid_us = now;
+	cmd_buf_write = (cmd_buf_write + 1) % CMD_BUF_LEN;
+	cmd_buf_full = cmd_buf_write == cmd_buf_read;
+	stats.commands++;
+
+	pending = cmd_buf_full ? CMD_BUF_LEN : (cmd_buf_write - cmd_buf_read + CMD_BUF_LEN) % CMD_BUF_LEN;
+	if(pending > stats.max_pending)
+	{
+		stats.max_pending = pending;
+	}
+}
+
+static void
+serial_error(const char* message, char in)
+{
+	if(in)
+	{
+		serial_print("%s%c\r\n", message, in);
+	}
+	else
+	{
+		serial_print("%s\r\n", message);
+	}
+	stats.rejected++;
+	serial_state = S_ERROR;
+}
+
+// serialEvent() of the firmware
+static void
+serial_event(long now)
+{
+	Command* cmd;
+	char* str;
+	size_t len;
+	char in;
+
+	while(rx_len > 0)
+	{
+		in = rx_buf[rx_read];
+		rx_read = (rx_read + 1) % RX_BUFFER;
+		rx_len--;
+		cmd = &cmd_buf[cmd_buf_write];
+
+		switch(serial_state)
+		{
+		case S_WAITING:
+			if(in == 'P')
+			{
+				serial_state = S_PI;
+			}
+			break;
+		case S_PI:
+			if(cmd_buf_full)
+			{
+				serial_error("cmd_buf full", 0);
+			}
+			else if(in == 'C')
+			{
+				serial_state = S_PRINT_CHAR;
+				cmd->cmd = PC;
+			}
+			else if(in == 'S')
+			{
+				if(cmd_buf_str_avail > 0)
+				{
+					serial_state = S_PRINT_STRING;
+					cmd->cmd = PS;
+					cmd->c = cmd_buf_str_write;
+					cmd_buf_str[cmd_buf_str_write][0] = '\0';
+				}
+				else
+				{
+					serial_error("cmd_buf_str full", 0);
+				}
+			}
+			else if(in == 'G')
+			{
+				serial_state = S_GO;
+				cmd->cmd = GO;
+			}
+			else if(in == 'L')
+			{
+				serial_state = S_CLEAR;
+				cmd->cmd = CLEAR;
+			}
+			else if(in == 'F')
+			{
+				serial_state = S_OFF;
+				cmd->cmd = OFF;
+			}
+			else
+			{
+				serial_error("Invalid CMD ", in);
+			}
+			break;
+		case S_PRINT_CHAR:
+			cmd->c = in;
+			serial_state = S_CHAR;
+			break;
+		case S_PRINT_STRING:
+			if(in == '\n')
+			{
+				cmd_buf_str_write = (cmd_buf_str_write + 1) % CMD_BUF_STR_LEN;
+				cmd_buf_str_avail--;
+				valid_cmd(now);
+				serial_state = S_WAITING;
+			}
+			else
+			{
+				str = cmd_buf_str[cmd_buf_str_write];
+				len = strlen(str);
+				if(len < LCD_DDRAM)
+				{
+					str[len] = in;
+					str[len + 1] = '\0';
+				}
+			}
+			break;
+		case S_GO:
+		case S_D_1_1:
+		case S_D_1_2:
+		case S_D_2_1:
+			if(in < '0' || in > '9')
+			{
+				serial_error(serial_state == S_GO ? "Invalid D1_1 "
+					: serial_state == S_D_1_1 ? "Invalid D1_2 "
+					: serial_state == S_D_1_2 ? "Invalid D2_1 " : "Invalid D2_2 ", in);
+			}
+			else if(serial_state == S_GO)
+			{
+				cmd->c = in - '0';
+				serial_state = S_D_1_1;
+			}
+			else if(serial_state == S_D_1_1)
+			{
+				cmd->c = cmd->c * 10 + in - '0';
+				serial_state = S_D_1_2;
+			}
+			else if(serial_state == S_D_1_2)
+			{
+				cmd->row = in - '0';
+				serial_state = S_D_2_1;
+			}
+			else
+			{
+				cmd->row = cmd->row * 10 + in - '0';
+				serial_state = S_D_2_2;
+			}
+			break;
+		case S_CLEAR:
+		case S_OFF:
+		case S_CHAR:
+		case S_D_2_2:
+			if(in == '\n')
+			{
+				valid_cmd(now);
+				serial_state = S_WAITING;
+			}
+			else
+			{
+				serial_error("Invalid \\n ", in);
+			}
+			break;
+		case S_ERROR:
+		default:
+			if(in == '\n')
+			{
+				serial_state = S_WAITING;
+			}
+		}
+	}
+}
+
+static void
+serial_write(const uint8_t* data, size_t len)
+{
+	if(len > sizeof(tx_buf) - tx_len)
+	{
+		len = sizeof(tx_buf) - tx_len;
+	}
+	memcpy(tx_buf + tx_len, data, len);
+	tx_len += len;
+}
+
+static void
+send_ir_event(uint32_t code, uint8_t flags, long ms)
+{
+	uint8_t frame[IR_FRAME_LEN];
+	int i;
+
+	frame[0] = IR_FRAME_SOH;
+	frame[1] = ir_seq++;
+	frame[2] = flags;
+	for(i=0;i<4;i++)
+	{
+		frame[3 + i] = (code >> (8 * i)) & 0xFF;
+		frame[7 + i] = ((uint32_t)ms >> (8 * i)) & 0xFF;
+	}
+	frame[11] = 0;
+	for(i=1;i<11;i++)
+	{
+		frame[11] ^= frame[i];
+	}
+	serial_write(frame, IR_FRAME_LEN);
+}
+
+static void
+ir_event(long now)
+{
+	const IrKey* key;
+	long ms;
+
+	if(ir_len == 0)
+	{
+		return;
+	}
+	key = ir_queue[ir_read];
+	ir_read = (ir_read + 1) % IR_QUEUE;
+	ir_len--;
+	stats.ir++;
+
+	ms = (now - start_us) / 1000;
+	if(key->code == IR_REPEAT_CODE)
+	{
+		if(ms - last_ir_ms < IR_REPEAT_GAP)
+		{
+			send_ir_event(last_ir_code, IR_FLAG_REPEAT, ms);
+		}
+	}
+	else
+	{
+		if(!strcmp(key->name, "POWER"))
+		{
+			rpi = true;
+		}
+		else if(!strcmp(key->name, "EXIT"))
+		{
+			rpi = false;
+		}
+		send_ir_event(key->code, 0, ms);
+		last_ir_code = key->code;
+	}
+	last_ir_ms = ms;
+}
+
+// loop() of the firmware, without the final delay
+static void
+firmware_loop(long now)
+{
+	Command* cmd;
+	long wait;
+
+	stats.loops++;
+	ir_event(now);
+	serial_event(now);
+
+	if(cmd_buf_full || cmd_buf_read != cmd_buf_write)
+	{
+		cmd = &cmd_buf[cmd_buf_read];
+		serial_print("ACK %i %i %i ", cmd->cmd, cmd_buf_read, cmd_buf_write);
+		last_acked_us = now;
+		if(cmd->cmd == PS)
+		{
+			serial_print("%i %s\r\n", cmd->c, cmd_buf_str[(int)cmd->c]);
+			lcd_print(cmd_buf_str[(int)cmd->c], strlen(cmd_buf_str[(int)cmd->c]));
+			cmd_buf_str_avail++;
+		}
+		else if(cmd->cmd == PC)
+		{
+			lcd_print(&cmd->c, 1);
+			serial_print("%c\r\n", cmd->c);
+		}
+		else if(cmd->cmd == CLEAR)
+		{
+			lcd_clear();
+			serial_print("CLEAR\r\n");
+		}
+		else if(cmd->cmd == OFF)
+		{
+			rpi_off_us = now;
+			serial_print("OFF\r\n");
+		}
+		else if(cmd->cmd == GO)
+		{
+			if(cmd->c < LCD_DDRAM)
+			{
+				lcd_col = cmd->c;
+				lcd_row = cmd->row ? 1 : 0;
+			}
+			serial_print("GO %i %i\r\n", cmd->c, cmd->row);
+		}
+
+		wait = now - cmd->valid_us;
+		stats.acks++;
+		stats.ack_wait_us += wait;
+		if(wait > stats.max_ack_wait_us)
+		{
+			stats.max_ack_wait_us = wait;
+		}
+		cmd_buf_read = (cmd_buf_read + 1) % CMD_BUF_LEN;
+		cmd_buf_full = false;
+	}
+	else
+	{
+		if(now - last_acked_us > UNFREEZE_MS * 1000L)
+		{
+			serial_print("ACK UNFREEZE\r\n");
+			stats.unfreezes++;
+			last_acked_us = now;
+		}
+		if(rpi_off_us > 0 && now - rpi_off_us > RPI_OFF_MS * 1000L)
+		{
+			serial_print("RPI IS OFF\r\n");
+			rpi_off_us = 0;
+		}
+	}
+}
+
+static void
+read_keys()
+{
+	static char line[64];
+	static size_t line_len = 0;
+	ssize_t len;
+	char* nl;
+	int i;
+
+	len = read(STDIN_FILENO, line + line_len, sizeof(line) - line_len - 1);
+	if(len <= 0)
+	{
+		keys_open = false;
+		return;
+	}
+	line_len += len;
+	line[line_len] = '\0';
+
+	while((nl = strchr(line, '\n')) != NULL)
+	{
+		*nl = '\0';
+		for(i=0;keys[i].name!=NULL && strcasecmp(keys[i].name, line);i++);
+		if(keys[i].name == NULL)
+		{
+			if(*line != '\0')
+			{
+				fprintf(stderr, "E: unknown key %s\n", line);
+			}
+		}
+		else if(ir_len < IR_QUEUE)
+		{
+			ir_queue[(ir_read + ir_len) % IR_QUEUE] = keys + i;
+			ir_len++;
+		}
+		line_len -= nl + 1 - line;
+		memmove(line, nl + 1, line_len + 1);
+	}
+	if(line_len == sizeof(line) - 1)
+	{
+		line_len = 0;
+	}
+}
+
+static int
+open_pty(const char* link)
+{
+	struct termios options;
+	const char* name;
+	int slave;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if(master == -1 || grantpt(master) || unlockpt(master) || (name = ptsname(master)) == NULL)
+	{
+		perror("E: pty");
+		return -1;
+	}
+
+	// kept open so that la can close and reopen it, and raw so that
+	// nothing is echoed before la sets it up
+	slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if(slave == -1 || tcgetattr(slave, &options))
+	{
+		perror("E: pty slave");
+		return -1;
+	}
+	cfmakeraw(&options);
+	tcsetattr(slave, TCSANOW, &options);
+
+	if(link != NULL)
+	{
+		unlink(link);
+		if(symlink(name, link))
+		{
+			perror("E: link");
+			return -1;
+		}
+	}
+	fprintf(stderr, "arduino on %s\n", name);
+	return 0;
+}
+
+static int
+usage(const char* progname)
+{
+	fprintf(stderr, "usage: %s [-l link] [-b baud] [-t loop_ms] [-q]\n", progname);
+	return 1;
+}
+
+int
+main(int argc, char** argv)
+{
+	struct pollfd pfds[2];
+	struct sigaction sa = {{0}};
+	const char* link = NULL;
+	long baud = 9600;
+	long next_loop;
+	long timeout;
+	long now;
+	int opt;
+
+	while((opt = getopt(argc, argv, "l:b:t:q")) != -1)
+	{
+		switch(opt)
+		{
+		case 'l':
+			link = optarg;
+			break;
+		case 'b':
+			baud = atol(optarg);
+			break;
+		case 't':
+			loop_us = atol(optarg) * 1000L;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+	if(baud <= 0 || loop_us <= 0)
+	{
+		return usage(argv[0]);
+	}
+	// 8N1: 10 bits per byte
+	byte_us = 10000000L / baud;
+
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	if(open_pty(link))
+	{
+		return 1;
+	}
+
+	start_us = now_us();
+	rx_last_us = tx_last_us = last_acked_us = start_us;
+	lcd_clear();
+	serial_print("\r\n\r\nD: FM + LCD + IR\r\n");
+	serial_print("D: Radio ON.\r\n");
+	serial_print("D: IR ON.\r\n");
+	next_loop = start_us;
+
+	while(running)
+	{
+		now = now_us();
+		rx_pump(now);
+		tx_pump(now);
+
+		if(now >= next_loop)
+		{
+			firmware_loop(now);
+			lcd_render(now);
+			// Serial.print blocks while its buffer is full, then delay(100)
+			next_loop = now + loop_us;
+			if(tx_len > TX_BUFFER)
+			{
+				next_loop += (tx_len - TX_BUFFER) * byte_us;
+			}
+		}
+
+		if(stats_flag)
+		{
+			stats_flag = 0;
+			print_stats(stderr);
+		}
+
+		timeout = next_loop - now;
+		if((tx_len > 0 || rx_busy) && timeout > 8 * byte_us)
+		{
+			timeout = 8 * byte_us;
+		}
+		pfds[0].fd = master;
+		pfds[0].events = rx_busy ? 0 : POLLIN;
+		pfds[1].fd = keys_open ? STDIN_FILENO : -1;
+		pfds[1].events = POLLIN;
+		if(poll(pfds, 2, (timeout + 999) / 1000) == -1 && errno != EINTR)
+		{
+			perror("E: poll");
+			break;
+		}
+		if(pfds[1].revents & (POLLIN | POLLHUP))
+		{
+			read_keys();
+		}
+	}
+
+	print_stats(stderr);
+	if(link != NULL)
+	{
+		unlink(link);
+	}
+	return 0;
+}
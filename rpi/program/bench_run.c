@@ -0,0 +1,485 @@
+/* bench_run.c
+   Copyright 2015 Eric Le Lay
+   This file is part of LecteurAudio.
+
+    LecteurAudio is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LecteurAudio is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LecteurAudio.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Offline benchmark (make bench): starts mock_mpd and la_bench (la with
+   the headless backend), replays key sequences and reports, for each
+   action, the wall time, the mpd commands and bytes, the display writes
+   and the heap allocations made by the key handlers.
+
+   usage: bench_run [-l latency_ms] [-n library_size] [-f script] [-z action]... [-v]
+
+   A script has one action per line: <name> <KEY> <KEY>...
+   A key written mpd:<command>, e.g. mpd:seekcur:30, is instead sent to
+   mock_mpd as another client would (colons for spaces), for la to
+   redraw from the idle event it gets.
+   The allocations of an action are those of its key handlers and of
+   the rest of la's event loop until SETTLE_MS after the last key, idle
+   events and timers included. The actions given with -z fail the run if
+   they allocate at all.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define ACK_FD 3
+#define ACK_TIMEOUT_MS 10000
+// lets the idle notifications of an action arrive before the next one
+#define SETTLE_MS 20
+#define LOG_FILE "la_bench.log"
+
+#define MAX_ZERO_ALLOC 8
+
+// frames only redraws the menu, entered from the playing state;
+// playing is the steady state of the episode resumed just before: the
+// clock redrawn on pause and seeks, then a volume change
+static const char* default_script =
+	"browse MENU DOWN OK DOWN DOWN OK DOWN DOWN DOWN MENU MENU MENU\n"
+	"resume MENU OK DOWN OK\n"
+	"playing mpd:pause:1 mpd:seekcur:30 mpd:seekcur:31 mpd:pause:0 MENU DOWN DOWN OK RIGHT LEFT MENU MENU\n"
+	"radio RADIO_1 RADIO_2 RADIO_3 RADIO_1\n"
+	"frames MENU DOWN DOWN DOWN UP UP DOWN UP\n"
+	"stop STOP\n"
+	"volume MENU DOWN DOWN OK RIGHT RIGHT LEFT MENU MENU\n";
+
+typedef struct {
+	unsigned long commands;
+	unsigned long bytes_in;
+	unsigned long bytes_out;
+} MpdStats;
+
+static char socket_path[108];
+static pid_t mock_pid = -1;
+static pid_t la_pid = -1;
+static int keys_fd = -1;
+static FILE* acks = NULL;
+static FILE* mpd = NULL;
+static bool verbose = false;
+static const char* zero_alloc[MAX_ZERO_ALLOC];
+static int zero_alloc_count = 0;
+
+static double
+now_ms()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+static void
+sleep_ms(long ms)
+{
+	struct timespec delay = { ms / 1000, (ms % 1000) * 1000000L };
+
+	nanosleep(&delay, NULL);
+}
+
+static void
+cleanup()
+{
+	if(la_pid > 0)
+	{
+		kill(la_pid, SIGTERM);
+		waitpid(la_pid, NULL, 0);
+	}
+	if(mock_pid > 0)
+	{
+		kill(mock_pid, SIGTERM);
+		waitpid(mock_pid, NULL, 0);
+	}
+	unlink(socket_path);
+}
+
+static FILE*
+connect_mock()
+{
+	struct sockaddr_un sa = {0};
+	char line[128];
+	FILE* f;
+	int fd;
+	int i;
+
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, socket_path);
+
+	for(i=0;i<500;i++)
+	{
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == 0)
+		{
+			f = fdopen(fd, "r+");
+			if(fgets(line, sizeof(line), f) == NULL || strncmp(line, "OK MPD", 6))
+			{
+				fprintf(stderr, "E: unexpected greeting from mock_mpd\n");
+				fclose(f);
+				return NULL;
+			}
+			return f;
+		}
+		close(fd);
+		sleep_ms(10);
+	}
+	fprintf(stderr, "E: mock_mpd didn't start\n");
+	return NULL;
+}
+
+static int
+mpd_stats(MpdStats* stats)
+{
+	char line[128];
+
+	fprintf(mpd, "x-bench-stats\n");
+	fflush(mpd);
+	while(fgets(line, sizeof(line), mpd) != NULL)
+	{
+		if(!strncmp(line, "OK", 2))
+		{
+			return 0;
+		}
+		sscanf(line, "commands: %lu", &stats->commands);
+		sscanf(line, "bytes_in: %lu", &stats->bytes_in);
+		sscanf(line, "bytes_out: %lu", &stats->bytes_out);
+	}
+	fprintf(stderr, "E: mock_mpd is gone\n");
+	return -1;
+}
+
+static pid_t
+spawn(char* const argv[], int stdin_fd, int ack_fd)
+{
+	pid_t pid;
+	int log_fd;
+
+	pid = fork();
+	if(pid == 0)
+	{
+		log_fd = open(LOG_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if(stdin_fd != -1)
+		{
+			dup2(stdin_fd, STDIN_FILENO);
+		}
+		if(ack_fd != -1)
+		{
+			dup2(ack_fd, ACK_FD);
+		}
+		dup2(log_fd, STDOUT_FILENO);
+		dup2(log_fd, STDERR_FILENO);
+		execv(argv[0], argv);
+		fprintf(stderr, "E: unable to run %s: %s\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+	return pid;
+}
+
+// a command of another mpd client, mpd:<command>
+static int
+send_mpd(const char* key, double* wall_ms)
+{
+	char line[128];
+	char* c;
+	double start;
+
+	snprintf(line, sizeof(line), "%s\n", key + 4);
+	for(c=line;*c!='\0';c++)
+	{
+		if(*c == ':')
+		{
+			*c = ' ';
+		}
+	}
+	start = now_ms();
+	fputs(line, mpd);
+	fflush(mpd);
+	while(fgets(line, sizeof(line), mpd) != NULL)
+	{
+		if(!strncmp(line, "OK", 2))
+		{
+			// what la does with the event
+			sleep_ms(SETTLE_MS);
+			*wall_ms = now_ms() - start;
+			if(verbose)
+			{
+				printf("  %-12s %8.2fms\n", key, *wall_ms);
+			}
+			return 0;
+		}
+		if(!strncmp(line, "ACK", 3))
+		{
+			fprintf(stderr, "E: %s: %s", key, line);
+			return -1;
+		}
+	}
+	fprintf(stderr, "E: mock_mpd is gone\n");
+	return -1;
+}
+
+// sends a key and waits for its ack, returns the display writes or -1;
+// allocs gets those of the handler and of the loop since the last ack
+static long
+send_key(const char* key, double* wall_ms, long* allocs)
+{
+	struct pollfd pfd;
+	char line[256];
+	double start;
+	long writes = 0;
+	long us = 0;
+	long loop_allocs = 0;
+	int ret = 0;
+
+	start = now_ms();
+	if(dprintf(keys_fd, "%s\n", key) < 0)
+	{
+		perror("E: send key");
+		return -1;
+	}
+
+	pfd.fd = fileno(acks);
+	pfd.events = POLLIN;
+	if(poll(&pfd, 1, ACK_TIMEOUT_MS) != 1 || fgets(line, sizeof(line), acks) == NULL)
+	{
+		fprintf(stderr, "E: no ack for %s\n", key);
+		return -1;
+	}
+	*wall_ms = now_ms() - start;
+
+	sscanf(line, "ack %i %li %li %li %li", &ret, &writes, &us, allocs, &loop_allocs);
+	if(verbose)
+	{
+		printf("  %-12s %8.2fms %3li writes %3li+%li allocs => %i %s", key, *wall_ms, writes, *allocs, loop_allocs, ret, strchr(line, '|'));
+	}
+	*allocs += loop_allocs;
+	return writes;
+}
+
+static int
+run_action(char* line)
+{
+	MpdStats before = {0}, after = {0};
+	char* saveptr;
+	char* name;
+	char* key;
+	double total = 0;
+	double max = 0;
+	double wall;
+	long writes = 0;
+	long allocs = 0;
+	long a = 0;
+	long w;
+	int keys = 0;
+	int i;
+
+	name = strtok_r(line, " \t\n", &saveptr);
+	if(name == NULL || *name == '#')
+	{
+		return 0;
+	}
+
+	// what the loop did before the action isn't counted
+	if(send_key("NOP", &wall, &a) < 0 || mpd_stats(&before))
+	{
+		return -1;
+	}
+	while((key = strtok_r(NULL, " \t\n", &saveptr)) != NULL)
+	{
+		if(!strncmp(key, "mpd:", 4))
+		{
+			if(send_mpd(key, &wall))
+			{
+				return -1;
+			}
+			total += wall;
+			max = wall > max ? wall : max;
+			continue;
+		}
+		w = send_key(key, &wall, &a);
+		if(w < 0)
+		{
+			return -1;
+		}
+		writes += w;
+		allocs += a;
+		total += wall;
+		max = wall > max ? wall : max;
+		keys++;
+	}
+	sleep_ms(SETTLE_MS);
+	if(mpd_stats(&after))
+	{
+		return -1;
+	}
+	// the idle events and timers handled after the last key
+	if(send_key("NOP", &wall, &a) < 0)
+	{
+		return -1;
+	}
+	allocs += a;
+
+	printf("%-10s %4i %9.2f %9.2f %8lu %9lu %9lu %6li %6li\n", name, keys, total, max,
+		after.commands - before.commands,
+		after.bytes_in - before.bytes_in,
+		after.bytes_out - before.bytes_out,
+		writes, allocs);
+	fflush(stdout);
+
+	for(i=0;i<zero_alloc_count;i++)
+	{
+		if(!strcmp(zero_alloc[i], name) && allocs != 0)
+		{
+			fprintf(stderr, "E: %s made %li allocations, expected none\n", name, allocs);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+usage(const char* progname)
+{
+	fprintf(stderr, "usage: %s [-l latency_ms] [-n library_size] [-f script] [-z action]... [-v]\n", progname);
+	return 1;
+}
+
+int
+main(int argc, char** argv)
+{
+	char* mock_argv[] = { "./mock_mpd", "-s", socket_path, "-l", "0", "-n", "500", NULL };
+	char* la_argv[] = { "./la_bench", NULL };
+	MpdStats before = {0}, after = {0};
+	char* script = NULL;
+	char* line = NULL;
+	size_t line_len = 0;
+	FILE* f;
+	int keys_pipe[2];
+	int acks_pipe[2];
+	double start;
+	double wall;
+	long allocs;
+	int opt;
+	int ret = 0;
+
+	while((opt = getopt(argc, argv, "l:n:f:z:v")) != -1)
+	{
+		switch(opt)
+		{
+		case 'l':
+			mock_argv[4] = optarg;
+			break;
+		case 'n':
+			mock_argv[6] = optarg;
+			break;
+		case 'f':
+			script = optarg;
+			break;
+		case 'z':
+			if(zero_alloc_count == MAX_ZERO_ALLOC)
+			{
+				return usage(argv[0]);
+			}
+			zero_alloc[zero_alloc_count++] = optarg;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	if(script != NULL)
+	{
+		f = fopen(script, "r");
+	}
+	else
+	{
+		f = fmemopen((void*)default_script, strlen(default_script), "r");
+	}
+	if(f == NULL)
+	{
+		perror("E: script");
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	snprintf(socket_path, sizeof(socket_path), "/tmp/la-bench-%i.sock", getpid());
+	unlink(LOG_FILE);
+
+	mock_pid = spawn(mock_argv, -1, -1);
+	mpd = connect_mock();
+	if(mpd == NULL)
+	{
+		cleanup();
+		return 1;
+	}
+
+	if(pipe2(keys_pipe, O_CLOEXEC) || pipe2(acks_pipe, O_CLOEXEC))
+	{
+		perror("E: pipe");
+		cleanup();
+		return 1;
+	}
+	setenv("MPD_HOST", socket_path, 1);
+	la_pid = spawn(la_argv, keys_pipe[0], acks_pipe[1]);
+	close(keys_pipe[0]);
+	close(acks_pipe[1]);
+	keys_fd = keys_pipe[1];
+	acks = fdopen(acks_pipe[0], "r");
+
+	printf("mpd latency %sms, %s songs, la logs in %s\n", mock_argv[4], mock_argv[6], LOG_FILE);
+	printf("%-10s %4s %9s %9s %8s %9s %9s %6s %6s\n",
+		"action", "keys", "wall ms", "max ms", "mpd cmds", "bytes in", "bytes out", "writes", "allocs");
+
+	// the first ack comes once la is in its event loop
+	start = now_ms();
+	if(send_key("NOP", &wall, &allocs) < 0)
+	{
+		cleanup();
+		return 1;
+	}
+	sleep_ms(SETTLE_MS);
+	mpd_stats(&after);
+	printf("%-10s %4i %9.2f %9.2f %8lu %9lu %9lu %6s %6s\n", "startup", 0, now_ms() - start - SETTLE_MS, 0.0,
+		after.commands - before.commands, after.bytes_in - before.bytes_in,
+		after.bytes_out - before.bytes_out, "-", "-");
+
+	while(ret == 0 && getline(&line, &line_len, f) > 0)
+	{
+		ret = run_action(line);
+	}
+	free(line);
+	fclose(f);
+
+	dprintf(keys_fd, "QUIT\n");
+	close(keys_fd);
+	waitpid(la_pid, NULL, 0);
+	la_pid = -1;
+	cleanup();
+
+	return ret ? 1 : 0;
+}
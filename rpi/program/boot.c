@@ -0,0 +1,81 @@
+#include "boot.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_PHASES 16
+
+typedef struct {
+	const char* phase;
+	long ms;
+} BootMark;
+
+static struct timespec boot_start;
+static BootMark boot_marks[MAX_PHASES];
+static int boot_marks_count = 0;
+
+static long
+since_start()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - boot_start.tv_sec) * 1000
+		+ (now.tv_nsec - boot_start.tv_nsec) / 1000000;
+}
+
+void
+la_boot_start()
+{
+	clock_gettime(CLOCK_MONOTONIC, &boot_start);
+	boot_marks_count = 0;
+}
+
+// only the first occurrence of a phase counts, so that it can be called
+// from code which runs again long after startup
+void
+la_boot_mark(const char* phase)
+{
+	long ms;
+	long previous;
+	int i;
+
+	if(boot_marks_count == MAX_PHASES)
+	{
+		return;
+	}
+	for(i=0;i<boot_marks_count;i++)
+	{
+		if(!strcmp(boot_marks[i].phase, phase))
+		{
+			return;
+		}
+	}
+
+	ms = since_start();
+	previous = boot_marks_count > 0 ? boot_marks[boot_marks_count - 1].ms : 0;
+	boot_marks[boot_marks_count].phase = phase;
+	boot_marks[boot_marks_count].ms = ms;
+	boot_marks_count++;
+
+	LOG_I("boot %s at %lims (+%lims)", phase, ms, ms - previous);
+}
+
+void
+la_boot_summary()
+{
+	char line[256];
+	size_t len = 0;
+	int i;
+
+	for(i=0;i<boot_marks_count && len < sizeof(line);i++)
+	{
+		len += snprintf(line + len, sizeof(line) - len, " %s=%li",
+			boot_marks[i].phase, boot_marks[i].ms);
+	}
+	line[len < sizeof(line) ? len : sizeof(line) - 1] = '\0';
+	LOG_I("boot timeline (ms):%s", boot_marks_count > 0 ? line : " none");
+	fflush(stdout);
+}
@@ -0,0 +1,8 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+void la_boot_start();
+void la_boot_mark(const char* phase);
+void la_boot_summary();
+
+#endif        //  #ifndef BOOT_H
@@ -10,8 +10,8 @@ char* DEBUG_CONTROLS[LA_CONTROL_LENGTH] = {
 	"LA_OK",
 	"LA_STOP",
 	"LA_EXIT",
-	"LA_RADIO_INTER",
-	"LA_RADIO_RENNES",
-	"LA_RADIO_CANALB",
+	"LA_RADIO_1",
+	"LA_RADIO_2",
+	"LA_RADIO_3",
 	"LA_PODCAST_DEGUSTER"
 };
@@ -3,12 +3,14 @@
 
 typedef enum {
 	LA_PLAYPAUSE, LA_UP, LA_DOWN, LA_LEFT, LA_RIGHT, LA_MENU, LA_OK, LA_STOP, LA_EXIT,
-	LA_RADIO_INTER, LA_RADIO_RENNES, LA_RADIO_CANALB,
+	LA_RADIO_1, LA_RADIO_2, LA_RADIO_3,
 	LA_PODCAST_DEGUSTER,
 	LA_CONTROL_LENGTH
 } Control;
 
-typedef int (*Callback)(Control control, void* param);
+// steps: how many times the key was pressed, or repeated while held,
+// since the previous call
+typedef int (*Callback)(Control control, int steps, void* param);
 
 int la_init_controls(int** fdControls, int* fdControlCount);
 void la_on_key(Control, Callback fn, void* param);
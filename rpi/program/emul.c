@@ -161,7 +161,7 @@ _la_control_input_one()
 	}
 	if(callbacks[c] != NULL)
 	{
-		return callbacks[c](c, callback_params[c]);
+		return callbacks[c](c, 1, callback_params[c]);
 	}
 	return 0;
 }
@@ -0,0 +1,266 @@
+#include "episodes.h"
+#include "resume_index.h"
+#include "pool.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpd/client.h>
+
+/* Episodes of the directory being listened to, in mpd's order, with
+   their duration. It is read by the pool once an episode starts; with
+   the positions of the resume index, picking the next one near the end
+   of the current episode costs no round trip. */
+
+typedef struct {
+	char* uri;
+	unsigned duration;
+} Episode;
+
+// a listing read by the pool, with its own copy of the directory
+typedef struct {
+	char* dir;
+	Episode* episodes;
+	size_t length;
+} EpisodesJob;
+
+static char* dir = NULL;
+static Episode* episodes = NULL;
+static size_t length = 0;
+
+// the listing of dir while the pool reads it
+static PoolJob* load_job = NULL;
+static EpisodesJob* load_pending = NULL;
+
+static void
+free_list(Episode* list, size_t count)
+{
+	size_t i;
+
+	for(i=0;i<count;i++)
+	{
+		free(list[i].uri);
+	}
+	free(list);
+}
+
+static void
+free_episodes()
+{
+	la_pool_cancel(load_job);
+	load_job = NULL;
+	load_pending = NULL;
+	free_list(episodes, length);
+	episodes = NULL;
+	length = 0;
+	free(dir);
+	dir = NULL;
+}
+
+static Episode*
+find_episode(const char* uri)
+{
+	size_t i;
+
+	for(i=0;i<length;i++)
+	{
+		if(!strcmp(episodes[i].uri, uri))
+		{
+			return episodes + i;
+		}
+	}
+	return NULL;
+}
+
+// returns the saved position, or -1 when finished
+static int
+get_played(const Episode* episode)
+{
+	ResumeRecord record;
+
+	if(!la_resume_index_get(episode->uri, &record))
+	{
+		return 0;
+	}
+	if(episode->duration > 0 && record.played + LA_RESUME_END_MARGIN_SECS >= episode->duration)
+	{
+		return -1;
+	}
+	return record.played;
+}
+
+// in a pool thread, with its own connection
+static int
+load_work(void* arg)
+{
+	EpisodesJob* j = arg;
+	struct mpd_connection* conn;
+	struct mpd_entity* entity;
+	const struct mpd_song* song;
+	Episode* tmp;
+	size_t size;
+
+	conn = la_pool_mpd();
+	if(conn == NULL)
+	{
+		return -1;
+	}
+
+	if(!mpd_send_list_meta(conn, j->dir))
+	{
+		fprintf(stderr, "E: listing episodes of %s: %s\n", j->dir, mpd_connection_get_error_message(conn));
+		return -1;
+	}
+
+	size = 0;
+	while((entity = mpd_recv_entity(conn)) != NULL)
+	{
+		if(mpd_entity_get_type(entity) == MPD_ENTITY_TYPE_SONG)
+		{
+			if(j->length == size)
+			{
+				size = size ? size * 2 : 16;
+				tmp = realloc(j->episodes, size * sizeof(Episode));
+				if(tmp == NULL)
+				{
+					perror("E: episodes");
+					mpd_entity_free(entity);
+					break;
+				}
+				j->episodes = tmp;
+			}
+			song = mpd_entity_get_song(entity);
+			j->episodes[j->length].uri = strdup(mpd_song_get_uri(song));
+			j->episodes[j->length].duration = mpd_song_get_duration(song);
+			j->length++;
+		}
+		mpd_entity_free(entity);
+	}
+
+	mpd_response_finish(conn);
+	if(mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS)
+	{
+		// a directory gone from the database is no reason to reconnect,
+		// the pool clears the error before its next use
+		fprintf(stderr, "E: listing episodes of %s: %s\n", j->dir, mpd_connection_get_error_message(conn));
+		return -1;
+	}
+	return 0;
+}
+
+static void
+load_done(void* arg, int ret, bool cancelled)
+{
+	EpisodesJob* j = arg;
+
+	if(j == load_pending)
+	{
+		load_job = NULL;
+		load_pending = NULL;
+		if(ret == 0 && !cancelled)
+		{
+			episodes = j->episodes;
+			length = j->length;
+			j->episodes = NULL;
+			j->length = 0;
+			LOG_D("%zu episodes in %s", length, dir);
+		}
+		// else no episode until the directory or the database changes
+	}
+	free_list(j->episodes, j->length);
+	free(j->dir);
+	free(j);
+}
+
+void
+la_episodes_load(const char* uri)
+{
+	EpisodesJob* j;
+	const char* slash;
+	size_t dir_len;
+
+	// streams have no directory
+	slash = strrchr(uri, '/');
+	if(slash == NULL || strstr(uri, "://") != NULL)
+	{
+		free_episodes();
+		return;
+	}
+	dir_len = slash - uri;
+	if(dir != NULL && strlen(dir) == dir_len && !strncmp(dir, uri, dir_len))
+	{
+		return;
+	}
+
+	free_episodes();
+	j = calloc(1, sizeof(EpisodesJob));
+	dir = strndup(uri, dir_len);
+	if(j == NULL || dir == NULL || (j->dir = strdup(dir)) == NULL)
+	{
+		perror("E: episodes");
+		free(j);
+		free(dir);
+		dir = NULL;
+		return;
+	}
+
+	load_job = la_pool_submit(load_work, load_done, j);
+	if(load_job == NULL)
+	{
+		// load_done has freed the job already, try again next time
+		free(dir);
+		dir = NULL;
+		return;
+	}
+	load_pending = j;
+}
+
+bool
+la_episodes_loading()
+{
+	return load_job != NULL;
+}
+
+const char*
+la_episodes_next(const char* uri, int* played)
+{
+	Episode* episode;
+	size_t i;
+
+	la_episodes_load(uri);
+	if(la_episodes_loading())
+	{
+		return NULL;
+	}
+
+	episode = find_episode(uri);
+	if(episode == NULL)
+	{
+		return NULL;
+	}
+
+	for(i=episode - episodes + 1;i<length;i++)
+	{
+		*played = get_played(episodes + i);
+		if(*played >= 0)
+		{
+			return episodes[i].uri;
+		}
+	}
+	return NULL;
+}
+
+void
+la_episodes_invalidate()
+{
+	// read again by the next la_episodes_next()
+	free_episodes();
+}
+
+void
+la_episodes_exit()
+{
+	free_episodes();
+}
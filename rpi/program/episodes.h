@@ -0,0 +1,12 @@
+#ifndef EPISODES_H
+#define EPISODES_H
+
+#include <stdbool.h>
+
+void la_episodes_load(const char* uri);
+bool la_episodes_loading();
+const char* la_episodes_next(const char* uri, int* played);
+void la_episodes_invalidate();
+void la_episodes_exit();
+
+#endif        //  #ifndef EPISODES_H
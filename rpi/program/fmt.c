@@ -0,0 +1,84 @@
+#include "fmt.h"
+
+static size_t
+put(char* buf, size_t size, size_t pos, char c)
+{
+	if(pos + 1 < size)
+	{
+		buf[pos++] = c;
+		buf[pos] = '\0';
+	}
+	return pos;
+}
+
+size_t
+la_fmt_str(char* buf, size_t size, size_t pos, const char* str)
+{
+	while(*str != '\0' && pos + 1 < size)
+	{
+		buf[pos++] = *str++;
+	}
+	if(pos < size)
+	{
+		buf[pos] = '\0';
+	}
+	return pos;
+}
+
+size_t
+la_fmt_uint(char* buf, size_t size, size_t pos, unsigned value, int width, char pad)
+{
+	char digits[10];
+	int len = 0;
+
+	do
+	{
+		digits[len++] = '0' + value % 10;
+		value /= 10;
+	} while(value != 0);
+
+	for(;width > len;width--)
+	{
+		pos = put(buf, size, pos, pad);
+	}
+	while(len > 0)
+	{
+		pos = put(buf, size, pos, digits[--len]);
+	}
+	return pos;
+}
+
+size_t
+la_fmt_time(char* buf, size_t size, size_t pos, unsigned secs, int hours)
+{
+	if(hours > 0)
+	{
+		pos = la_fmt_uint(buf, size, pos, secs / 3600, hours, '0');
+		pos = put(buf, size, pos, ':');
+		secs %= 3600;
+	}
+	pos = la_fmt_uint(buf, size, pos, secs / 60, 2, '0');
+	pos = put(buf, size, pos, ':');
+	return la_fmt_uint(buf, size, pos, secs % 60, 2, '0');
+}
+
+size_t
+la_fmt_percent(char* buf, size_t size, size_t pos, unsigned value)
+{
+	pos = la_fmt_uint(buf, size, pos, value, 2, ' ');
+	return put(buf, size, pos, '%');
+}
+
+size_t
+la_fmt_pad(char* buf, size_t size, size_t pos, size_t width)
+{
+	while(pos < width && pos + 1 < size)
+	{
+		buf[pos++] = ' ';
+	}
+	if(pos < size)
+	{
+		buf[pos] = '\0';
+	}
+	return pos;
+}
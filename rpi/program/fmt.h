@@ -0,0 +1,18 @@
+#ifndef FMT_H
+#define FMT_H
+
+#include <stddef.h>
+
+/* Formatting into caller buffers, for the display paths that run on every
+   key and every mpd event. Each function writes at buf + pos, truncates to
+   size, keeps buf terminated and returns the new length. */
+
+size_t la_fmt_str(char* buf, size_t size, size_t pos, const char* str);
+size_t la_fmt_uint(char* buf, size_t size, size_t pos, unsigned value, int width, char pad);
+// hours: 0 for mm:ss (minutes may go past 99), otherwise the width of h:mm:ss
+size_t la_fmt_time(char* buf, size_t size, size_t pos, unsigned secs, int hours);
+// like "%2i%%"
+size_t la_fmt_percent(char* buf, size_t size, size_t pos, unsigned value);
+size_t la_fmt_pad(char* buf, size_t size, size_t pos, size_t width);
+
+#endif        //  #ifndef FMT_H
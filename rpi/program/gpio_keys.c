@@ -0,0 +1,100 @@
+/* gpio_keys.c
+   Copyright 2015 Eric Le Lay
+   This file is part of LecteurAudio.
+
+    LecteurAudio is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LecteurAudio is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LecteurAudio.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Prints the keys decoded by the gpio backend (make gpio_keys), with
+   the time since the previous one, to check the wiring and debouncing
+   or to try the backend against gpio-sim (see magneto_gpio.c). The keys
+   come from LA_KEYMAP if given, like for la.
+
+   usage: gpio_keys
+*/
+
+#include "controles.h"
+#include "ecran.h"
+#include "keymap.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static volatile sig_atomic_t quit = 0;
+
+static void
+on_signal(int sig)
+{
+	quit = 1;
+}
+
+static int
+print_key(Control control, int steps, void* param)
+{
+	static struct timespec last;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	printf("%-20s %8.1fms\n", DEBUG_CONTROLS[control],
+		last.tv_sec == 0 ? 0.0 : (now.tv_sec - last.tv_sec) * 1000.0 + (now.tv_nsec - last.tv_nsec) / 1000000.0);
+	fflush(stdout);
+	last = now;
+	return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+	struct pollfd pfds[4];
+	int* fds;
+	int count;
+	int i;
+
+	la_keymap_load(getenv("LA_KEYMAP"));
+	if(la_init_controls(&fds, &count))
+	{
+		return 1;
+	}
+	for(i=0;i<LA_CONTROL_LENGTH;i++)
+	{
+		la_on_key(i, print_key, NULL);
+	}
+	for(i=0;i<count;i++)
+	{
+		pfds[i].fd = fds[i];
+		pfds[i].events = POLLIN;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	while(!quit)
+	{
+		if(poll(pfds, count, -1) <= 0)
+		{
+			continue;
+		}
+		for(i=0;i<count;i++)
+		{
+			if(pfds[i].revents & POLLIN)
+			{
+				la_control_input_one(pfds[i].fd);
+			}
+		}
+	}
+	la_exit();
+	return 0;
+}
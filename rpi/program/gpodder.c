@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include "gpodder.h"
+#include "log.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -26,6 +28,7 @@ typedef struct {
 	const char* episode;
 	int position;
 	int total;
+	time_t timestamp;
 	void* next;
 } Play;
 
@@ -69,7 +72,7 @@ get_events_str(const char* user, const char* password, long timestamp, char** ev
 	// curl -v -u user:pass http://gpodder.net/api/2/episodes/user.json?since=1445824406 > /tmp/actionsnonagg.json
 	snprintf(url, URL_BUF_SIZE, "http://gpodder.net/api/2/episodes/%s.json?since=%li", user, timestamp);
 	
-	printf("D: gpodder url %s\n", url);
+	LOG_D("gpodder url %s", url);
 	
 	curl = curl_easy_init();
 
@@ -87,6 +90,7 @@ get_events_str(const char* user, const char* password, long timestamp, char** ev
 		
 		res = curl_easy_perform(curl);
 		curl_easy_cleanup(curl);
+		free(url);
 
 		if(res != CURLE_OK)
 		{
@@ -101,6 +105,7 @@ get_events_str(const char* user, const char* password, long timestamp, char** ev
 			{
 				fprintf(stderr, "%s\n", curl_easy_strerror(res));
 			}
+			free(chunk.memory);
 			return -1;
 		}
 		
@@ -108,6 +113,8 @@ get_events_str(const char* user, const char* password, long timestamp, char** ev
 		return 0;
   	}else{
   		fprintf(stderr, "E: couldn't initialize curl\n");
+		free(url);
+		free(chunk.memory);
 		return -1;
 	}
 }
@@ -168,6 +175,37 @@ isNum(jsmntok_t* token, const char* events_str)
 		&& st[0] <= '9';
 }
 
+static time_t
+parse_timestamp(const char* value)
+{
+	struct tm tm = {0};
+
+	// gpodder.net timestamps are UTC, without zone: 2015-10-26T08:35:12
+	if(strptime(value, "%Y-%m-%dT%H:%M:%S", &tm) == NULL)
+	{
+		return 0;
+	}
+	return timegm(&tm);
+}
+
+static char*
+episode_filename(const char* episode)
+{
+	const char* start;
+
+	start = strrchr(episode, '/');
+	if(start == NULL)
+	{
+		start = episode;
+	}
+	else
+	{
+		start++;
+	}
+
+	return strndup(start, strcspn(start, "?#"));
+}
+
 #define TOKENS_SIZE 10000
 
 static int
@@ -190,6 +228,7 @@ parse_events_str(char* events_str, EnCours** encours, size_t* encours_length, lo
 	EnCours* enc;
 	int position;
 	int total;
+	time_t timestamp_action;
 	
 	*encours_length = 0;
 
@@ -226,7 +265,7 @@ parse_events_str(char* events_str, EnCours** encours, size_t* encours_length, lo
 	}
 	else
 	{
-		printf("D: %i tokens\n", ret);
+		LOG_D("%i tokens", ret);
 		if(ret>0)
 		{
 			hcreate(ret/8);
@@ -237,37 +276,41 @@ parse_events_str(char* events_str, EnCours** encours, size_t* encours_length, lo
 					if(tokens[2].type == JSMN_PRIMITIVE)
 					{
 						*timestamp = atol(events_str+tokens[2].start);
-						printf("D: timestamp:%li\n", *timestamp);
+						LOG_D("timestamp:%li", *timestamp);
 					}
 				}
 				if(isKey(tokens+3, events_str, "actions"))
 				{
 					if(tokens[4].type == JSMN_ARRAY){
-						printf("D: actions array\n");
+						LOG_D("actions array");
 						for(i=0, j=5;i<tokens[4].size;i++)
 						{
-							//printf("D: event %i %i %i\n", j, tokens[j].type, tokens[j].size);
+							//LOG_D("event %i %i %i", j, tokens[j].type, tokens[j].size);
 							if(tokens[j].type == JSMN_OBJECT)
 							{
 								episode = NULL;
+								action = INVAL;
+								position = 0;
+								total = 0;
+								timestamp_action = 0;
 								for(k=0;k<tokens[j].size;k++)
 								{
-									//printf("D: token %i %i %i\n", j+1+k*2, tokens[j+1+k*2].type, tokens[j+1+k*2].size);
+									//LOG_D("token %i %i %i", j+1+k*2, tokens[j+1+k*2].type, tokens[j+1+k*2].size);
 									if(isKey(tokens+j+1+k*2, events_str, "action"))
 									{
 										if(isKey(tokens+j+1+k*2+1, events_str, "download"))
 										{
-											printf("D: download\n");
+											LOG_D("download");
 											action = DOWNLOAD;
 										}
 										else if(isKey(tokens+j+1+k*2+1, events_str, "play"))
 										{
-											printf("D: play\n");
+											LOG_D("play");
 											action = PLAY;
 										}
 										else if(isKey(tokens+k*2+1, events_str, "delete"))
 										{
-											printf("D: delete\n");
+											LOG_D("delete");
 											action = DELETE;
 										}
 										else
@@ -291,6 +334,11 @@ parse_events_str(char* events_str, EnCours** encours, size_t* encours_length, lo
 											position = 0;
 										}
 									}
+									else if(isKey(tokens+j+1+k*2, events_str, "timestamp"))
+									{
+										events_str[tokens[j+1+k*2+1].end] = '\0';
+										timestamp_action = parse_timestamp(events_str+tokens[j+1+k*2+1].start);
+									}
 									else if(isKey(tokens+j+1+k*2, events_str, "total"))
 									{
 										if(isNum(tokens+j+1+k*2+1, events_str))
@@ -314,20 +362,21 @@ parse_events_str(char* events_str, EnCours** encours, size_t* encours_length, lo
 										case DELETE:
 											e.data = NULL;
 											ep = hsearch(e, ENTER);
-											printf("D: DELETE %s\n", episode);
+											LOG_D("DELETE %s", episode);
 											break;
 										case PLAY:
 											play = malloc(sizeof(Play));
 											play->episode = episode;
 											play->position = position;
 											play->total = total;
+											play->timestamp = timestamp_action;
 											play->next = NULL;
 											cur_play->next = play;
 											cur_play = play;
 											n_play++;
 											e.data = play;
 											ep = hsearch(e, ENTER);
-											printf("D: PLAY %s\n", episode);
+											LOG_D("PLAY %s", episode);
 											break;
 										case DOWNLOAD:
 										case INVAL:
@@ -342,7 +391,7 @@ parse_events_str(char* events_str, EnCours** encours, size_t* encours_length, lo
 					}
 				}
 			}
-			printf("D: found %li plays\n", n_play);
+			LOG_D("found %li plays", n_play);
 			enc = calloc(n_play, sizeof(EnCours));
 			*encours = enc;
 			*encours_length = 0;
@@ -351,28 +400,38 @@ parse_events_str(char* events_str, EnCours** encours, size_t* encours_length, lo
 				for(play=first_play->next;play!=NULL;play=play->next)
 				{
 					e.key = (char*)play->episode;
-					printf("D: %li %s\n", *encours_length, e.key);
+					LOG_D("%li %s", *encours_length, e.key);
 					if((ep = hsearch(e, FIND))!= NULL && ep->data != NULL
 						&& (play->position == 0 || play->position != play->total))
 					{
-						printf("D: YAY %li %s\n", *encours_length, e.key);
-						enc[*encours_length].uri = play->episode;
-						enc[*encours_length].filename = play->episode;
+						LOG_D("YAY %li %s", *encours_length, e.key);
+						enc[*encours_length].uri = strdup(play->episode);
+						enc[*encours_length].filename = episode_filename(play->episode);
 						enc[*encours_length].position = play->position;
+						enc[*encours_length].timestamp = play->timestamp;
 						(*encours_length)++;
 					}
 				}
 			}
-			printf("D: tokens[1] %i %i - %i %i %.*s\n", tokens[1].type, tokens[1].start, tokens[1].end, tokens[1].size, tokens[1].end - tokens[1].start, events_str+tokens[1].start);
-			printf("D: tokens[2] %i %i - %i %i %.*s\n", tokens[2].type, tokens[2].start, tokens[2].end, tokens[2].size, tokens[2].end - tokens[2].start, events_str+tokens[2].start);
-			//printf("D: tokens[3] %i %i - %i %i %.*s\n", tokens[3].type, tokens[3].start, tokens[3].end, tokens[3].size, tokens[3].end - tokens[3].start, events_str+tokens[3].start);
-			//printf("D: tokens[4] %i %i - %i %i %.*s\n", tokens[4].type, tokens[4].start, tokens[4].end, tokens[4].size, tokens[4].end - tokens[4].start, events_str+tokens[4].start);
+			LOG_D("tokens[1] %i %i - %i %i %.*s", tokens[1].type, tokens[1].start, tokens[1].end, tokens[1].size, tokens[1].end - tokens[1].start, events_str+tokens[1].start);
+			LOG_D("tokens[2] %i %i - %i %i %.*s", tokens[2].type, tokens[2].start, tokens[2].end, tokens[2].size, tokens[2].end - tokens[2].start, events_str+tokens[2].start);
+			//LOG_D("tokens[3] %i %i - %i %i %.*s", tokens[3].type, tokens[3].start, tokens[3].end, tokens[3].size, tokens[3].end - tokens[3].start, events_str+tokens[3].start);
+			//LOG_D("tokens[4] %i %i - %i %i %.*s", tokens[4].type, tokens[4].start, tokens[4].end, tokens[4].size, tokens[4].end - tokens[4].start, events_str+tokens[4].start);
 			for(i=5;i<5+tokens[5].size;i++)
 			{
-				printf("D: tokens[%i] %i %i - %i %i %.*s\n", i, tokens[i].type, tokens[i].start, tokens[i].end, tokens[i].size, tokens[i].end - tokens[i].start, events_str+tokens[i].start);
+				LOG_D("tokens[%i] %i %i - %i %i %.*s", i, tokens[i].type, tokens[i].start, tokens[i].end, tokens[i].size, tokens[i].end - tokens[i].start, events_str+tokens[i].start);
 			}
+			hdestroy();
 		}
 	}
+
+	while(first_play != NULL)
+	{
+		play = first_play->next;
+		free(first_play);
+		first_play = play;
+	}
+	free(tokens);
 	
 	return 0;
 }
@@ -386,8 +445,14 @@ int get_en_cours(EnCours** res, size_t* res_count)
 	const char* password = getenv("GPODDER_PASSWORD");
 	long timestamp = 1445824406L;
 	
-	//ret = get_events_str(user, password, timestamp, (const char**) &events_str);
-	ret = dummy_get_events_str(user, password, timestamp, &events_str);
+	if(user != NULL && password != NULL)
+	{
+		ret = get_events_str(user, password, timestamp, &events_str);
+	}
+	else
+	{
+		ret = dummy_get_events_str(user, password, timestamp, &events_str);
+	}
 	if(ret)
 	{
 		return ret;
@@ -399,8 +464,22 @@ int get_en_cours(EnCours** res, size_t* res_count)
 	
 	if(!ret)
 	{
-		printf("D: %li en cours, timestamp=%li\n", *res_count, timestamp);
+		LOG_D("%li en cours, timestamp=%li", *res_count, timestamp);
 	}
+
+	free(events_str);
 	
 	return ret;
 }
+
+void free_en_cours(EnCours* res, size_t res_count)
+{
+	size_t i;
+
+	for(i=0;i<res_count;i++)
+	{
+		free((char*)res[i].uri);
+		free((char*)res[i].filename);
+	}
+	free(res);
+}
@@ -2,14 +2,17 @@
 #define GPODDER_H
 
 #include <stdlib.h>
+#include <time.h>
 
 typedef struct {
 	const char* uri;
 	const char* filename;
 	int position;
+	time_t timestamp;
 } EnCours;
 
 int get_en_cours(EnCours** res, size_t* res_count);
+void free_en_cours(EnCours* res, size_t res_count);
 
 
 #endif        //  #ifndef GPODDER_H
@@ -0,0 +1,428 @@
+#define _GNU_SOURCE
+#include "group.h"
+#include "log.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mpd/client.h>
+
+/* Group mode: every room listed in the group file plays what the local
+   mpd plays. Each room has a thread with its own connection; the event
+   loop only leaves the latest state of the leader in a mailbox, so
+   rooms never slow it down and a slow room only sees the newest state.
+
+   The file has one mpd per line: host, host:port or a socket path. */
+
+#define MAX_ROOMS 8
+#define ROOM_TIMEOUT_MS 3000
+// rooms closer than that to the leader are left alone
+#define SYNC_TOLERANCE_MS 150
+// also the keepalive period
+#define ROOM_RETRY_SECS 10
+#define URI_SIZE 1024
+
+typedef struct {
+	enum mpd_state state;
+	char uri[URI_SIZE];
+	unsigned elapsed_ms;
+	int volume;
+	// when the leader reported elapsed_ms
+	struct timespec at;
+} GroupState;
+
+typedef struct {
+	char* host;
+	unsigned port;
+	pthread_t thread;
+	struct mpd_connection* conn;
+	// smoothed round trip to this room
+	long rtt_us;
+	unsigned done;
+} Room;
+
+static Room rooms[MAX_ROOMS];
+static size_t rooms_count = 0;
+
+static pthread_mutex_t group_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t group_cond = PTHREAD_COND_INITIALIZER;
+static GroupState leader;
+static unsigned leader_generation = 0;
+static bool group_stopping = false;
+
+static long
+us_since(const struct timespec* start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void
+add_room(char* line)
+{
+	char* colon;
+
+	if(rooms_count == MAX_ROOMS)
+	{
+		fprintf(stderr, "E: group: too many rooms, ignoring %s\n", line);
+		return;
+	}
+	rooms[rooms_count].port = 0;
+	colon = strrchr(line, ':');
+	if(line[0] != '/' && colon != NULL)
+	{
+		*colon = '\0';
+		rooms[rooms_count].port = atoi(colon + 1);
+	}
+	rooms[rooms_count].host = strdup(line);
+	rooms[rooms_count].conn = NULL;
+	rooms[rooms_count].rtt_us = -1;
+	rooms[rooms_count].done = 0;
+	rooms_count++;
+}
+
+static int
+load_rooms(const char* path)
+{
+	FILE* f;
+	char* line = NULL;
+	size_t line_len = 0;
+	char* start;
+	char* end;
+
+	f = fopen(path, "r");
+	if(f == NULL)
+	{
+		// no group file: no group mode
+		return 0;
+	}
+	while(getline(&line, &line_len, f) > 0)
+	{
+		start = line;
+		while(isspace(*start))
+		{
+			start++;
+		}
+		end = start + strlen(start);
+		while(end > start && isspace(end[-1]))
+		{
+			end--;
+		}
+		*end = '\0';
+		if(*start != '\0' && *start != '#')
+		{
+			add_room(start);
+		}
+	}
+	free(line);
+	fclose(f);
+	return rooms_count;
+}
+
+static bool
+room_failed(Room* room, const char* what)
+{
+	if(room->conn == NULL)
+	{
+		return true;
+	}
+	if(mpd_connection_get_error(room->conn) == MPD_ERROR_SUCCESS)
+	{
+		return false;
+	}
+	fprintf(stderr, "E: group %s: %s: %s\n", room->host, what,
+		mpd_connection_get_error_message(room->conn));
+	if(!mpd_connection_clear_error(room->conn))
+	{
+		mpd_connection_free(room->conn);
+		room->conn = NULL;
+	}
+	return true;
+}
+
+// where the leader is now, plus the way to the room; a paused leader
+// stays where it is
+static double
+target_secs(const GroupState* s, const Room* room)
+{
+	long ms;
+
+	ms = s->elapsed_ms;
+	if(s->state == MPD_STATE_PLAY)
+	{
+		ms += us_since(&s->at) / 1000 + room->rtt_us / 2000;
+	}
+	return ms / 1000.0;
+}
+
+static void
+apply(Room* room, const GroupState* s)
+{
+	struct mpd_status* status;
+	struct mpd_song* song;
+	struct timespec start;
+	enum mpd_state state;
+	bool same_song;
+	long rtt;
+	long drift;
+	char secs[32];
+
+	// the status round trip doubles as the rtt measure
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	status = mpd_run_status(room->conn);
+	rtt = us_since(&start);
+	if(status == NULL)
+	{
+		room_failed(room, "status");
+		return;
+	}
+	room->rtt_us = room->rtt_us < 0 ? rtt : (room->rtt_us * 7 + rtt) / 8;
+
+	state = mpd_status_get_state(status);
+	drift = (long)mpd_status_get_elapsed_ms(status) - (long)(target_secs(s, room) * 1000);
+	if(s->volume >= 0 && mpd_status_get_volume(status) >= 0
+		&& mpd_status_get_volume(status) != s->volume)
+	{
+		mpd_run_set_volume(room->conn, s->volume);
+	}
+	mpd_status_free(status);
+	if(room_failed(room, "volume"))
+	{
+		return;
+	}
+
+	song = mpd_run_current_song(room->conn);
+	same_song = song != NULL && !strcmp(mpd_song_get_uri(song), s->uri);
+	if(song != NULL)
+	{
+		mpd_song_free(song);
+	}
+	mpd_response_finish(room->conn);
+	if(room_failed(room, "current song"))
+	{
+		return;
+	}
+
+	if(s->state == MPD_STATE_STOP || s->uri[0] == '\0')
+	{
+		if(state != MPD_STATE_STOP)
+		{
+			mpd_run_stop(room->conn);
+		}
+		room_failed(room, "stop");
+		return;
+	}
+
+	if(!same_song)
+	{
+		// the rooms share the library: same uri, same song
+		mpd_command_list_begin(room->conn, false);
+		mpd_send_clear(room->conn);
+		mpd_send_add(room->conn, s->uri);
+		mpd_send_play(room->conn);
+		mpd_command_list_end(room->conn);
+		mpd_response_finish(room->conn);
+		if(room_failed(room, "play"))
+		{
+			return;
+		}
+		state = MPD_STATE_PLAY;
+		drift = SYNC_TOLERANCE_MS + 1;
+	}
+	else if(state == MPD_STATE_STOP)
+	{
+		// can't seek a stopped player
+		mpd_run_play(room->conn);
+		if(room_failed(room, "play"))
+		{
+			return;
+		}
+		state = MPD_STATE_PLAY;
+		drift = SYNC_TOLERANCE_MS + 1;
+	}
+
+	// a stream can't be aligned
+	if(strncmp(s->uri, "http://", 7) && (drift > SYNC_TOLERANCE_MS || drift < -SYNC_TOLERANCE_MS))
+	{
+		snprintf(secs, sizeof(secs), "%.3f", target_secs(s, room));
+		LOG_D("group %s: %lims off, seek to %s (rtt %lius)", room->host, drift, secs, room->rtt_us);
+		mpd_send_command(room->conn, "seekcur", secs, NULL);
+		mpd_response_finish(room->conn);
+		if(room_failed(room, "seek"))
+		{
+			return;
+		}
+	}
+
+	if(s->state == MPD_STATE_PAUSE && state != MPD_STATE_PAUSE)
+	{
+		mpd_run_pause(room->conn, true);
+	}
+	else if(s->state == MPD_STATE_PLAY && state != MPD_STATE_PLAY)
+	{
+		mpd_run_play(room->conn);
+	}
+	room_failed(room, "state");
+}
+
+static void*
+room_thread(void* arg)
+{
+	Room* room = arg;
+	GroupState s;
+	struct timespec deadline;
+	int ret;
+
+	pthread_mutex_lock(&group_mutex);
+	while(!group_stopping)
+	{
+		if(room->done == leader_generation)
+		{
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += ROOM_RETRY_SECS;
+			ret = pthread_cond_timedwait(&group_cond, &group_mutex, &deadline);
+			if(ret == ETIMEDOUT && room->conn == NULL && leader_generation > 0)
+			{
+				// try again to join with the latest state
+				room->done = leader_generation - 1;
+			}
+			else if(ret == ETIMEDOUT && room->conn != NULL)
+			{
+				// mpd closes idle connections after a minute
+				pthread_mutex_unlock(&group_mutex);
+				mpd_run_ping(room->conn);
+				room_failed(room, "ping");
+				pthread_mutex_lock(&group_mutex);
+			}
+			continue;
+		}
+		s = leader;
+		room->done = leader_generation;
+		pthread_mutex_unlock(&group_mutex);
+
+		if(room->conn == NULL)
+		{
+			room->conn = mpd_connection_new(room->host, room->port, ROOM_TIMEOUT_MS);
+			if(!room_failed(room, "connect"))
+			{
+				LOG_I("group: %s joined", room->host);
+			}
+		}
+		if(room->conn != NULL)
+		{
+			apply(room, &s);
+		}
+
+		pthread_mutex_lock(&group_mutex);
+	}
+	pthread_mutex_unlock(&group_mutex);
+
+	if(room->conn != NULL)
+	{
+		mpd_connection_free(room->conn);
+		room->conn = NULL;
+	}
+	return NULL;
+}
+
+int
+la_group_init(const char* path)
+{
+	size_t i;
+
+	if(load_rooms(path) <= 0)
+	{
+		return 0;
+	}
+	group_stopping = false;
+	for(i=0;i<rooms_count;i++)
+	{
+		if(pthread_create(&rooms[i].thread, NULL, room_thread, rooms + i))
+		{
+			fprintf(stderr, "E: group: unable to start %s\n", rooms[i].host);
+			free(rooms[i].host);
+			rooms_count = i;
+			break;
+		}
+	}
+	LOG_I("group: %zu rooms", rooms_count);
+	return rooms_count;
+}
+
+bool
+la_group_active()
+{
+	return rooms_count > 0;
+}
+
+// reads the local state and hands it to the rooms, without waiting for them
+int
+la_group_sync(struct mpd_connection* conn)
+{
+	struct mpd_status* status;
+	struct mpd_song* song;
+	GroupState s;
+
+	if(rooms_count == 0)
+	{
+		return 0;
+	}
+
+	status = mpd_run_status(conn);
+	if(status == NULL)
+	{
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &s.at);
+	s.state = mpd_status_get_state(status);
+	s.elapsed_ms = mpd_status_get_elapsed_ms(status);
+	s.volume = mpd_status_get_volume(status);
+	mpd_status_free(status);
+	mpd_response_finish(conn);
+
+	s.uri[0] = '\0';
+	song = mpd_run_current_song(conn);
+	if(song != NULL)
+	{
+		snprintf(s.uri, sizeof(s.uri), "%s", mpd_song_get_uri(song));
+		mpd_song_free(song);
+	}
+	mpd_response_finish(conn);
+	if(mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&group_mutex);
+	leader = s;
+	leader_generation++;
+	pthread_cond_broadcast(&group_cond);
+	pthread_mutex_unlock(&group_mutex);
+	return 0;
+}
+
+void
+la_group_exit()
+{
+	size_t i;
+
+	pthread_mutex_lock(&group_mutex);
+	group_stopping = true;
+	pthread_cond_broadcast(&group_cond);
+	pthread_mutex_unlock(&group_mutex);
+
+	// a room stuck in a call gives up after ROOM_TIMEOUT_MS
+	for(i=0;i<rooms_count;i++)
+	{
+		pthread_join(rooms[i].thread, NULL);
+		free(rooms[i].host);
+	}
+	rooms_count = 0;
+}
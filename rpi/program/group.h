@@ -0,0 +1,13 @@
+#ifndef GROUP_H
+#define GROUP_H
+
+#include <stdbool.h>
+
+#include <mpd/client.h>
+
+int la_group_init(const char* path);
+bool la_group_active();
+int la_group_sync(struct mpd_connection* conn);
+void la_group_exit();
+
+#endif        //  #ifndef GROUP_H
@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include "controles.h"
+#include "ecran.h"
+
+#include <execinfo.h>
+#include <link.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Display and remote without any hardware nor terminal, for make bench.
+   Keys are read from stdin, one name per line (OK or LA_OK, NOP to
+   just get an ack, QUIT to stop). After each line, a report is written
+   on ACK_FD:
+     ack <handler result> <display writes> <handler us> <allocations> <loop allocations> |<row 0>|<row 1>|
+
+   Allocations are counted by wrapping malloc, calloc and realloc, in
+   the main thread only: those of the key handler, then those of the
+   rest of the event loop since the previous ack (timers, mpd idle
+   events, finished jobs). The ones made inside libmpdclient, which
+   returns every status and song on the heap, are told apart by the
+   call stack and left out.
+*/
+
+#define ACK_FD 3
+#define LCD_COLS 16
+
+static Callback callbacks[LA_CONTROL_LENGTH] = {0};
+static void* callback_params[LA_CONTROL_LENGTH] = {0};
+
+static int headless_fdControls[1] = { STDIN_FILENO };
+
+static char screen[2][LCD_COLS + 1];
+static int cursor_col = 0;
+static int cursor_row = 0;
+// what would be a command on the serial line
+static unsigned long display_writes = 0;
+
+static char in_buf[256];
+static size_t in_len = 0;
+
+// the workers allocate whenever they like
+static __thread unsigned long allocations = 0;
+static __thread bool main_thread = false;
+static __thread bool in_backtrace = false;
+// at the last ack
+static unsigned long acked_allocations = 0;
+
+// code of libmpdclient, 0 if linked statically
+static uintptr_t mpd_text_start = 0;
+static uintptr_t mpd_text_end = 0;
+
+#define BACKTRACE_DEPTH 8
+
+static int
+find_libmpdclient(struct dl_phdr_info* info, size_t size, void* data)
+{
+	uintptr_t start;
+	int i;
+
+	if(strstr(info->dlpi_name, "libmpdclient") == NULL)
+	{
+		return 0;
+	}
+	for(i=0;i<info->dlpi_phnum;i++)
+	{
+		if(info->dlpi_phdr[i].p_type == PT_LOAD && (info->dlpi_phdr[i].p_flags & PF_X))
+		{
+			start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+			mpd_text_start = start;
+			mpd_text_end = start + info->dlpi_phdr[i].p_memsz;
+		}
+	}
+	return 1;
+}
+
+static void
+count_allocation()
+{
+	void* frames[BACKTRACE_DEPTH];
+	uintptr_t pc;
+	int n;
+	int i;
+
+	if(!main_thread || in_backtrace)
+	{
+		return;
+	}
+	if(mpd_text_start != 0)
+	{
+		in_backtrace = true;
+		n = backtrace(frames, BACKTRACE_DEPTH);
+		in_backtrace = false;
+		for(i=1;i<n;i++)
+		{
+			pc = (uintptr_t)frames[i];
+			if(pc >= mpd_text_start && pc < mpd_text_end)
+			{
+				return;
+			}
+		}
+	}
+	allocations++;
+}
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size)
+{
+	count_allocation();
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+	count_allocation();
+	return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+	count_allocation();
+	return __libc_realloc(ptr, size);
+}
+
+int la_init_ecran()
+{
+	la_lcdClear();
+	display_writes = 0;
+	return 0;
+}
+
+void la_exit()
+{
+}
+
+void la_lcdHome()
+{
+	la_lcdPosition(0, 0);
+}
+
+void la_lcdClear()
+{
+	memset(screen[0], ' ', LCD_COLS);
+	memset(screen[1], ' ', LCD_COLS);
+	screen[0][LCD_COLS] = screen[1][LCD_COLS] = '\0';
+	cursor_col = cursor_row = 0;
+	display_writes++;
+}
+
+void la_lcdPosition(int col, int row)
+{
+	cursor_col = col < LCD_COLS ? col : LCD_COLS;
+	cursor_row = row ? 1 : 0;
+	display_writes++;
+}
+
+void la_lcdPutChar(uint8_t c)
+{
+	if(cursor_col < LCD_COLS)
+	{
+		screen[cursor_row][cursor_col++] = c;
+	}
+	display_writes++;
+}
+
+void la_lcdPuts(char* str)
+{
+	while(*str != '\0' && cursor_col < LCD_COLS)
+	{
+		screen[cursor_row][cursor_col++] = *str++;
+	}
+	display_writes++;
+}
+
+void la_ecran_change_state(bool sleep)
+{
+}
+
+void la_ecran_show_off()
+{
+}
+
+int la_init_controls(int** fdControls, int* fdControlCount)
+{
+	void* frame;
+
+	// the first backtrace loads the unwinder, with allocations
+	in_backtrace = true;
+	backtrace(&frame, 1);
+	in_backtrace = false;
+	dl_iterate_phdr(find_libmpdclient, NULL);
+	main_thread = true;
+
+	*fdControls = headless_fdControls;
+	*fdControlCount = 1;
+	return 0;
+}
+
+void la_on_key(Control ctrl, Callback fn, void* param)
+{
+	if(ctrl>=0 && ctrl < LA_CONTROL_LENGTH)
+	{
+		callbacks[ctrl] = fn;
+		callback_params[ctrl] = param;
+	}
+}
+
+void la_wait_input()
+{
+	fprintf(stderr, "E: UNSUPPORTED la_wait_input\n");
+}
+
+static int
+find_control(const char* name)
+{
+	int i;
+
+	for(i=0;i<LA_CONTROL_LENGTH;i++)
+	{
+		if(!strcmp(DEBUG_CONTROLS[i], name) || !strcmp(DEBUG_CONTROLS[i] + 3, name))
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int
+handle_key(const char* name)
+{
+	struct timespec start, end;
+	unsigned long writes;
+	unsigned long allocs;
+	unsigned long loop_allocs;
+	int c;
+	int ret = 0;
+
+	c = find_control(name);
+
+	writes = display_writes;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	allocs = allocations;
+	loop_allocs = allocs - acked_allocations;
+	if(c != -1 && callbacks[c] != NULL)
+	{
+		ret = callbacks[c](c, 1, callback_params[c]);
+	}
+	allocs = allocations - allocs;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	dprintf(ACK_FD, "ack %i %lu %li %lu %lu |%s|%s|\n", ret, display_writes - writes,
+		(end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000,
+		allocs, loop_allocs, screen[0], screen[1]);
+	acked_allocations = allocations;
+	return ret;
+}
+
+int la_control_input_one(int fd)
+{
+	ssize_t len;
+	char* start;
+	char* nl;
+	int ret = 0;
+
+	len = read(fd, in_buf + in_len, sizeof(in_buf) - in_len - 1);
+	if(len <= 0)
+	{
+		// bench_run is gone
+		return -1;
+	}
+	in_len += len;
+	in_buf[in_len] = '\0';
+
+	start = in_buf;
+	while(ret >= 0 && (nl = strchr(start, '\n')) != NULL)
+	{
+		*nl = '\0';
+		if(!strcmp(start, "QUIT"))
+		{
+			return -1;
+		}
+		ret = handle_key(start);
+		start = nl + 1;
+	}
+	in_len -= start - in_buf;
+	memmove(in_buf, start, in_len);
+	if(in_len == sizeof(in_buf) - 1)
+	{
+		in_len = 0;
+	}
+
+	return ret;
+}
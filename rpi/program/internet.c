@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+#include "internet.h"
+#include "log.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+// same as the connect timeout of the old curl HEAD request
+#define PROBE_TIMEOUT 2
+// how long a verdict is trusted before probing again
+#define STATUS_TTL 60
+// how long the resolved endpoint is reused before asking the DNS again
+#define ADDRESS_TTL 600
+
+static char host[256];
+static char port[8];
+
+// private epoll set: the main loop only sees internet_fd
+static int internet_fd = -1;
+static int dns_fd = -1;
+static int timer_fd = -1;
+static int sock_fd = -1;
+
+static struct gaicb dns_req;
+static struct addrinfo dns_hints;
+static bool resolving = false;
+
+static struct sockaddr_storage address;
+static socklen_t address_len = 0;
+static time_t address_at;
+
+static InternetStatus status = LA_INTERNET_UNKNOWN;
+static time_t status_at;
+static bool probing = false;
+static struct timespec probe_start;
+
+static int stats_probe_ok = -1;
+static int stats_probe_ko = -1;
+
+static time_t
+now_secs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+static int
+parse_url(const char* url)
+{
+	const char* start;
+	const char* end;
+	const char* colon;
+	size_t len;
+
+	start = strstr(url, "://");
+	start = start == NULL ? url : start + 3;
+	end = start + strcspn(start, "/?#");
+	colon = memchr(start, ':', end - start);
+
+	len = (colon == NULL ? end : colon) - start;
+	if(len == 0 || len >= sizeof(host))
+	{
+		fprintf(stderr, "E: invalid probe url %s\n", url);
+		return -1;
+	}
+	memcpy(host, start, len);
+	host[len] = '\0';
+
+	if(colon == NULL)
+	{
+		strcpy(port, "80");
+	}
+	else
+	{
+		snprintf(port, sizeof(port), "%.*s", (int)(end - colon - 1), colon + 1);
+	}
+	return 0;
+}
+
+static void
+dns_done(union sigval sv)
+{
+	uint64_t one = 1;
+
+	// runs in a glibc helper thread: only signal the event loop
+	if(write(dns_fd, &one, sizeof(one)) != sizeof(one))
+	{
+		perror("E: internet dns notify");
+	}
+}
+
+static int
+epoll_watch(int fd, uint32_t events)
+{
+	struct epoll_event ev = {0};
+
+	ev.events = events;
+	ev.data.fd = fd;
+	return epoll_ctl(internet_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int
+finish(InternetStatus verdict)
+{
+	struct itimerspec its = {{0}};
+	struct timespec now;
+	bool changed;
+
+	if(sock_fd != -1)
+	{
+		close(sock_fd);
+		sock_fd = -1;
+	}
+	timerfd_settime(timer_fd, 0, &its, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	LOG_I("internet %s:%s %s in %lims", host, port,
+		verdict == LA_INTERNET_OK ? "OK" : "KO",
+		(now.tv_sec - probe_start.tv_sec) * 1000 + (now.tv_nsec - probe_start.tv_nsec) / 1000000);
+	la_stats_since(verdict == LA_INTERNET_OK ? stats_probe_ok : stats_probe_ko, &probe_start);
+
+	probing = false;
+	changed = verdict != status;
+	status = verdict;
+	status_at = now.tv_sec;
+	return changed ? 1 : 0;
+}
+
+static int
+start_connect()
+{
+	sock_fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(sock_fd == -1)
+	{
+		perror("E: internet socket");
+		return finish(LA_INTERNET_KO);
+	}
+
+	if(connect(sock_fd, (struct sockaddr*)&address, address_len) == 0)
+	{
+		return finish(LA_INTERNET_OK);
+	}
+	else if(errno != EINPROGRESS)
+	{
+		// maybe the cached address is stale: resolve it again next time
+		address_len = 0;
+		return finish(LA_INTERNET_KO);
+	}
+
+	if(epoll_watch(sock_fd, EPOLLOUT) == -1)
+	{
+		perror("E: internet epoll_ctl");
+		return finish(LA_INTERNET_KO);
+	}
+	return 0;
+}
+
+static int
+start_resolve()
+{
+	struct gaicb* reqs[1] = { &dns_req };
+	struct sigevent sev = {{0}};
+	int ret;
+
+	memset(&dns_req, 0, sizeof(dns_req));
+	memset(&dns_hints, 0, sizeof(dns_hints));
+	dns_hints.ai_family = AF_UNSPEC;
+	dns_hints.ai_socktype = SOCK_STREAM;
+	dns_req.ar_name = host;
+	dns_req.ar_service = port;
+	dns_req.ar_request = &dns_hints;
+
+	sev.sigev_notify = SIGEV_THREAD;
+	sev.sigev_notify_function = dns_done;
+
+	ret = getaddrinfo_a(GAI_NOWAIT, reqs, 1, &sev);
+	if(ret)
+	{
+		fprintf(stderr, "E: internet getaddrinfo_a: %s\n", gai_strerror(ret));
+		return finish(LA_INTERNET_KO);
+	}
+	resolving = true;
+	return 0;
+}
+
+static int
+on_resolved()
+{
+	uint64_t count;
+	int ret;
+
+	if(read(dns_fd, &count, sizeof(count)) != sizeof(count))
+	{
+		perror("E: internet dns eventfd");
+	}
+	resolving = false;
+
+	ret = gai_error(&dns_req);
+	if(ret == 0)
+	{
+		memcpy(&address, dns_req.ar_result->ai_addr, dns_req.ar_result->ai_addrlen);
+		address_len = dns_req.ar_result->ai_addrlen;
+		address_at = now_secs();
+		freeaddrinfo(dns_req.ar_result);
+	}
+	else
+	{
+		fprintf(stderr, "E: internet resolve %s: %s\n", host, gai_strerror(ret));
+	}
+
+	if(!probing)
+	{
+		// late answer of a timed out probe: keep the address anyway
+		return 0;
+	}
+	if(ret)
+	{
+		return finish(LA_INTERNET_KO);
+	}
+	return start_connect();
+}
+
+static int
+on_connected()
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if(getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err)
+	{
+		fprintf(stderr, "E: internet connect %s:%s: %s\n", host, port, strerror(err));
+		address_len = 0;
+		return finish(LA_INTERNET_KO);
+	}
+	return finish(LA_INTERNET_OK);
+}
+
+static int
+on_timeout()
+{
+	uint64_t count;
+
+	if(read(timer_fd, &count, sizeof(count)) != sizeof(count))
+	{
+		perror("E: internet timerfd");
+	}
+	if(!probing)
+	{
+		return 0;
+	}
+	if(resolving && gai_cancel(&dns_req) == EAI_CANCELED)
+	{
+		resolving = false;
+	}
+	return finish(LA_INTERNET_KO);
+}
+
+int
+la_internet_init(const char* url)
+{
+	if(parse_url(url))
+	{
+		return -1;
+	}
+
+	stats_probe_ok = la_stats_histogram("probe internet OK");
+	stats_probe_ko = la_stats_histogram("probe internet KO");
+
+	internet_fd = epoll_create1(EPOLL_CLOEXEC);
+	dns_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(internet_fd == -1 || dns_fd == -1 || timer_fd == -1
+		|| epoll_watch(dns_fd, EPOLLIN) == -1
+		|| epoll_watch(timer_fd, EPOLLIN) == -1)
+	{
+		perror("E: internet init");
+		la_internet_exit();
+		return -1;
+	}
+	return internet_fd;
+}
+
+void
+la_internet_exit()
+{
+	struct timespec timeout = { PROBE_TIMEOUT, 0 };
+	const struct gaicb* reqs[1] = { &dns_req };
+
+	if(resolving && gai_cancel(&dns_req) != EAI_CANCELED)
+	{
+		// the notification must not find dns_fd closed
+		gai_suspend(reqs, 1, &timeout);
+	}
+	resolving = false;
+	probing = false;
+
+	if(sock_fd != -1) close(sock_fd);
+	if(timer_fd != -1) close(timer_fd);
+	if(dns_fd != -1) close(dns_fd);
+	if(internet_fd != -1) close(internet_fd);
+	sock_fd = timer_fd = dns_fd = internet_fd = -1;
+}
+
+int
+la_internet_handle()
+{
+	struct epoll_event events[4];
+	int nfds;
+	int n;
+	int changed = 0;
+
+	nfds = epoll_wait(internet_fd, events, 4, 0);
+	for(n = 0; n < nfds; n++)
+	{
+		if(events[n].data.fd == dns_fd)
+		{
+			changed |= on_resolved();
+		}
+		else if(events[n].data.fd == timer_fd)
+		{
+			changed |= on_timeout();
+		}
+		else if(events[n].data.fd == sock_fd)
+		{
+			changed |= on_connected();
+		}
+	}
+	return changed;
+}
+
+// returns 1 if the verdict changed right away (e.g. no route at all)
+int
+la_internet_probe(bool force)
+{
+	struct itimerspec its = {{0}};
+	time_t now;
+
+	if(probing || internet_fd == -1)
+	{
+		return 0;
+	}
+
+	now = now_secs();
+	if(!force && status != LA_INTERNET_UNKNOWN && now - status_at < STATUS_TTL)
+	{
+		return 0;
+	}
+
+	probing = true;
+	clock_gettime(CLOCK_MONOTONIC, &probe_start);
+
+	its.it_value.tv_sec = PROBE_TIMEOUT;
+	timerfd_settime(timer_fd, 0, &its, NULL);
+
+	if(resolving)
+	{
+		// a previous resolution is still running: wait for it
+		return 0;
+	}
+	else if(address_len != 0 && now - address_at < ADDRESS_TTL)
+	{
+		return start_connect();
+	}
+	else
+	{
+		return start_resolve();
+	}
+}
+
+bool
+la_internet_probing()
+{
+	return probing;
+}
+
+// the last verdict: only la_internet_probe refreshes it, for a caller
+// that handles the change
+InternetStatus
+la_internet_status()
+{
+	return status;
+}
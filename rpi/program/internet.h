@@ -0,0 +1,20 @@
+#ifndef INTERNET_H
+#define INTERNET_H
+
+#include <stdbool.h>
+
+typedef enum {
+	LA_INTERNET_UNKNOWN,
+	LA_INTERNET_OK,
+	LA_INTERNET_KO
+} InternetStatus;
+
+int la_internet_init(const char* url);
+int la_internet_handle();
+void la_internet_exit();
+
+int la_internet_probe(bool force);
+bool la_internet_probing();
+InternetStatus la_internet_status();
+
+#endif        //  #ifndef INTERNET_H
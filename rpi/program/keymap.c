@@ -0,0 +1,340 @@
+#include "keymap.h"
+#include "log.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* What the remotes and buttons send, to controls. The keys are the raw
+   IR codes of the firmware's input events (0x1FE48B7...), the IR names
+   it printed before (POWER, UP...), pins:<name> for the pins read by
+   magneto_arduino and pins<bank>:<code in hex> for the banks of magneto
+   and magneto_gpio. The file has one <key> <control> per line, the
+   control with or without LA_.
+
+   At load, the keys are put in a table with a seed found so that no two
+   of them share a slot: a lookup hashes the key and compares it with
+   the only entry that may match. */
+
+#define KEY_SIZE 24
+// tries per table size before doubling it
+#define MAX_SEEDS 256
+
+typedef struct {
+	const char* key;
+	Control control;
+} DefaultKey;
+
+static const DefaultKey default_keys[] = {
+	// fm_LCD_IR_PI input events
+	{"0x1FE48B7", LA_PLAYPAUSE},
+	{"0x1FE58A7", LA_UP},
+	{"0x1FE7887", LA_MENU},
+	{"0x1FE807F", LA_LEFT},
+	{"0x1FE40BF", LA_OK},
+	{"0x1FEC03F", LA_RIGHT},
+	{"0x1FEA05F", LA_DOWN},
+	{"0x1FE609F", LA_PODCAST_DEGUSTER},
+	{"0x1FE906F", LA_STOP},
+	{"0x1FED827", LA_EXIT},
+	{"0x1FE30CF", LA_RADIO_1},
+	{"0x1FEB04F", LA_RADIO_2},
+	{"0x1FE708F", LA_RADIO_3},
+	// fm_LCD_IR_PI text lines
+	{"POWER", LA_PLAYPAUSE},
+	{"UP", LA_UP},
+	{"SETUP", LA_MENU},
+	{"LEFT", LA_LEFT},
+	{"ENTER", LA_OK},
+	{"RIGHT", LA_RIGHT},
+	{"DOWN", LA_DOWN},
+	{"ROTATE", LA_PODCAST_DEGUSTER},
+	{"STOP", LA_STOP},
+	{"EXIT", LA_EXIT},
+	{"VIDEO", LA_RADIO_1},
+	{"ZOOM", LA_RADIO_2},
+	{"VOL-", LA_RADIO_3},
+	// magneto_arduino
+	{"pins:POWER", LA_MENU},
+	{"pins:PLAY", LA_PLAYPAUSE},
+	{"pins:UP", LA_UP},
+	{"pins:DOWN", LA_DOWN},
+	{"pins:REW", LA_LEFT},
+	{"pins:FF", LA_RIGHT},
+	{"pins:REC", LA_OK},
+	// magneto, magneto_gpio
+	{"pins2:f", LA_MENU},
+	{"pins2:7", LA_PLAYPAUSE},
+	{"pins2:3", LA_DOWN},
+};
+
+typedef struct {
+	// a name, or empty for a code
+	char key[KEY_SIZE];
+	uint32_t code;
+	bool used;
+	Control control;
+} KeymapEntry;
+
+// read from the file, until hashed
+static KeymapEntry* entries = NULL;
+static size_t entries_count = 0;
+
+// power of 2 slots
+static KeymapEntry* table = NULL;
+static uint32_t table_size = 0;
+static uint32_t table_seed = 0;
+
+static uint32_t
+hash_bytes(const void* bytes, size_t len, uint32_t seed)
+{
+	const unsigned char* b = bytes;
+	uint32_t hash = 2166136261U ^ seed;
+
+	while(len-- > 0)
+	{
+		hash ^= *b++;
+		hash *= 16777619U;
+	}
+	return hash ^ (hash >> 15);
+}
+
+static uint32_t
+hash_entry(const KeymapEntry* entry, uint32_t seed)
+{
+	if(entry->key[0] == '\0')
+	{
+		return hash_bytes(&entry->code, sizeof(entry->code), seed);
+	}
+	return hash_bytes(entry->key, strlen(entry->key), seed);
+}
+
+static char*
+trim(char* line)
+{
+	char* end;
+
+	while(isspace(*line))
+	{
+		line++;
+	}
+	end = line + strlen(line);
+	while(end > line && isspace(end[-1]))
+	{
+		end--;
+	}
+	*end = '\0';
+	return line;
+}
+
+static int
+find_control(const char* name)
+{
+	int i;
+
+	for(i=0;i<LA_CONTROL_LENGTH;i++)
+	{
+		if(!strcmp(DEBUG_CONTROLS[i], name) || !strcmp(DEBUG_CONTROLS[i] + 3, name))
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// a key given again replaces the previous one
+static int
+add_key(const char* key, Control control)
+{
+	KeymapEntry entry = {{0}};
+	KeymapEntry* grown;
+	char* end;
+	size_t i;
+
+	if(*key == '\0' || strlen(key) >= KEY_SIZE)
+	{
+		return -1;
+	}
+	if(!strncmp(key, "0x", 2))
+	{
+		entry.code = strtoul(key + 2, &end, 16);
+		if(end == key + 2 || *end != '\0')
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		strcpy(entry.key, key);
+	}
+	entry.used = true;
+	entry.control = control;
+
+	for(i=0;i<entries_count;i++)
+	{
+		if(!strcmp(entries[i].key, entry.key) && entries[i].code == entry.code)
+		{
+			entries[i].control = control;
+			return 0;
+		}
+	}
+
+	grown = realloc(entries, (entries_count + 1) * sizeof(KeymapEntry));
+	if(grown == NULL)
+	{
+		return -1;
+	}
+	entries = grown;
+	entries[entries_count++] = entry;
+	return 0;
+}
+
+static int
+try_seed(uint32_t size, uint32_t seed)
+{
+	KeymapEntry* slot;
+	size_t i;
+
+	memset(table, 0, size * sizeof(KeymapEntry));
+	for(i=0;i<entries_count;i++)
+	{
+		slot = table + (hash_entry(entries + i, seed) & (size - 1));
+		if(slot->used)
+		{
+			return -1;
+		}
+		*slot = entries[i];
+	}
+	return 0;
+}
+
+static int
+build_table()
+{
+	KeymapEntry* grown;
+	uint32_t size;
+	uint32_t seed;
+
+	for(size=2;size<2*entries_count;size*=2);
+	for(;size<=1024*(entries_count+1);size*=2)
+	{
+		grown = realloc(table, size * sizeof(KeymapEntry));
+		if(grown == NULL)
+		{
+			return -1;
+		}
+		table = grown;
+		for(seed=0;seed<MAX_SEEDS;seed++)
+		{
+			if(!try_seed(size, seed))
+			{
+				table_size = size;
+				table_seed = seed;
+				return 0;
+			}
+		}
+	}
+	return -1;
+}
+
+// without the file, the keys of the remotes la was built for
+int
+la_keymap_load(const char* path)
+{
+	FILE* f;
+	char* line = NULL;
+	size_t line_len = 0;
+	char* key;
+	char* name;
+	int control;
+	size_t i;
+
+	la_keymap_exit();
+
+	f = path != NULL ? fopen(path, "r") : NULL;
+	if(f == NULL)
+	{
+		LOG_D("no keymap %s, using the default keys", path != NULL ? path : "");
+		for(i=0;i<sizeof(default_keys)/sizeof(DefaultKey);i++)
+		{
+			add_key(default_keys[i].key, default_keys[i].control);
+		}
+	}
+	else
+	{
+		while(getline(&line, &line_len, f) > 0)
+		{
+			key = trim(line);
+			if(*key == '\0' || *key == '#')
+			{
+				continue;
+			}
+			name = key + strcspn(key, " \t");
+			if(*name != '\0')
+			{
+				*name = '\0';
+				name = trim(name + 1);
+			}
+			control = find_control(name);
+			if(control == -1 || add_key(key, control))
+			{
+				fprintf(stderr, "E: keymap: invalid line for %s\n", key);
+			}
+		}
+		free(line);
+		fclose(f);
+	}
+
+	if(build_table())
+	{
+		fprintf(stderr, "E: keymap: no table for %zu keys\n", entries_count);
+		la_keymap_exit();
+		return -1;
+	}
+	LOG_I("keymap: %zu keys in %u slots", entries_count, table_size);
+	free(entries);
+	entries = NULL;
+	entries_count = 0;
+	return 0;
+}
+
+// the control, -1 for an unknown key
+int
+la_keymap_lookup(const char* key)
+{
+	KeymapEntry* slot;
+
+	if(table == NULL && la_keymap_load(NULL))
+	{
+		return -1;
+	}
+	slot = table + (hash_bytes(key, strlen(key), table_seed) & (table_size - 1));
+	return !slot->used || slot->key[0] == '\0' || strcmp(slot->key, key) ? -1 : (int)slot->control;
+}
+
+int
+la_keymap_lookup_code(uint32_t code)
+{
+	KeymapEntry* slot;
+
+	if(table == NULL && la_keymap_load(NULL))
+	{
+		return -1;
+	}
+	slot = table + (hash_bytes(&code, sizeof(code), table_seed) & (table_size - 1));
+	return !slot->used || slot->key[0] != '\0' || slot->code != code ? -1 : (int)slot->control;
+}
+
+void
+la_keymap_exit()
+{
+	free(entries);
+	entries = NULL;
+	entries_count = 0;
+	free(table);
+	table = NULL;
+	table_size = 0;
+}
@@ -0,0 +1,13 @@
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+#include "controles.h"
+
+#include <stdint.h>
+
+int la_keymap_load(const char* path);
+int la_keymap_lookup(const char* key);
+int la_keymap_lookup_code(uint32_t code);
+void la_keymap_exit();
+
+#endif        //  #ifndef KEYMAP_H
@@ -0,0 +1,207 @@
+#include "log.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#define LOG_RECORDS 512
+#define LOG_RECORD_SIZE 128
+// written to stderr when the program crashes
+#define LOG_CRASH_RECORDS 64
+#define LOG_FLUSH_INTERVAL 2
+
+typedef struct {
+	int level;
+	int len;
+	char text[LOG_RECORD_SIZE];
+} LogRecord;
+
+static const char* level_prefix[] = { "D: ", "I: ", "E: " };
+
+// records are formatted in place: logging costs a vsnprintf, no system call
+static LogRecord records[LOG_RECORDS];
+static uint64_t written = 0;
+static uint64_t flushed = 0;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int log_fd = -1;
+static char flush_buffer[LOG_RECORDS * LOG_RECORD_SIZE];
+
+static void
+flush_locked()
+{
+	size_t len = 0;
+	uint64_t lost;
+	LogRecord* r;
+
+	if(written - flushed > LOG_RECORDS)
+	{
+		lost = written - flushed - LOG_RECORDS;
+		len += snprintf(flush_buffer, sizeof(flush_buffer), "I: log: %llu records lost\n",
+			(unsigned long long)lost);
+		flushed += lost;
+	}
+
+	for(;flushed < written;flushed++)
+	{
+		r = records + flushed % LOG_RECORDS;
+		if(len + r->len > sizeof(flush_buffer))
+		{
+			break;
+		}
+		memcpy(flush_buffer + len, r->text, r->len);
+		len += r->len;
+	}
+
+	if(len > 0)
+	{
+		fwrite(flush_buffer, 1, len, stdout);
+		fflush(stdout);
+	}
+}
+
+void
+la_log(int level, const char* fmt, ...)
+{
+	LogRecord* r;
+	va_list ap;
+	int len;
+
+	pthread_mutex_lock(&log_mutex);
+
+	r = records + written % LOG_RECORDS;
+	r->level = level;
+	strcpy(r->text, level_prefix[level]);
+	va_start(ap, fmt);
+	len = vsnprintf(r->text + 3, LOG_RECORD_SIZE - 4, fmt, ap);
+	va_end(ap);
+	if(len < 0)
+	{
+		len = 0;
+	}
+	len += 3;
+	if(len > LOG_RECORD_SIZE - 2)
+	{
+		// truncated
+		len = LOG_RECORD_SIZE - 2;
+	}
+	if(r->text[len - 1] != '\n')
+	{
+		r->text[len++] = '\n';
+	}
+	r->text[len] = '\0';
+	r->len = len;
+	written++;
+
+	if(level == LA_LOG_ERROR)
+	{
+		// rare, and must not be lost
+		fwrite(r->text, 1, r->len, stderr);
+		fflush(stderr);
+	}
+
+	// don't wait for the timer when the ring is filling up (during startup...)
+	if(written - flushed >= LOG_RECORDS / 2)
+	{
+		flush_locked();
+	}
+
+	pthread_mutex_unlock(&log_mutex);
+}
+
+void
+la_log_flush()
+{
+	pthread_mutex_lock(&log_mutex);
+	flush_locked();
+	pthread_mutex_unlock(&log_mutex);
+}
+
+static void
+crash_handler(int sig)
+{
+	static const char header[] = "E: crashed, last log records:\n";
+	uint64_t i;
+	uint64_t first;
+	LogRecord* r;
+
+	// no locking nor stdio here: only write(2)
+	if(write(STDERR_FILENO, header, sizeof(header) - 1) < 0)
+	{
+		// nothing left to do
+	}
+	first = written > LOG_CRASH_RECORDS ? written - LOG_CRASH_RECORDS : 0;
+	for(i=first;i<written;i++)
+	{
+		r = records + i % LOG_RECORDS;
+		if(write(STDERR_FILENO, r->text, r->len) < 0)
+		{
+			break;
+		}
+	}
+
+	// SA_RESETHAND: the default action runs now
+	raise(sig);
+}
+
+int
+la_log_init()
+{
+	struct sigaction sa = {{0}};
+	struct itimerspec its = {{0}};
+
+	sa.sa_handler = crash_handler;
+	sa.sa_flags = SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, NULL);
+	sigaction(SIGBUS, &sa, NULL);
+	sigaction(SIGFPE, &sa, NULL);
+	sigaction(SIGILL, &sa, NULL);
+	sigaction(SIGABRT, &sa, NULL);
+
+	if(log_fd != -1)
+	{
+		return log_fd;
+	}
+
+	log_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(log_fd == -1)
+	{
+		perror("E: log timerfd");
+		return -1;
+	}
+	its.it_value.tv_sec = LOG_FLUSH_INTERVAL;
+	its.it_interval.tv_sec = LOG_FLUSH_INTERVAL;
+	timerfd_settime(log_fd, 0, &its, NULL);
+
+	return log_fd;
+}
+
+int
+la_log_handle()
+{
+	uint64_t count;
+
+	if(read(log_fd, &count, sizeof(count)) != sizeof(count))
+	{
+		perror("E: log timerfd");
+	}
+	la_log_flush();
+	return 0;
+}
+
+void
+la_log_exit()
+{
+	la_log_flush();
+	if(log_fd != -1)
+	{
+		close(log_fd);
+		log_fd = -1;
+	}
+}
@@ -0,0 +1,34 @@
+#ifndef LOG_H
+#define LOG_H
+
+#define LA_LOG_DEBUG 0
+#define LA_LOG_INFO 1
+#define LA_LOG_ERROR 2
+
+// messages below this level are not even compiled in (make LOG_LEVEL=1)
+#ifndef LA_LOG_LEVEL
+#define LA_LOG_LEVEL LA_LOG_DEBUG
+#endif
+
+#if LA_LOG_LEVEL <= LA_LOG_DEBUG
+#define LOG_D(...) la_log(LA_LOG_DEBUG, __VA_ARGS__)
+#else
+#define LOG_D(...) do {} while(0)
+#endif
+
+#if LA_LOG_LEVEL <= LA_LOG_INFO
+#define LOG_I(...) la_log(LA_LOG_INFO, __VA_ARGS__)
+#else
+#define LOG_I(...) do {} while(0)
+#endif
+
+#define LOG_E(...) la_log(LA_LOG_ERROR, __VA_ARGS__)
+
+void la_log(int level, const char* fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+int la_log_init();
+int la_log_handle();
+void la_log_flush();
+void la_log_exit();
+
+#endif        //  #ifndef LOG_H
@@ -1,4 +1,6 @@
 #include "controles.h"
+#include "keymap.h"
+#include "log.h"
 
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -9,29 +11,84 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include <wiringPi.h>
 
+/* The ISR threads of wiringPi only sample the pins: each bank has its
+   own ring with that thread as the single producer, and an eventfd wakes
+   up the main loop to drain them. Debouncing and the callbacks happen
+   in the main loop, the code being read once the pins have settled,
+   when the settle timerfd expires. */
+
 #define	DEBOUNCE_TIME	200
+// the 4 pins of a bank don't change all at once
+#define SETTLE_TIME 300
+#define RING_SIZE 16
+
 static Callback callbacks[LA_CONTROL_LENGTH] = {0};
 static void* callback_params[LA_CONTROL_LENGTH] = {0};
 
 static int PINS_1[4] = {3, 12, 13, 14};
 static int PINS_2[4] = {26, 27, 28, 29};
 
-static int debounceTime[2] = {0};
+typedef struct {
+	unsigned int ms;
+	int pins;
+} PinEdge;
+
+typedef struct {
+	PinEdge edges[RING_SIZE];
+	// written by the ISR thread
+	atomic_uint head;
+	// written by the main thread
+	atomic_uint tail;
+} PinRing;
+
+static PinRing rings[2];
+
+// the eventfd, then the settle timerfd
+static int fdsPins[2] = {-1, -1};
 
-static void handlePins(int i)
+static unsigned int debounceTime[2] = {0};
+// an edge was accepted, the code is read when the timer expires
+static bool pending[2] = {false};
+
+static int read_pins(int bank)
 {
-	if (millis () < debounceTime[i])
+	int pins = 0;
+	int i;
+
+	for(i=0 ; i < 4 ; i++)
 	{
-		debounceTime[i] = millis() + DEBOUNCE_TIME;
-		//printf("bouncing\n");
-		return;
+		pins |= digitalRead(bank == 0 ? PINS_1[i] : PINS_2[i]) << i;
+	}
+	return pins;
+}
+
+static void handlePins(int bank)
+{
+	PinRing* ring = &rings[bank];
+	unsigned int head;
+	uint64_t one = 1;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if(head - atomic_load_explicit(&ring->tail, memory_order_acquire) < RING_SIZE)
+	{
+		ring->edges[head % RING_SIZE].ms = millis();
+		ring->edges[head % RING_SIZE].pins = read_pins(bank);
+		atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	}
+	// else the main loop is late and this edge would be a bounce anyway
+
+	if(write(fdsPins[0], &one, sizeof(one)) != sizeof(one))
+	{
+		perror("E: pins eventfd");
 	}
-	
-	la_control_input_one(i+1);
-	debounceTime[i] = millis() + DEBOUNCE_TIME;
 }
 
 static void handlePins1()
@@ -51,6 +108,19 @@ int la_init_controls(int** fdControls, int* fdControlCount)
 	ret = wiringPiSetup();
 	if(ret) return ret;
 
+	fdsPins[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	fdsPins[1] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(fdsPins[0] == -1 || fdsPins[1] == -1)
+	{
+		perror("E: pins fds");
+		return -1;
+	}
+	for(i=0;i<2;i++)
+	{
+		atomic_init(&rings[i].head, 0);
+		atomic_init(&rings[i].tail, 0);
+	}
+
 	for(i=0;i<4;i++)
 	{
 		pinMode(PINS_1[i], INPUT);
@@ -71,8 +141,8 @@ int la_init_controls(int** fdControls, int* fdControlCount)
     	return ret;
     }
 
-	*fdControls = NULL;
-	*fdControlCount = 0;
+	*fdControls = fdsPins;
+	*fdControlCount = 2;
 	return 0;
 }
 
@@ -91,85 +161,101 @@ void la_wait_input()
 	exit(-1);
 }
 
-// PINS 1
-// #define CODE_ 0xf
-// #define CODE_PLAY 0x7
-// #define CODE_REW 0x1
-// #define CODE_CHUP 0x3
 
-// PINS 2
-#define CODE_POWER 0xf
-#define CODE_PLAY 0x7
-#define CODE_REW 0x1
-#define CODE_CHDWN 0x3
-
-int la_control_input_one(int fd)
+static void arm_settle()
 {
-	int pins = 0;
-	int i;
-	Control c;
-	int countDebounce = 0;
-	int pinsDebounce = 0;
-	
-	delay(300);
-	for(countDebounce = 0; countDebounce < 1; countDebounce++)
+	struct itimerspec its = {{0}};
+
+	its.it_value.tv_sec = SETTLE_TIME / 1000;
+	its.it_value.tv_nsec = (SETTLE_TIME % 1000) * 1000000L;
+	if(timerfd_settime(fdsPins[1], 0, &its, NULL) == -1)
 	{
-		pins = 0;
-		for(i=0 ; i < 4 ; i++)
-		{
-			pins |= digitalRead(fd == 1 ? PINS_1[i] : PINS_2[i]) << i;
-		}
-		if(countDebounce == 0)
-		{
-			pinsDebounce = pins;
-		}
-		else
-		{
-			if(pins != pinsDebounce)
-			{
-				countDebounce = 0;
-				pinsDebounce = pins;
-				printf("debounce %x\n", pins);
-			}
-		}
-		delay(1);
+		perror("E: settle timer");
 	}
-	
-	printf("out\n");
+}
 
-	if(fd == 2)
+static void drain(int bank)
+{
+	PinRing* ring = &rings[bank];
+	unsigned int head;
+	unsigned int tail;
+	PinEdge edge;
+
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	while(tail != head)
 	{
-		if(pins == CODE_POWER)
-		{
-			c = LA_MENU;
-		}
-		else if(pins == CODE_PLAY)
-		{
-			c = LA_PLAYPAUSE;
-		}
-		else if(pins == CODE_CHDWN)
+		edge = ring->edges[tail % RING_SIZE];
+		tail++;
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+		// bouncing, by the time of the edge and not of the drain
+		if((int)(edge.ms - debounceTime[bank]) < 0)
 		{
-			c = LA_DOWN;
+			debounceTime[bank] = edge.ms + DEBOUNCE_TIME;
+			continue;
 		}
-		else
+		debounceTime[bank] = edge.ms + DEBOUNCE_TIME;
+		LOG_D("pins %i edge %x", bank + 1, edge.pins);
+
+		if(!pending[0] && !pending[1])
 		{
-			return 0;
+			arm_settle();
 		}
+		pending[bank] = true;
 	}
-	else
+}
+
+static int dispatch_pins(int bank, int pins)
+{
+	char key[24];
+	int c;
+
+	snprintf(key, sizeof(key), "pins%i:%x", bank + 1, pins);
+	c = la_keymap_lookup(key);
+	if(c == -1)
 	{
-		printf("D: pb pins 1\n");
 		return 0;
 	}
-	
-	printf("D: la_control_input_one %i %x %s\n", fd, pins, DEBUG_CODES[c]);
+
+	LOG_D("pins %i %x %s", bank + 1, pins, DEBUG_CONTROLS[c]);
 	if(callbacks[c] != NULL)
 	{
-		return callbacks[c](c, callback_params[c]);
+		return callbacks[c](c, 1, callback_params[c]);
 	}
 	return 0;
 }
 
+int la_control_input_one(int fd)
+{
+	uint64_t count;
+	int bank;
+	int ret = 1;
+
+	// both the eventfd and the timerfd give a counter
+	if(read(fd, &count, sizeof(count)) != sizeof(count))
+	{
+		return 1;
+	}
+
+	if(fd == fdsPins[0])
+	{
+		drain(0);
+		drain(1);
+		return 1;
+	}
+
+	for(bank=0;bank<2;bank++)
+	{
+		if(pending[bank])
+		{
+			pending[bank] = false;
+			ret = dispatch_pins(bank, read_pins(bank));
+		}
+	}
+	return ret;
+}
+
 void la_exit()
 {
 }
\ No newline at end of file
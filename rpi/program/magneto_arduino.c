@@ -1,4 +1,5 @@
 #include "controles.h"
+#include "keymap.h"
 
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -111,8 +112,9 @@ void la_leds_on()
 
 int la_control_input_one(int fd)
 {
+	char key[24];
 	int val;
-	Control c;
+	int c;
 	int len;
 
 
@@ -152,45 +154,16 @@ int la_control_input_one(int fd)
 		fprintf(stderr, "E: invalid line read from arduino: %s\n", buf);
 		return 0;
 	}
-	//printf("D: PIN %s\n",DEBUG_CODES[val]);
-
-	switch(val)
+	snprintf(key, sizeof(key), "pins:%s", DEBUG_CODES[val]);
+	c = la_keymap_lookup(key);
+	if(c == -1)
 	{
-	case CODE_POWER:
-		c = LA_MENU;
-		break;
-
-	case CODE_PLAY:
-		c = LA_PLAYPAUSE;
-		break;
-
-	case CODE_UP:
-		c = LA_UP;
-		break;
-
-	case CODE_DOWN:
-		c = LA_DOWN;
-		break;
-
-	case CODE_REW:
-		c = LA_LEFT;
-		break;
-
-	case CODE_FF:
-		c = LA_RIGHT;
-		break;
-
-	case CODE_REC:
-		c = LA_OK;
-		break;
-
-	default:
 		return 0;
 	}
 
 	if(callbacks[c] != NULL)
 	{
-		return callbacks[c](c, callback_params[c]);
+		return callbacks[c](c, 1, callback_params[c]);
 	}
 	return 0;
 }
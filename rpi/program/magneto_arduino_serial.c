@@ -1,5 +1,8 @@
 #include "controles.h"
 #include "ecran.h"
+#include "keymap.h"
+#include "stats.h"
+#include "log.h"
 
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -7,24 +10,68 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <errno.h>
 #include <string.h>
+#include <stdarg.h>
+#include <termios.h>
+#include <poll.h>
+#include <time.h>
 
 #include <iconv.h>
 
-#include <wiringPi.h>
-#include <wiringSerial.h>
+// LA_SERIAL=/dev/pts/N runs la against arduino_emul
+#define DEFAULT_SERIAL_DEVICE "/dev/ttyAMA0"
 
 static Callback callbacks[LA_CONTROL_LENGTH] = {0};
 static void* callback_params[LA_CONTROL_LENGTH] = {0};
 
 static int fdsArduino[1] = {-1};
-static FILE* fArduino = NULL;
 
-static char* buf;
-static size_t buf_len;
+// what came from the arduino and isn't handled yet, the indexes run
+// freely and the bytes are at index % IN_RING_SIZE
+#define IN_RING_SIZE 512
+// longer lines are cut
+#define IN_LINE_SIZE 128
+static char in_ring[IN_RING_SIZE];
+static size_t in_head = 0;
+static size_t in_tail = 0;
+
+// the arduino acks at least every 5s (ACK UNFREEZE)
+#define ACK_TIMEOUT_MS 10000
+
+// input event frames of the firmware, between the text lines:
+// SOH, sequence, flags, IR code (4), millis() (4), xor of the 10 bytes
+// from the sequence on, little endian
+#define FRAME_SOH 0x01
+#define FRAME_LEN 12
+#define FRAME_FLAG_REPEAT 0x01
+// a longer delay is a restart of the arduino rather than a slow event
+#define FRAME_MAX_LATENCY_MS 10000
+static bool frame_seen = false;
+static uint8_t frame_seq = 0;
+// arrival time minus the arduino's, the smallest seen
+static uint32_t frame_base_delta = 0;
+
+// keys read but not handled yet: waitAck() reads them in the middle of a
+// redraw, and they are handled once it is over, repeated ones merged
+#define MAX_PENDING_KEYS 16
+typedef struct {
+	Control control;
+	int steps;
+} PendingKey;
+static PendingKey pending_keys[MAX_PENDING_KEYS];
+static int pending_count = 0;
+
+// a held key repeats about every 110ms: nothing for the first
+// frames, then 1 step each, then faster
+#define REPEAT_DELAY_FRAMES 3
+#define REPEAT_FAST_FRAMES 12
+#define REPEAT_FASTER_FRAMES 30
+static int repeat_control = -1;
+static int repeat_frames = 0;
 
 static iconv_t conv;
 static const size_t conv_buf_len = 128;
@@ -32,31 +79,107 @@ static char conv_buf[128];
 static int saved_x = 0, saved_y = 0;
 static int sent_cmds = 0;
 
-int la_init_controls(int** fdControls, int* fdControlCount)
+static int stats_serial_cmds = -1;
+static int stats_serial_ack = -1;
+static int stats_serial_key_delay = -1;
+static int stats_serial_keys_lost = -1;
+
+// same settings as wiringPi's serialOpen, raw 8N1, but reads never wait:
+// the main loop and waitAck() poll
+static int
+serial_open(const char* device)
 {
-	int ret;
+	struct termios options;
+	int fd;
 
-	ret = wiringPiSetup();
-	if(ret) return ret;
+	fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if(fd == -1)
+	{
+		return -1;
+	}
 
-	if ((fdsArduino[0] = serialOpen ("/dev/ttyAMA0", 9600)) < 0)
-    {
-    	fprintf (stderr, "E: Unable to open serial device: %s\n", strerror (errno)) ;
-    	return -1;
-    }
+	tcgetattr(fd, &options);
+	cfmakeraw(&options);
+	cfsetispeed(&options, B9600);
+	cfsetospeed(&options, B9600);
+	options.c_cflag |= (CLOCAL | CREAD);
+	options.c_cflag &= ~(PARENB | CSTOPB | CSIZE);
+	options.c_cflag |= CS8;
+	// with O_NONBLOCK, an empty read fails with EAGAIN instead of
+	// looking like the end of file
+	options.c_cc[VMIN] = 1;
+	options.c_cc[VTIME] = 0;
+	if(tcsetattr(fd, TCSANOW, &options))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
 
-    serialFlush(fdsArduino[0]);
+static void
+serial_printf(const char* format, ...)
+{
+	char line[256];
+	struct pollfd pfd;
+	va_list args;
+	ssize_t written;
+	int len;
+	int off;
 
-    fArduino = fdopen(fdsArduino[0], "r");
+	va_start(args, format);
+	len = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if(len >= sizeof(line))
+	{
+		len = sizeof(line) - 1;
+	}
 
-    buf_len = 128;
-    buf = malloc(buf_len);
-    if(!buf)
+	pfd.fd = fdsArduino[0];
+	pfd.events = POLLOUT;
+	for(off=0;off<len;)
+	{
+		written = write(fdsArduino[0], line + off, len - off);
+		if(written > 0)
+		{
+			off += written;
+		}
+		else if(written == -1 && errno == EAGAIN)
+		{
+			// the output queue is full, at 9600 bauds
+			poll(&pfd, 1, ACK_TIMEOUT_MS);
+		}
+		else if(written == -1 && errno != EINTR)
+		{
+			fprintf(stderr, "E: short write to arduino: %s\n", strerror(errno));
+			return;
+		}
+	}
+}
+
+int la_init_controls(int** fdControls, int* fdControlCount)
+{
+	const char* device;
+
+	device = getenv("LA_SERIAL");
+	if(device == NULL)
+	{
+		device = DEFAULT_SERIAL_DEVICE;
+	}
+
+	if ((fdsArduino[0] = serial_open(device)) < 0)
     {
-    	fprintf (stderr, "E: Unable to allocate buffer: %s\n", strerror (errno)) ;
+    	fprintf (stderr, "E: Unable to open serial device %s: %s\n", device, strerror (errno)) ;
     	return -1;
     }
 
+    tcflush(fdsArduino[0], TCIOFLUSH);
+
+	stats_serial_cmds = la_stats_counter("serial commands");
+	stats_serial_ack = la_stats_histogram("serial ack wait");
+	stats_serial_key_delay = la_stats_histogram("serial key delay");
+	stats_serial_keys_lost = la_stats_counter("serial keys lost");
+
 	*fdControls = fdsArduino;
 	*fdControlCount = 1;
 	return 0;
@@ -79,14 +202,12 @@ void la_wait_input()
 
 void la_leds_off()
 {
-	//serialPutchar (fdsArduino[0], 'J');
-	//serialFlush(fdsArduino[0]);
+	//serial_printf("J");
 }
 
 void la_leds_on()
 {
-	//serialPutchar (fdsArduino[0], 'N');
-	//serialFlush(fdsArduino[0]);
+	//serial_printf("N");
 }
 
 int la_init_ecran()
@@ -104,12 +225,35 @@ int la_init_ecran()
 	return 0;
 }
 
+static int read_available();
+
 void waitAck()
 {
+	struct timespec start;
+	struct pollfd pfd;
+
+	la_stats_add(stats_serial_cmds, 1);
+	if(sent_cmds <= 1)
+	{
+		return;
+	}
+
+	la_stats_start(&start);
+	pfd.fd = fdsArduino[0];
+	pfd.events = POLLIN;
 	while(sent_cmds > 1)
 	{
-		la_control_input_one(fdsArduino[0]);
+		// the keys read meanwhile wait for la_control_input_one()
+		if(poll(&pfd, 1, ACK_TIMEOUT_MS) == 0)
+		{
+			fprintf(stderr, "E: nothing read from arduino\n");
+		}
+		else if(read_available())
+		{
+			break;
+		}
 	}
+	la_stats_since(stats_serial_ack, &start);
 }
 
 void la_lcdHome()
@@ -119,16 +263,16 @@ void la_lcdHome()
 
 void la_lcdClear()
 {
-	fprintf(stdout,"D: sending PL\n");
-	serialPuts(fdsArduino[0], "PL\n");
+	LOG_D("sending PL");
+	serial_printf("PL\n");
 	sent_cmds++;
 	waitAck();
 }
 
 void la_lcdPosition(int col, int row)
 {
-	fprintf(stdout,"D: sending PG%02i%02i\n", col, row);
-	serialPrintf(fdsArduino[0], "PG%02i%02i\n", col, row);
+	LOG_D("sending PG%02i%02i", col, row);
+	serial_printf("PG%02i%02i\n", col, row);
 	saved_x = col;
 	saved_y = row;
 	sent_cmds++;
@@ -137,9 +281,9 @@ void la_lcdPosition(int col, int row)
 
 void la_lcdPutChar(uint8_t c)
 {
-	fprintf(stdout,"D: sending PC%c\n", c);
+	LOG_D("sending PC%c", c);
 	waitAck();
-	serialPrintf(fdsArduino[0], "PC%c\n", c);
+	serial_printf("PC%c\n", c);
 	sent_cmds++;
 }
 
@@ -205,9 +349,9 @@ void la_lcdPuts(char* str)
 		stop = 16 - saved_x;
 		conv_buf[stop] = '\0';
 		tr(conv_buf);
-		printf("D: %s|%s\n", str, conv_buf);
-		printf("D: sending PS%s\n", conv_buf);
-		serialPrintf(fdsArduino[0], "PS%s\n", conv_buf);
+		LOG_D("%s|%s", str, conv_buf);
+		LOG_D("sending PS%s", conv_buf);
+		serial_printf("PS%s\n", conv_buf);
 		sent_cmds++;
 		waitAck();
 	}
@@ -218,103 +362,335 @@ void la_ecran_change_state(bool sleep)
 	//NOOP
 }
 
-int la_control_input_one(int fd)
+static bool
+repeatable(Control c)
 {
-	Control c;
-	int len;
-	const char* cmd;
+	return c == LA_UP || c == LA_DOWN || c == LA_LEFT || c == LA_RIGHT;
+}
 
+static void
+queue_key(Control c, int steps)
+{
+	PendingKey* last;
 
-	len = getline(&buf, &buf_len, fArduino);
-	if(len == 0)
+	last = pending_count > 0 ? &pending_keys[pending_count - 1] : NULL;
+	if(last != NULL && last->control == c && repeatable(c))
 	{
-		fprintf(stderr, "E: nothing read from arduino\n");
-		return -1;
+		last->steps += steps;
 	}
-	else if(strstr(buf, "ACK") == buf)
+	else if(pending_count < MAX_PENDING_KEYS)
 	{
-		fprintf(stdout, "arduino: %s\n", buf);
-		sent_cmds = 0;
-		return 1;
+		pending_keys[pending_count].control = c;
+		pending_keys[pending_count].steps = steps;
+		pending_count++;
 	}
-	else if(strstr(buf, "IR: ") != buf)
+	else
 	{
-		fprintf(stdout, "arduino: %s\n", buf);
-		return 0;
+		fprintf(stderr, "E: too many keys waiting, %s dropped\n", DEBUG_CONTROLS[c]);
 	}
-	else if(buf[len - 1] != '\n')
+}
+
+static void
+on_repeat()
+{
+	int steps;
+
+	if(repeat_control == -1)
 	{
-		fprintf(stdout, "arduino no endl: %s\n", buf);
-		return 0;
+		return;
 	}
-	fprintf(stdout, "IR: %s\n", buf);
-
-	buf[len - 2] = '\0';
-	cmd = buf + 4;
-	if(!strcmp("POWER", cmd))
+	repeat_frames++;
+	if(repeat_frames < REPEAT_DELAY_FRAMES)
 	{
-		c = LA_PLAYPAUSE;
+		steps = 0;
 	}
-	else if(!strcmp("UP", cmd))
+	else if(repeat_frames < REPEAT_FAST_FRAMES)
 	{
-		c = LA_UP;
+		steps = 1;
 	}
-	else if(!strcmp("SETUP", cmd))
+	else if(repeat_frames < REPEAT_FASTER_FRAMES)
 	{
-		c = LA_MENU;
+		steps = 2;
 	}
-	else if(!strcmp("LEFT", cmd))
+	else
 	{
-		c = LA_LEFT;
+		steps = 4;
 	}
-	else if(!strcmp("ENTER", cmd))
+	if(steps > 0)
 	{
-		c = LA_OK;
+		queue_key(repeat_control, steps);
 	}
-	else if(!strcmp("RIGHT", cmd))
+}
+
+static void
+on_key(int c)
+{
+	// only the key just pressed repeats
+	repeat_control = -1;
+	repeat_frames = 0;
+
+	if(c == -1)
 	{
-		c = LA_RIGHT;
+		return;
 	}
-	else if(!strcmp("DOWN", cmd))
+	if(repeatable(c))
 	{
-		c = LA_DOWN;
+		repeat_control = c;
 	}
-	else if(!strcmp("ROTATE", cmd))
+	queue_key(c, 1);
+}
+
+static uint32_t
+read_le32(const uint8_t* b)
+{
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+// the delay over the fastest event seen: the two clocks aren't
+// synchronised, and the transfer takes at least 12.5ms at 9600 bauds
+static void
+record_delay(uint32_t arduino_ms)
+{
+	struct timespec now;
+	uint32_t delta;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	delta = (uint32_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000) - arduino_ms;
+	if(!frame_seen || (int32_t)(delta - frame_base_delta) < 0
+		|| delta - frame_base_delta > FRAME_MAX_LATENCY_MS)
 	{
-		c = LA_PODCAST_DEGUSTER;
+		frame_base_delta = delta;
 	}
-	else if(!strcmp("STOP", cmd))
+	la_stats_record_us(stats_serial_key_delay, (delta - frame_base_delta) * 1000L);
+}
+
+// returns -1 for a corrupt frame
+static int
+handle_frame(const uint8_t* frame)
+{
+	uint32_t code;
+	uint8_t check = 0;
+	uint8_t lost;
+	int c;
+	int i;
+
+	for(i=1;i<FRAME_LEN-1;i++)
+	{
+		check ^= frame[i];
+	}
+	if(check != frame[FRAME_LEN-1])
+	{
+		fprintf(stderr, "E: corrupt input event from arduino\n");
+		la_stats_add(stats_serial_keys_lost, 1);
+		return -1;
+	}
+
+	lost = frame[1] - frame_seq - 1;
+	if(frame_seen && lost != 0)
 	{
-		c = LA_STOP;
+		LOG_I("%u input events lost", lost);
+		la_stats_add(stats_serial_keys_lost, lost);
 	}
-	else if(!strcmp("EXIT", cmd))
+	record_delay(read_le32(frame + 7));
+	frame_seen = true;
+	frame_seq = frame[1];
+
+	code = read_le32(frame + 3);
+	c = la_keymap_lookup_code(code);
+	LOG_D("IR: %08X%s %s", code, frame[2] & FRAME_FLAG_REPEAT ? " repeat" : "",
+		c != -1 ? DEBUG_CONTROLS[c] : "unknown");
+	if(!(frame[2] & FRAME_FLAG_REPEAT))
 	{
-		c = LA_EXIT;
+		on_key(c);
 	}
-	else if(!strcmp("VIDEO", cmd))
+	else if(c != -1 && c == repeat_control)
 	{
-		printf("VIDEOE\n");
-		c = LA_RADIO_INTER;
+		on_repeat();
+	}
+	return 0;
+}
+
+static void
+handle_line(char* line)
+{
+	int c;
+
+	if(strstr(line, "ACK") == line)
+	{
+		LOG_D("arduino: %s", line);
+		sent_cmds = 0;
 	}
-	else if(!strcmp("ZOOM", cmd))
+	else if(strstr(line, "IR: ") != line)
 	{
-		c = LA_RADIO_RENNES;
+		LOG_D("arduino: %s", line);
 	}
-	else if(!strcmp("VOL-", cmd))
+	else if(!strcmp(line + 4, "REPEAT"))
 	{
-		c = LA_RADIO_CANALB;
+		on_repeat();
 	}
 	else
 	{
-		fprintf(stderr, "unsupported command: '%s'\n", cmd);
-		return 0;
+		// firmware without input events
+		LOG_D("%s", line);
+		c = la_keymap_lookup(line + 4);
+		if(c == -1)
+		{
+			fprintf(stderr, "unsupported command: '%s'\n", line + 4);
+		}
+		on_key(c);
 	}
+}
+
+// handles the complete lines and frames in the ring
+static void
+split_input()
+{
+	char line[IN_LINE_SIZE];
+	uint8_t frame[FRAME_LEN];
+	uint8_t b;
+	size_t i;
+	size_t n;
 
-	if(callbacks[c] != NULL)
+	while(in_tail != in_head)
 	{
-		return callbacks[c](c, callback_params[c]);
+		// frames start where a line would
+		if(in_ring[in_tail % IN_RING_SIZE] == FRAME_SOH)
+		{
+			if(in_head - in_tail < FRAME_LEN)
+			{
+				return;
+			}
+			for(i=0;i<FRAME_LEN;i++)
+			{
+				frame[i] = in_ring[(in_tail + i) % IN_RING_SIZE];
+			}
+			if(handle_frame(frame))
+			{
+				// a byte was lost: the next line or frame may start in
+				// these 12 bytes, look for it from the next one
+				in_tail++;
+			}
+			else
+			{
+				in_tail += FRAME_LEN;
+			}
+			continue;
+		}
+
+		for(i=in_tail;i!=in_head && in_ring[i % IN_RING_SIZE]!='\n'
+			&& in_ring[i % IN_RING_SIZE]!=FRAME_SOH;i++);
+		if(i != in_head && in_ring[i % IN_RING_SIZE] == FRAME_SOH)
+		{
+			// the rest of a corrupt frame, or of a line cut by a reset:
+			// framing goes on from the next frame
+			LOG_D("arduino %zu bytes dropped before a frame", i - in_tail);
+			in_tail = i;
+			continue;
+		}
+		if(i == in_head)
+		{
+			if(in_head - in_tail >= IN_LINE_SIZE)
+			{
+				LOG_D("arduino no endl, %zu bytes dropped", in_head - in_tail);
+				in_tail = in_head;
+			}
+			return;
+		}
+		for(n=0;in_tail<i;in_tail++)
+		{
+			b = in_ring[in_tail % IN_RING_SIZE];
+			if((b < ' ' || b > '~') && b != '\r')
+			{
+				// the rest of a corrupt frame: the line starts after it
+				n = 0;
+			}
+			else if(n < IN_LINE_SIZE - 1)
+			{
+				line[n++] = b;
+			}
+		}
+		in_tail++;
+		if(n > 0 && line[n - 1] == '\r')
+		{
+			n--;
+		}
+		line[n] = '\0';
+		handle_line(line);
 	}
-	return 0;
+}
+
+// everything received already, in one go, without waiting
+static int
+read_available()
+{
+	ssize_t len;
+	size_t offset;
+	size_t room;
+
+	for(;;)
+	{
+		if(in_head - in_tail == IN_RING_SIZE)
+		{
+			// split_input() cuts lines before that
+			in_tail = in_head;
+		}
+		offset = in_head % IN_RING_SIZE;
+		room = IN_RING_SIZE - (in_head - in_tail);
+		if(room > IN_RING_SIZE - offset)
+		{
+			room = IN_RING_SIZE - offset;
+		}
+
+		len = read(fdsArduino[0], in_ring + offset, room);
+		if(len > 0)
+		{
+			in_head += len;
+			split_input();
+		}
+		else if(len == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		else if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return 0;
+		}
+		else
+		{
+			fprintf(stderr, "E: arduino is gone: %s\n", len == 0 ? "end of file" : strerror(errno));
+			return -1;
+		}
+	}
+}
+
+int la_control_input_one(int fd)
+{
+	PendingKey key;
+	int ret = 1;
+
+	if(read_available())
+	{
+		return -1;
+	}
+
+	// keys coming while the previous ones redraw are merged and handled here
+	while(pending_count > 0)
+	{
+		key = pending_keys[0];
+		pending_count--;
+		memmove(pending_keys, pending_keys + 1, pending_count * sizeof(PendingKey));
+		ret = 0;
+		if(callbacks[key.control] != NULL)
+		{
+			ret = callbacks[key.control](key.control, key.steps, callback_params[key.control]);
+		}
+		if(ret < 0)
+		{
+			// they were meant for a state that is gone
+			pending_count = 0;
+		}
+	}
+	return ret;
 }
 
 void la_exit()
@@ -324,8 +700,8 @@ void la_exit()
 
 void la_ecran_show_off()
 {
-	fprintf(stdout,"D: sending PF\n");
-	serialPuts(fdsArduino[0], "PF\n");
+	LOG_D("sending PF");
+	serial_printf("PF\n");
 	sent_cmds++;
 	waitAck();
 }
@@ -0,0 +1,360 @@
+#include "controles.h"
+#include "keymap.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+
+#include <linux/gpio.h>
+
+/* The buttons of magneto.c through the GPIO character device (uapi v2)
+   instead of wiringPi: the kernel queues timestamped edges on the fd of
+   each bank, polled by the main loop, and debounces them when it can.
+   Otherwise, edges are debounced by their timestamps and the code is
+   read once the pins have settled, when a timerfd expires.
+
+   LA_GPIO_CHIP is the chip (/dev/gpiochip0) and LA_GPIO_LINES the 8
+   line offsets, bank 1 then bank 2 (the BCM numbers of the wiringPi
+   pins of magneto.c by default).
+
+   On any Linux box, with gpio-sim and configfs:
+     modprobe gpio-sim
+     mkdir -p /sys/kernel/config/gpio-sim/la/bank0
+     echo 8 > /sys/kernel/config/gpio-sim/la/bank0/num_lines
+     echo 1 > /sys/kernel/config/gpio-sim/la/live
+     LA_GPIO_CHIP=/dev/$(cat /sys/kernel/config/gpio-sim/la/bank0/chip_name) \
+       LA_GPIO_LINES=0,1,2,3,4,5,6,7 ./gpio_keys
+   then PLAY (0x7 on bank 2) is, in
+   /sys/devices/platform/<dev_name>/<chip_name>/:
+     echo pull-up > sim_gpio5/pull; echo pull-up > sim_gpio6/pull
+     echo pull-up > sim_gpio4/pull
+   and the same with pull-down to release it.
+*/
+
+#define DEFAULT_GPIO_CHIP "/dev/gpiochip0"
+#define DEFAULT_GPIO_LINES "22,10,9,11,12,16,20,21"
+
+#define	DEBOUNCE_TIME	200
+// the 4 pins of a bank don't change all at once
+#define SETTLE_TIME 300
+
+static Callback callbacks[LA_CONTROL_LENGTH] = {0};
+static void* callback_params[LA_CONTROL_LENGTH] = {0};
+
+// bank 1, bank 2, then the settle timerfd without kernel debouncing
+static int fdsPins[3] = {-1, -1, -1};
+static bool kernel_debounce = false;
+
+// without kernel debouncing
+static uint64_t last_edge_ns[2] = {0};
+static bool pending[2] = {false};
+
+static int
+parse_lines(const char* str, uint32_t offsets[8])
+{
+	char* end;
+	int i;
+
+	for(i=0;i<8;i++)
+	{
+		errno = 0;
+		offsets[i] = strtoul(str, &end, 10);
+		if(errno != 0 || end == str || (*end != (i < 7 ? ',' : '\0')))
+		{
+			return -1;
+		}
+		str = end + 1;
+	}
+	return 0;
+}
+
+// the first line of the bank gives the edges, the others are only read
+static int
+request_bank(int chip_fd, const uint32_t offsets[4], uint64_t clock, uint32_t debounce_us)
+{
+	struct gpio_v2_line_request req;
+	struct gpio_v2_line_config_attribute* attr;
+
+	memset(&req, 0, sizeof(req));
+	memcpy(req.offsets, offsets, 4 * sizeof(uint32_t));
+	req.num_lines = 4;
+	snprintf(req.consumer, sizeof(req.consumer), "la");
+	req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN;
+
+	// every code has bit 0 set: pressing a key is a rising edge
+	attr = &req.config.attrs[req.config.num_attrs++];
+	attr->attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+	attr->attr.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN
+		| GPIO_V2_LINE_FLAG_EDGE_RISING | clock;
+	attr->mask = 1;
+	if(debounce_us != 0)
+	{
+		attr = &req.config.attrs[req.config.num_attrs++];
+		attr->attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+		attr->attr.debounce_period_us = debounce_us;
+		attr->mask = 1;
+	}
+
+	if(ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) == -1)
+	{
+		return -1;
+	}
+	return req.fd;
+}
+
+// hardware timestamps and kernel debouncing when the chip has them
+static int
+request_banks(int chip_fd, const uint32_t offsets[8])
+{
+	static const struct {
+		uint64_t clock;
+		uint32_t debounce_us;
+		const char* name;
+	} modes[] = {
+		{ GPIO_V2_LINE_FLAG_EVENT_CLOCK_HTE, DEBOUNCE_TIME * 1000, "hardware timestamps, kernel debounce" },
+		{ 0, DEBOUNCE_TIME * 1000, "kernel debounce" },
+		{ GPIO_V2_LINE_FLAG_EVENT_CLOCK_HTE, 0, "hardware timestamps" },
+		{ 0, 0, "monotonic timestamps" },
+	};
+	size_t m;
+	int bank;
+
+	for(m=0;m<sizeof(modes)/sizeof(modes[0]);m++)
+	{
+		for(bank=0;bank<2;bank++)
+		{
+			fdsPins[bank] = request_bank(chip_fd, offsets + 4 * bank, modes[m].clock, modes[m].debounce_us);
+			if(fdsPins[bank] == -1)
+			{
+				break;
+			}
+		}
+		if(bank == 2)
+		{
+			LOG_I("gpio: %s", modes[m].name);
+			kernel_debounce = modes[m].debounce_us != 0;
+			return 0;
+		}
+		if(bank == 1)
+		{
+			close(fdsPins[0]);
+			fdsPins[0] = -1;
+		}
+		if(errno != EINVAL && errno != EOPNOTSUPP)
+		{
+			break;
+		}
+	}
+	perror("E: gpio line request");
+	return -1;
+}
+
+int la_init_controls(int** fdControls, int* fdControlCount)
+{
+	const char* chip;
+	const char* lines;
+	uint32_t offsets[8];
+	int chip_fd;
+	int ret;
+
+	chip = getenv("LA_GPIO_CHIP");
+	if(chip == NULL)
+	{
+		chip = DEFAULT_GPIO_CHIP;
+	}
+	lines = getenv("LA_GPIO_LINES");
+	if(lines == NULL)
+	{
+		lines = DEFAULT_GPIO_LINES;
+	}
+	if(parse_lines(lines, offsets))
+	{
+		fprintf(stderr, "E: LA_GPIO_LINES needs 8 line offsets: %s\n", lines);
+		return -1;
+	}
+
+	chip_fd = open(chip, O_RDONLY | O_CLOEXEC);
+	if(chip_fd == -1)
+	{
+		fprintf(stderr, "E: Unable to open %s: %s\n", chip, strerror(errno));
+		return -1;
+	}
+	// the line requests stay without the chip
+	ret = request_banks(chip_fd, offsets);
+	close(chip_fd);
+	if(ret)
+	{
+		return -1;
+	}
+
+	*fdControls = fdsPins;
+	*fdControlCount = 2;
+	if(!kernel_debounce)
+	{
+		fdsPins[2] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if(fdsPins[2] == -1)
+		{
+			perror("E: settle timer");
+			return -1;
+		}
+		*fdControlCount = 3;
+	}
+	return 0;
+}
+
+void la_on_key(Control ctrl, Callback fn, void* param)
+{
+	if(ctrl>=0 && ctrl < LA_CONTROL_LENGTH)
+	{
+		callbacks[ctrl] = fn;
+		callback_params[ctrl] = param;
+	}
+}
+
+void la_wait_input()
+{
+	fprintf(stderr, "E: UNSUPPORTED la_wait_input\n");
+	exit(-1);
+}
+
+static int
+read_pins(int bank)
+{
+	struct gpio_v2_line_values values = {0};
+
+	values.mask = 0xf;
+	if(ioctl(fdsPins[bank], GPIO_V2_LINE_GET_VALUES_IOCTL, &values) == -1)
+	{
+		perror("E: gpio read");
+		return 0;
+	}
+	return values.bits & 0xf;
+}
+
+static int
+dispatch_pins(int bank, int pins)
+{
+	char key[24];
+	int c;
+
+	snprintf(key, sizeof(key), "pins%i:%x", bank + 1, pins);
+	c = la_keymap_lookup(key);
+	if(c == -1)
+	{
+		return 0;
+	}
+
+	LOG_D("gpio: pins %i %x %s", bank + 1, pins, DEBUG_CONTROLS[c]);
+	if(callbacks[c] != NULL)
+	{
+		return callbacks[c](c, 1, callback_params[c]);
+	}
+	return 0;
+}
+
+static void
+arm_settle()
+{
+	struct itimerspec its = {{0}};
+
+	its.it_value.tv_sec = SETTLE_TIME / 1000;
+	its.it_value.tv_nsec = (SETTLE_TIME % 1000) * 1000000L;
+	if(timerfd_settime(fdsPins[2], 0, &its, NULL) == -1)
+	{
+		perror("E: settle timer");
+	}
+}
+
+static int
+on_settled()
+{
+	uint64_t count;
+	int bank;
+	int ret = 1;
+
+	if(read(fdsPins[2], &count, sizeof(count)) != sizeof(count))
+	{
+		return 1;
+	}
+	for(bank=0;bank<2;bank++)
+	{
+		if(pending[bank])
+		{
+			pending[bank] = false;
+			ret = dispatch_pins(bank, read_pins(bank));
+		}
+	}
+	return ret;
+}
+
+int la_control_input_one(int fd)
+{
+	struct gpio_v2_line_event events[16];
+	ssize_t len;
+	size_t i;
+	bool pressed = false;
+	int bank;
+
+	if(fd == fdsPins[2])
+	{
+		return on_settled();
+	}
+	bank = fd == fdsPins[0] ? 0 : 1;
+
+	len = read(fd, events, sizeof(events));
+	if(len < (ssize_t)sizeof(events[0]))
+	{
+		return 1;
+	}
+
+	for(i=0;i<len/sizeof(events[0]);i++)
+	{
+		// bouncing, by the time of the edge and not of the read
+		if(!kernel_debounce && last_edge_ns[bank] != 0
+			&& events[i].timestamp_ns - last_edge_ns[bank] < DEBOUNCE_TIME * 1000000ULL)
+		{
+			last_edge_ns[bank] = events[i].timestamp_ns;
+			continue;
+		}
+		last_edge_ns[bank] = events[i].timestamp_ns;
+		pressed = true;
+	}
+	if(!pressed)
+	{
+		return 1;
+	}
+
+	if(kernel_debounce)
+	{
+		// stable for DEBOUNCE_TIME already
+		return dispatch_pins(bank, read_pins(bank));
+	}
+	if(!pending[0] && !pending[1])
+	{
+		arm_settle();
+	}
+	pending[bank] = true;
+	return 1;
+}
+
+void la_exit()
+{
+	int i;
+
+	for(i=0;i<3;i++)
+	{
+		if(fdsPins[i] != -1)
+		{
+			close(fdsPins[i]);
+			fdsPins[i] = -1;
+		}
+	}
+}
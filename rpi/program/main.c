@@ -25,19 +25,38 @@
 #include <mpd/tag.h>
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <getopt.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <time.h>
 
 #include <curl/curl.h>
 
 #include "ecran.h"
 #include "controles.h"
+#include "resume.h"
+#include "wifi.h"
+#include "internet.h"
+#include "radios.h"
+#include "boot.h"
+#include "stats.h"
+#include "log.h"
+#include "trace.h"
+#include "fmt.h"
+#include "group.h"
+#include "keymap.h"
+#include "episodes.h"
+#include "pool.h"
 
 #define BRIGHT 1
 #define RED 31
@@ -49,24 +68,57 @@
 #define DEFAULT_LOG_FILE "/var/log/la.out"
 #define DEFAULT_ERROR_FILE "/var/log/la.err"
 #define DEFAULT_WLAN_ITF "wlan0"
+#define DEFAULT_RADIOS_FILE "/etc/la-radios.conf"
+#define DEFAULT_RADIOS_CACHE "/var/cache/la-radios"
+#define DEFAULT_RESUME_INDEX "/var/cache/la-resume"
+#define DEFAULT_STATS_SOCKET "/run/la.stats"
+// other rooms' mpd to keep in step with this one
+#define DEFAULT_GROUP_FILE "/etc/la-group.conf"
+// the keys of the remote, LA_KEYMAP to try another file
+#define DEFAULT_KEYMAP_FILE "/etc/la-keymap.conf"
+
+// mpd may still be starting: retry quickly at first, then less often
+#define MPD_CONNECT_FIRST_DELAY_MS 50
+#define MPD_CONNECT_MAX_DELAY_MS 2000
+#define MPD_CONNECT_DEADLINE_MS 90000
+
+// once running, a lost connection is retried from the event loop
+#define MPD_RECONNECT_FIRST_DELAY_MS 20
+#define MPD_RECONNECT_MAX_DELAY_MS 5000
+#define MPD_RECONNECT_TIMEOUT_MS 1000
+#define MPD_TIMEOUT_MS 30000
+// ping an idle connection so that a dead one is noticed
+#define MPD_PING_INTERVAL 60
+#define MPD_PING_TIMEOUT_MS 2000
+
+// the next episode is queued that long before the end of the last one
+#define NEXT_EPISODE_LEAD_MS 10000
+// and looked for again that often while the pool reads its directory
+#define EPISODES_RETRY_MS 500
 //#define CONFIG_SLEEP 1
 
 typedef enum {
 	LA_STATE_PLAYING, LA_STATE_MENU, LA_STATE_RESUME, LA_STATE_LIST, LA_STATE_ADD_REPLACE, LA_STATE_VOLUME, LA_STATE_SETTINGS, LA_STATE_RADIO
 } LaState;
 
-static int print_current_time(unsigned int played, unsigned int total);
+static void print_current_time(unsigned int played, unsigned int total);
 static void print_list(int old_state_list);
+static void print_menu(int old_state_menu);
 static void print_settings();
 static int do_shutdown(struct mpd_connection *conn);
 static int print_status(struct mpd_connection *conn);
+static bool send_idle(struct mpd_connection* conn);
+static void dispatch_idle(struct mpd_connection* conn, enum mpd_idle idle);
 static int do_sleep(struct mpd_connection* conn);
 static int do_wifi_status();
+static int on_wifi_changed(struct mpd_connection* conn, int wifi_fd);
+static int on_internet_changed(struct mpd_connection* conn, int changed);
 static void free_list_state();
 static int reconnect_to_mpd(struct mpd_connection **conn);
 static int do_update_played(struct mpd_connection *conn);
 static int do_play(struct mpd_connection* conn);
 static int do_radio(Control control, struct mpd_connection* conn);
+static const char* la_mpd_song_get_filename(const struct mpd_song* song);
 
 
 LaState state;
@@ -82,19 +134,51 @@ char* state_list_path;
 int state_list_dir_index;
 int state_list_rl_offset;
 int* resume_played;
-bool ignore_next_idle;
-
-#define LIST_RADIOS_LEN 3
-const char* list_radios[LIST_RADIOS_LEN] = {
-	"France Inter",
-	"Radio Rennes",
-	"Canal B"
-};
-const char* list_radios_uris[LIST_RADIOS_LEN] = {
-	"http://direct.franceinter.fr/live/franceinter-midfi.mp3",
-	"http://sv2.vestaradio.com:5750/;stream.mp3",
-	"http://stream.levillage.org/canalb?1362308951917.mp3"
-};
+bool pending_stream_play;
+
+// what print_status last showed, to skip redrawing for our own commands
+static struct {
+	bool valid;
+	int song_id;
+	enum mpd_state state;
+	unsigned elapsed;
+} shown_status;
+
+// events received while another screen was shown, replayed on return
+static enum mpd_idle pending_idle = 0;
+
+// registry index of each line of the Radio list
+size_t* list_radios_order;
+
+// name of the stored playlist keeping the podcast queue while in radio mode
+#define RADIO_STASH_PLAYLIST "la-stash"
+bool radio_mode;
+// resolved URLs the queue was built with
+unsigned radio_mode_generation;
+
+// current mpd connection, NULL while reconnecting
+struct mpd_connection* mpd_conn;
+int mpd_epollfd = -1;
+int mpd_watched_fd = -1;
+int mpd_timer_fd = -1;
+// fires shortly before the end of the queue
+int next_timer_fd = -1;
+long mpd_backoff_ms;
+struct timespec mpd_lost_at;
+// handlers of the controls, called with the current connection
+typedef int (*ControlHandler)(Control control, struct mpd_connection* conn);
+ControlHandler control_handlers[LA_CONTROL_LENGTH];
+// repeats of the key being handled, moves by as many steps at once
+int control_steps = 1;
+int control_stats[LA_CONTROL_LENGTH];
+
+int stats_mpd_status = -1;
+int stats_mpd_ping = -1;
+int stats_mpd_idle = -1;
+int stats_mpd_reconnect = -1;
+int stats_mpd_reconnects = -1;
+int stats_controls_dropped = -1;
+int stats_loop_wakeups = -1;
 
 int state_add_replace;
 
@@ -111,6 +195,13 @@ bool asleep = false;
 timer_t timer_sleep;
 volatile sig_atomic_t sleep_flag = 0;
 
+// SIGUSR1 dumps the stats to the log
+volatile sig_atomic_t stats_flag = 0;
+
+// -p: keys are read from a recorded trace instead of the remote
+static const char* trace_replay_path = NULL;
+static double trace_speed = 1.0;
+
 #define LOG_INFO(x, ...) {printf("    [info]" x "\n", __VA_ARGS__);}
 #define LOG_WARNING(x, ...) \
 {\
@@ -137,9 +228,10 @@ volatile sig_atomic_t sleep_flag = 0;
 static int
 reconnect_to_mpd(struct mpd_connection **conn)
 {
-	*conn = mpd_connection_new(NULL, 0, 30000);
+	*conn = mpd_connection_new(NULL, 0, MPD_TIMEOUT_MS);
 	if (*conn == NULL) {
-		LOG_ERROR("%s", "Out of memory");
+		// not LOG_ERROR: this may run before the display is ready
+		fprintf(stderr, "E: Out of memory\n");
 		return -1;
 	}
 
@@ -156,11 +248,13 @@ reconnect_to_mpd(struct mpd_connection **conn)
 static int
 connect_to_mpd(struct mpd_connection **conn)
 {
-	int retry = 30;
+	struct timespec delay;
+	long delay_ms = MPD_CONNECT_FIRST_DELAY_MS;
+	long waited = 0;
 	int t = 1;
 	int ret;
 	// pour attendre que le service soit bien démarré
-	while(t <= retry){
+	while(1){
 		ret = reconnect_to_mpd(conn);
 		if (ret == -1)  // fatal
 		{
@@ -169,18 +263,41 @@ connect_to_mpd(struct mpd_connection **conn)
 
 		if (ret == 0)
 		{
+			LOG_I("connected to mpd after %i attempt(s), %lims", t, waited);
 			return 0;
 		}
 		else
 		{
-			LOG_ERROR("%d/%d %s", t, retry, mpd_connection_get_error_message(*conn));
+			fprintf(stderr, "E: mpd %d (%lims): %s\n", t, waited, mpd_connection_get_error_message(*conn));
 			mpd_connection_free(*conn);
 			*conn = NULL;
-			sleep(3);
+			if(waited >= MPD_CONNECT_DEADLINE_MS)
+			{
+				return -1;
+			}
+			// a refused connection fails at once, so short delays are cheap
+			delay.tv_sec = delay_ms / 1000;
+			delay.tv_nsec = (delay_ms % 1000) * 1000000;
+			nanosleep(&delay, NULL);
+			waited += delay_ms;
+			delay_ms = delay_ms * 2 > MPD_CONNECT_MAX_DELAY_MS ? MPD_CONNECT_MAX_DELAY_MS : delay_ms * 2;
 		}
 		t++;
 	}
-	return -1;
+}
+
+typedef struct {
+	struct mpd_connection* conn;
+	int ret;
+} MpdConnectResult;
+
+static void*
+connect_to_mpd_thread(void* arg)
+{
+	MpdConnectResult* result = arg;
+
+	result->ret = connect_to_mpd(&result->conn);
+	return NULL;
 }
 
 static int
@@ -192,25 +309,202 @@ do_clear_current(struct mpd_connection* conn)
 		return -1;
 	}
 
-	printf("D: do_clear_current\n");
+	LOG_D("do_clear_current");
 	if(!mpd_run_clear(conn))
 	{
 		LOG_ERROR("%s", mpd_connection_get_error_message(conn));
 		return -1;
 	}
-	printf("D: do_clear_current end\n");
+	LOG_D("do_clear_current end");
+
+	return 0;
+}
+
+static int
+stash_queue(struct mpd_connection* conn)
+{
+	if(do_update_played(conn))
+	{
+		return -1;
+	}
+
+	// the playlist doesn't exist the first time
+	if(!mpd_run_rm(conn, RADIO_STASH_PLAYLIST))
+	{
+		if(mpd_connection_get_error(conn) != MPD_ERROR_SERVER
+			|| !mpd_connection_clear_error(conn))
+		{
+			LOG_ERROR("%s", mpd_connection_get_error_message(conn));
+			return -1;
+		}
+	}
+
+	if(!mpd_run_save(conn, RADIO_STASH_PLAYLIST))
+	{
+		LOG_ERROR("%s", mpd_connection_get_error_message(conn));
+		return -1;
+	}
+	return 0;
+}
+
+static int
+enter_radio_mode(struct mpd_connection* conn, int radio, bool stash)
+{
+	size_t i;
+
+	LOG_D("enter radio mode");
+
+	if(stash && stash_queue(conn))
+	{
+		return -1;
+	}
+
+	// all the stations at once, so that switching is a single playpos
+	radio_mode_generation = la_radios_generation();
+	mpd_command_list_begin(conn, false);
+	mpd_send_clear(conn);
+	for(i=0;i<la_radios_count();i++)
+	{
+		mpd_send_add(conn, la_radios_uri(i));
+	}
+	mpd_send_play_pos(conn, radio);
+	mpd_command_list_end(conn);
+
+	if(!mpd_response_finish(conn))
+	{
+		LOG_ERROR("%s", mpd_connection_get_error_message(conn));
+		return -1;
+	}
+
+	radio_mode = true;
+	return 0;
+}
+
+static int
+leave_radio_mode(struct mpd_connection* conn, bool restore)
+{
+	if(!radio_mode)
+	{
+		return 0;
+	}
+
+	LOG_D("leave radio mode%s", restore ? ", restoring queue" : "");
+	radio_mode = false;
+
+	if(restore)
+	{
+		mpd_command_list_begin(conn, false);
+		mpd_send_clear(conn);
+		mpd_send_load(conn, RADIO_STASH_PLAYLIST);
+		mpd_command_list_end(conn);
+
+		if(!mpd_response_finish(conn))
+		{
+			LOG_ERROR("%s", mpd_connection_get_error_message(conn));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+do_play_radio(struct mpd_connection* conn, int radio)
+{
+	const Radio* r;
+
+	r = la_radios_get(radio);
+	if(r == NULL)
+	{
+		fprintf(stderr, "E: no radio %i\n", radio);
+		return 0;
+	}
+	LOG_D("radio %s", r->name);
+
+	CHECK_CONNECTION(conn);
+	mpd_run_noidle(conn);
+
+	if(radio_mode && radio_mode_generation != la_radios_generation())
+	{
+		// some stream moved since the queue was built: build it again
+		if(enter_radio_mode(conn, radio, false))
+		{
+			return -1;
+		}
+	}
+	else if(radio_mode)
+	{
+		if(!mpd_run_play_pos(conn, radio))
+		{
+			LOG_ERROR("%s", mpd_connection_get_error_message(conn));
+			return -1;
+		}
+	}
+	else if(enter_radio_mode(conn, radio, true))
+	{
+		return -1;
+	}
+
+	state = LA_STATE_PLAYING;
+	la_lcdClear();
+	la_lcdHome();
+	la_lcdPuts(r->name);
+	shown_status.valid = false;
+
+	// the player idle event will bring the full status
+	if(!send_idle(conn))
+	{
+		LOG_ERROR("Unable to put mpd in idle mode%s\n","");
+		return -1;
+	}
 
 	return 0;
 }
 
+static bool
+is_radio_queue(struct mpd_connection* conn)
+{
+	struct mpd_song *song;
+	const char *value;
+	int i = 0;
+	bool ret = true;
+
+	mpd_send_list_queue_meta(conn);
+	while((song = mpd_recv_song(conn)) != NULL)
+	{
+		value = mpd_song_get_uri(song);
+		if(value == NULL || la_radios_find(value) != i)
+		{
+			ret = false;
+		}
+		i++;
+		mpd_song_free(song);
+	}
+	mpd_response_finish(conn);
+
+	// not CHECK_CONNECTION: -1 would read as true
+	if(mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS)
+	{
+		LOG_ERROR("%s", mpd_connection_get_error_message(conn));
+		return false;
+	}
+
+	return ret && i == la_radios_count();
+}
+
 static int
 do_replace_playing_with_uri(struct mpd_connection* conn, bool replace, const char* file)
 {
-	printf("D: switch to %s\n", file);
+	LOG_D("switch to %s", file);
 
 	CHECK_CONNECTION(conn);
 	mpd_run_noidle(conn);
 
+	// appending goes after the podcasts that were there before the radio
+	if(leave_radio_mode(conn, !replace))
+	{
+		return -1;
+	}
+
 	if(replace)
 	{
 		if(do_clear_current(conn))
@@ -231,7 +525,10 @@ do_replace_playing_with_uri(struct mpd_connection* conn, bool replace, const cha
 		return -1;
 	}
 
-	if(!mpd_send_idle(conn))
+	// the next episode comes from this listing, read by the pool
+	la_episodes_load(file);
+
+	if(!send_idle(conn))
 	{
 		LOG_ERROR("Unable to put mpd in idle mode%s\n","");
 		return -1;
@@ -253,11 +550,16 @@ do_resume_selected(struct mpd_connection* conn)
 	char* file = list_uris[state_list];
 	int played = resume_played[state_list];
 
-	printf("D: switch to %s at %i\n", file, played);
+	LOG_D("switch to %s at %i", file, played);
 
 	CHECK_CONNECTION(conn);
 	mpd_run_noidle(conn);
 
+	if(leave_radio_mode(conn, false))
+	{
+		return -1;
+	}
+
 	if(do_clear_current(conn))
 	{
 		LOG_ERROR("do_resume_selected %s failed\n", "do_clear_current");
@@ -282,7 +584,9 @@ do_resume_selected(struct mpd_connection* conn)
 		return -1;
 	}
 
-	if(!mpd_send_idle(conn))
+	la_episodes_load(file);
+
+	if(!send_idle(conn))
 	{
 		LOG_ERROR("Unable to put mpd in idle mode%s\n","");
 		return -1;
@@ -292,15 +596,11 @@ do_resume_selected(struct mpd_connection* conn)
 }
 
 static int
-fetch_and_print_volume(struct mpd_connection *conn)
+print_volume(struct mpd_connection *conn)
 {
 	struct mpd_status *status;
 	int volume;
 
-
-	CHECK_CONNECTION(conn);
-	mpd_run_noidle(conn);
-
 	status = mpd_run_status(conn);
 	if (!status) {
 		LOG_ERROR("%s", mpd_connection_get_error_message(conn));
@@ -318,7 +618,7 @@ fetch_and_print_volume(struct mpd_connection *conn)
 	}
 	else
 	{
-		snprintf(log_buffer,16, "%2i%%", volume);
+		la_fmt_percent(log_buffer, sizeof(log_buffer), 0, volume);
 		la_lcdPuts(log_buffer);
 	}
 
@@ -326,8 +626,21 @@ fetch_and_print_volume(struct mpd_connection *conn)
 
 	mpd_response_finish(conn);
 	CHECK_CONNECTION(conn);
+	return 0;
+}
+
+static int
+fetch_and_print_volume(struct mpd_connection *conn)
+{
+	CHECK_CONNECTION(conn);
+	mpd_run_noidle(conn);
+
+	if(print_volume(conn))
+	{
+		return -1;
+	}
 
-	if(!mpd_send_idle(conn))
+	if(!send_idle(conn))
 	{
 		LOG_ERROR("Unable to put mpd in idle mode%s\n","");
 		return -1;
@@ -339,9 +652,6 @@ fetch_and_print_volume(struct mpd_connection *conn)
 static int
 do_change_volume(struct mpd_connection *conn, int inc, bool set)
 {
-	struct mpd_status *status;
-	int volume;
-
 	CHECK_CONNECTION(conn);
 	mpd_run_noidle(conn);
 
@@ -362,33 +672,12 @@ do_change_volume(struct mpd_connection *conn, int inc, bool set)
 		}
 	}
 
-	status = mpd_run_status(conn);
-	if (!status) {
-		LOG_ERROR("%s", mpd_connection_get_error_message(conn));
-		return -1;
-	}
-
-	volume = mpd_status_get_volume(status);
-
-	la_lcdClear();
-	la_lcdHome();
-
-	if(volume == -1)
-	{
-		la_lcdPuts("E: no volume");
-	}
-	else
+	if(print_volume(conn))
 	{
-		snprintf(log_buffer,16, "%2i%%", volume);
-		la_lcdPuts(log_buffer);
+		return -1;
 	}
 
-	mpd_status_free(status);
-
-	mpd_response_finish(conn);
-	CHECK_CONNECTION(conn);
-
-	if(!mpd_send_idle(conn))
+	if(!send_idle(conn))
 	{
 		LOG_ERROR("Unable to put mpd in idle mode%s\n","");
 		return -1;
@@ -407,8 +696,11 @@ print_status(struct mpd_connection *conn)
 	char* tmp;
 	enum mpd_state mpdstate;
 	unsigned int current, total;
+	struct timespec start;
 
+	la_stats_start(&start);
 	la_lcdClear();
+	pending_idle &= ~MPD_IDLE_PLAYER;
 
 	status = mpd_run_status(conn);
 	if (!status) {
@@ -418,6 +710,10 @@ print_status(struct mpd_connection *conn)
 	mpdstate = mpd_status_get_state(status);
 	current = mpd_status_get_elapsed_time(status);
 	total  = mpd_status_get_total_time(status);
+	shown_status.valid = true;
+	shown_status.song_id = mpd_status_get_song_id(status);
+	shown_status.state = mpdstate;
+	shown_status.elapsed = current;
 	mpd_status_free(status);
 	mpd_response_finish(conn);
 
@@ -487,6 +783,7 @@ print_status(struct mpd_connection *conn)
 		break;
 	case MPD_STATE_PLAY:
 		la_lcdPutChar('P');
+		la_boot_mark("playback");
 		break;
 	case MPD_STATE_PAUSE:
 		print_current_time(current, total);
@@ -499,6 +796,7 @@ print_status(struct mpd_connection *conn)
 	}
 	CHECK_CONNECTION(conn);
 
+	la_stats_since(stats_mpd_status, &start);
 	return 0;
 }
 
@@ -508,25 +806,33 @@ do_update_played(struct mpd_connection *conn)
 	struct mpd_status *status;
 	struct mpd_song *song;
 	const char *value;
-	char* tmp;
-	char* uri;                     
+	// song is kept until the end: uri and title point into it
+	const char* uri;
+	const char* title;
 	int played;
+	int duration;
 	bool previous;
+	time_t now;
+	char played_str[12];
+	char played_at[24];
+	int ret = 0;
 
 	uri = NULL;
+	title = NULL;
+	duration = 0;
 	previous = false;
 
 	song = mpd_run_current_song(conn);
 	if (song == NULL)
 	{
-		printf("D: do_update_played no current song\n");
+		LOG_D("do_update_played no current song");
 		mpd_response_finish(conn);
 		song = mpd_run_get_queue_song_pos(conn, 0);
 		previous = true;
 		
 		if(song == NULL)
 		{
-			printf("D: do_update_played no previous song\n");
+			LOG_D("do_update_played no previous song");
 			mpd_response_finish(conn);
 			CHECK_CONNECTION(conn);
 		}
@@ -543,11 +849,12 @@ do_update_played(struct mpd_connection *conn)
 		{
 			if(strstr(value, "http://") != value)
 			{
-				uri = strdup(value);
+				uri = value;
+				title = la_mpd_song_get_filename(song);
+				duration = mpd_song_get_duration(song);
 			}
 		}
 
-		mpd_song_free(song);
 		mpd_response_finish(conn);
 	}
 
@@ -556,6 +863,10 @@ do_update_played(struct mpd_connection *conn)
 		status = mpd_run_status(conn);
 		if (!status) {
 			LOG_ERROR("%s", mpd_connection_get_error_message(conn));
+			if(song != NULL)
+			{
+				mpd_song_free(song);
+			}
 			return -1;
 		}
 
@@ -563,27 +874,47 @@ do_update_played(struct mpd_connection *conn)
 		mpd_status_free(status);
 	
 		mpd_response_finish(conn);
-		CHECK_CONNECTION(conn);
+		if(mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS)
+		{
+			LOG_ERROR("%s", mpd_connection_get_error_message(conn));
+			uri = NULL;
+			ret = -1;
+		}
 	}
 
 
 	if(uri)
 	{
-		tmp = malloc(10);
-		snprintf(tmp, 10, "%i", played);
-
-		printf("D: saving sticker played %s = %i\n", uri, played);
+		LOG_D("saving played %s = %i", uri, played);
 
-		if(!mpd_run_sticker_set(conn, "song", uri, "played", tmp))
+		// written in place in the resume index, the stickers follow
+		// in the background; played_at lets positions coming from
+		// gpodder.net be merged
+		now = time(NULL);
+		if(la_resume_update(uri, title, played, duration, now))
 		{
-			LOG_ERROR("%s", mpd_connection_get_error_message(conn));
-			return -1;
+			// not in the index (uri too long): straight to the stickers
+			LOG_I("%s not in the resume index, saving its stickers", uri);
+			la_fmt_uint(played_str, sizeof(played_str), 0, played, 0, '0');
+			la_fmt_uint(played_at, sizeof(played_at), 0, now, 0, '0');
+			mpd_command_list_begin(conn, false);
+			mpd_send_sticker_set(conn, "song", uri, "played", played_str);
+			mpd_send_sticker_set(conn, "song", uri, "played_at", played_at);
+			mpd_command_list_end(conn);
+			if(!mpd_response_finish(conn))
+			{
+				LOG_ERROR("%s", mpd_connection_get_error_message(conn));
+				ret = -1;
+			}
 		}
-
-		free(tmp);
+		la_resume_refresh(false);
 	}
 
-	return 0;
+	if(song != NULL)
+	{
+		mpd_song_free(song);
+	}
+	return ret;
 }
 
 static bool
@@ -615,40 +946,6 @@ is_stream_in_queue(struct mpd_connection* conn)
 	return ret;
 }
 
-typedef struct StringList {
-	char* value;
-	struct StringList* next;
-} StringList;
-
-static StringList*
-mk_string_list()
-{
-	StringList *tmp;
-	tmp = calloc(1, sizeof(StringList));
-	if(tmp == NULL){
-		LOG_ERROR("E: %s", "calloc");
-		exit(-1);
-	}
-	return tmp;
-}
-
-typedef struct IntList {
-	int value;
-	struct IntList* next;
-} IntList;
-
-static IntList*
-mk_int_list()
-{
-	IntList *tmp;
-	tmp = calloc(1, sizeof(IntList));
-	if(tmp == NULL){
-		LOG_ERROR("E: %s", "calloc");
-		exit(-1);
-	}
-	return tmp;
-}
-
 static char*
 get_filename_from_uri(char* uri)
 {
@@ -668,7 +965,7 @@ get_filename_from_uri(char* uri)
 	return value;
 }
 
-static char*
+static const char*
 la_mpd_song_get_filename(const struct mpd_song* song)
 {
 	char* value;
@@ -683,42 +980,9 @@ la_mpd_song_get_filename(const struct mpd_song* song)
 			value = get_filename_from_uri(value);
 		}
 	}
-	return strdup(value);
-}
-
-static char*
-format_resume_label(char* uri, int played)
-{
-	char* filename;
-	char* buf;
-	size_t len;
-	int ret;
-
-	filename = get_filename_from_uri(uri);
-
-	len = strlen(filename)+1+3*(2+1)+1;
-	buf = malloc(len);
-
-	if(buf == NULL)
-	{
-		perror("format_resume_label allocate buf");
-		return NULL;
-	}
-
-	ret = snprintf(buf, len, "%s %02i:%02i:%02i", filename, played / 3600, (played % 3600) / 60, played % 60);
-
-	if(ret > 0)
-	{
-		return buf;
-	}
-	else
-	{
-		free(buf);
-		return NULL;
-	}
+	return value;
 }
 
-
 static void
 free_list_state()
 {
@@ -741,39 +1005,100 @@ free_list_state()
 	list_uris = NULL;
 }
 
-static int
-fetch_list(struct mpd_connection *conn, char* path)
-{
-	StringList *buf, *tmp, *cur, *fns, *cur_fns, *tmp_fns;
-	char **tmpl;
-	int tmp_len;
-	struct mpd_entity* entity;
-	const struct mpd_directory* dir;
-	const struct mpd_song* song;
-	char *value, *uri;
-
-	tmp_len = 0;
-	cur = NULL;
+typedef struct {
+	// NULL for Podcasts
+	char* path;
+	// line selected once shown
+	int select;
+	char** contents;
+	char** uris;
+	int length;
+} ListJob;
+
+// the listing being read by the pool, and its argument
+static PoolJob* list_job = NULL;
+static ListJob* list_pending = NULL;
+
+// keys pressed on the list while it loads, run once it is shown
+#define MAX_DEFERRED_CONTROLS 16
+typedef struct {
+	Control control;
+	int steps;
+} DeferredControl;
+static DeferredControl deferred_controls[MAX_DEFERRED_CONTROLS];
+static int deferred_count = 0;
+
+static void run_deferred_controls();
 
-	CHECK_CONNECTION(conn);
-	mpd_run_noidle(conn);
+static void
+free_list_job(ListJob* j)
+{
+	int i;
 
-	if(path == NULL)
-	{
-		mpd_send_list_meta(conn, "Podcasts");
-	}
-	else
+	for(i=0;i<j->length;i++)
 	{
-		printf("D: fetch_list(%s)\n", path);
-		mpd_send_list_meta(conn, path);
+		free(j->contents[i]);
+		free(j->uris[i]);
 	}
+	free(j->contents);
+	free(j->uris);
+	free(j);
+}
 
-	CHECK_CONNECTION(conn);
+static bool
+list_job_append(ListJob* j, char* value, char* uri, int* size)
+{
+	char** tmp;
 
-	tmp_len = 0;
-	while((entity = mpd_recv_entity(conn)) != NULL)
+	if(j->length == *size)
 	{
-		if(mpd_entity_get_type(entity)  ==  MPD_ENTITY_TYPE_DIRECTORY)
+		*size = *size ? *size * 2 : 32;
+		tmp = realloc(j->contents, *size * sizeof(char*));
+		if(tmp == NULL)
+		{
+			return false;
+		}
+		j->contents = tmp;
+		tmp = realloc(j->uris, *size * sizeof(char*));
+		if(tmp == NULL)
+		{
+			return false;
+		}
+		j->uris = tmp;
+	}
+	j->contents[j->length] = value;
+	j->uris[j->length] = uri;
+	j->length++;
+	return true;
+}
+
+// in a pool thread, with its own connection
+static int
+list_work(void* arg)
+{
+	ListJob* j = arg;
+	struct mpd_connection* conn;
+	struct mpd_entity* entity;
+	const struct mpd_directory* dir;
+	const struct mpd_song* song;
+	char *value, *uri;
+	int size;
+	int ret;
+
+	conn = la_pool_mpd();
+	if(conn == NULL)
+	{
+		return -1;
+	}
+
+	LOG_D("list_work(%s)", j->path);
+	mpd_send_list_meta(conn, j->path == NULL ? "Podcasts" : j->path);
+
+	size = 0;
+	ret = 0;
+	while((entity = mpd_recv_entity(conn)) != NULL)
+	{
+		if(mpd_entity_get_type(entity)  ==  MPD_ENTITY_TYPE_DIRECTORY)
 		{
 			dir = mpd_entity_get_directory(entity);
 			uri = strdup(mpd_directory_get_path(dir));
@@ -783,106 +1108,148 @@ fetch_list(struct mpd_connection *conn, char* path)
 		{
 			song = mpd_entity_get_song(entity);
 			uri = strdup(mpd_song_get_uri(song));
-			value = la_mpd_song_get_filename(song);
+			value = strdup(la_mpd_song_get_filename(song));
 		}
 		else
 		{
+			mpd_entity_free(entity);
 			continue;
 		}
+		mpd_entity_free(entity);
 
-		if (cur == NULL)
+		if(ret == 0 && !list_job_append(j, value, uri, &size))
 		{
-			buf = tmp = mk_string_list();
-			tmp->value = value;
-
-			fns = tmp_fns = mk_string_list();
-			tmp_fns->value = uri;
+			perror("E: list_work");
+			ret = -1;
 		}
-		else
+		if(ret)
 		{
-			tmp = mk_string_list();
-			tmp->value = value;
-			cur->next = tmp;
-
-			tmp_fns = mk_string_list();
-			tmp_fns->value = uri;
-			cur_fns->next = tmp_fns;
+			free(value);
+			free(uri);
 		}
-		cur = tmp;
-		cur_fns = tmp_fns;
-		tmp_len++;
-
-		mpd_entity_free(entity);
 	}
 
 	mpd_response_finish(conn);
-	CHECK_CONNECTION(conn);
-
-	if(!mpd_send_idle(conn))
-	{
-		LOG_ERROR("Unable to put mpd in idle mode%s\n","");
-		return -1;
-	}
+	return mpd_connection_get_error(conn) == MPD_ERROR_SUCCESS ? ret : -1;
+}
 
-	list_length = 0;
-	free_list_state();
+static void
+list_done(void* arg, int ret, bool cancelled)
+{
+	ListJob* j = arg;
 
-	list_contents = calloc(tmp_len, sizeof(char*));
-	cur = buf;
-	for(tmpl = list_contents; cur != NULL; tmpl++)
+	// replaced by another listing, or the list was left
+	if(j != list_pending || cancelled)
 	{
-		*tmpl = cur->value;
-		tmp = cur;
-		cur = cur->next;
-		free(tmp);
+		free_list_job(j);
+		return;
 	}
-	list_length = tmp_len;
+	list_job = NULL;
+	list_pending = NULL;
 
-	list_uris = calloc(tmp_len, sizeof(char*));
-	cur = fns;
-	for(tmpl = list_uris; cur != NULL; tmpl++)
+	if(ret)
 	{
-		*tmpl = cur->value;
-		tmp = cur;
-		cur = cur->next;
-		free(tmp);
+		LOG_ERROR("unable to list %s", j->path != NULL ? j->path : "Podcasts");
+		free_list_job(j);
+		deferred_count = 0;
+		state = LA_STATE_MENU;
+		state_menu = 0;
+		print_menu(-1);
+		return;
 	}
 
-	state_list = 0;
+	list_length = 0;
+	free_list_state();
+	list_contents = j->contents;
+	list_uris = j->uris;
+	list_length = j->length;
+	state_list = j->select < list_length ? j->select : 0;
 	state_list_rl_offset = 0;
-	state_list_path = path;
+	free(j);
 
-	return 0;
+	print_list(-1);
+	run_deferred_controls();
 }
 
+// the previous list stays until the new one is there
 static int
-fetch_and_print_list(struct mpd_connection *conn, char* path)
+request_list(char* path, int select)
 {
-	int ret;
-	ret = fetch_list(conn, path);
-	if(ret) return ret;
-	else
+	ListJob* j;
+
+	// a listing nobody will look at
+	la_pool_cancel(list_job);
+	deferred_count = 0;
+
+	j = calloc(1, sizeof(ListJob));
+	if(j == NULL)
 	{
-		print_list(-1);
-		return 0;
+		LOG_ERROR("%s", "Out of memory");
+		return -1;
+	}
+	j->path = path;
+	j->select = select;
+	state_list_path = path;
+
+	list_pending = NULL;
+	list_job = la_pool_submit(list_work, list_done, j);
+	if(list_job == NULL)
+	{
+		// list_done has freed the job already
+		state_list_path = NULL;
+		return -1;
 	}
+	list_pending = j;
+	return 0;
 }
 
-static int
-fetch_and_print_list_radio()
+static void
+cancel_list()
+{
+	la_pool_cancel(list_job);
+	list_job = NULL;
+	list_pending = NULL;
+	deferred_count = 0;
+}
+
+static void
+load_list_radio()
 {
+	const Radio* r;
+	size_t count;
 	int i;
 
 	free_list_state();
+	free(list_radios_order);
+
+	count = la_radios_count();
+	list_radios_order = calloc(count, sizeof(size_t));
+	list_contents = calloc(count, sizeof(char*));
+	list_uris = calloc(count, sizeof(char*));
 
-	list_contents = calloc(LIST_RADIOS_LEN, sizeof(char*));
-	list_uris = calloc(LIST_RADIOS_LEN, sizeof(char*));
-	for(i=0;i<LIST_RADIOS_LEN;i++)
+	// working stations first, the fastest at the top
+	la_radios_sorted(list_radios_order);
+	for(i=0;i<count;i++)
 	{
-		list_contents[i] = strdup(list_radios[i]);
-		list_uris[i] = strdup(list_radios_uris[i]);
+		r = la_radios_get(list_radios_order[i]);
+		if(r->probed && !r->available)
+		{
+			list_contents[i] = malloc(strlen(r->name) + 4);
+			sprintf(list_contents[i], "%s KO", r->name);
+		}
+		else
+		{
+			list_contents[i] = strdup(r->name);
+		}
+		list_uris[i] = strdup(r->uri);
 	}
-	list_length = LIST_RADIOS_LEN;
+	list_length = count;
+}
+
+static int
+fetch_and_print_list_radio()
+{
+	load_list_radio();
 
 	state_list = 0;
 	state_list_rl_offset = 0;
@@ -891,167 +1258,122 @@ fetch_and_print_list_radio()
 	return 0;
 }
 
-
-static int
-fetch_resume(struct mpd_connection *conn)
+static void
+on_radios_probed()
 {
-	StringList *buf, *tmp, *cur, *buf_fns, *cur_fns, *tmp_fns;
-	IntList *buf_int, *tmp_int, *cur_int;
-	char **tmpl;
-	int tmp_len;
-	struct mpd_pair* pair;
-	const char *sticker_value;
-	char *uri, *value;
-	int played;
-	size_t name_len;
-	int* tmpli;
-	struct mpd_entity* entity;
-	const struct mpd_song* song;
-
-	tmp_len = 0;
-	cur_int = NULL;
-	cur_fns = NULL;
-	cur = NULL;
-
-	CHECK_CONNECTION(conn);
-	mpd_run_noidle(conn);
-
-	mpd_send_sticker_find(conn, "song", "", "played");
-	CHECK_CONNECTION(conn);
+	char* keep_uri;
+	int i;
 
-	tmp_len = 0;
-	while((pair = mpd_recv_pair(conn)) != NULL)
+	if(state == LA_STATE_RADIO)
 	{
-		if(!strcmp(pair->name, "file"))
+		// the order changed: stay on the same station
+		keep_uri = list_length > 0 ? strdup(list_uris[state_list]) : NULL;
+		load_list_radio();
+		state_list = 0;
+		for(i=0;keep_uri != NULL && i<list_length;i++)
 		{
-			uri=strdup(pair->value);
-		}
-		else
-		{
-			sticker_value=mpd_parse_sticker(pair->value, &name_len);
-			if(sticker_value)
-			{
-				played=atoi(sticker_value);
-
-				tmp_fns = mk_string_list();
-				tmp_fns->value = uri;
-				tmp_int = mk_int_list();
-				tmp_int->value = played;
-
-				if (cur_fns == NULL)
-				{
-					buf_fns = tmp_fns;
-					buf_int = tmp_int;
-				}
-				else
-				{
-					cur_fns->next = tmp_fns;
-					cur_int->next = tmp_int;
-				}
-				cur_fns = tmp_fns;
-				cur_int = tmp_int;
-				tmp_len++;
-			}
-			else
+			if(!strcmp(list_uris[i], keep_uri))
 			{
-				fprintf(stderr, "E: parsing sticker %s\n", pair->value);
-				return -1;
+				state_list = i;
 			}
 		}
-		mpd_return_pair(conn, pair);
+		free(keep_uri);
+		state_list_rl_offset = 0;
+		print_list(-1);
 	}
+}
 
-	mpd_response_finish(conn);
-	CHECK_CONNECTION(conn);
 
-	if(tmp_len == 0)
-	{
-		buf = NULL;
-	}
-	else
+static void
+load_resume_list(const ResumeList* resume, const char* keep_uri)
+{
+	size_t i;
+
+	list_length = 0;
+	free_list_state();
+	free(resume_played);
+
+	list_contents = calloc(resume->length, sizeof(char*));
+	list_uris = calloc(resume->length, sizeof(char*));
+	resume_played = calloc(resume->length, sizeof(int));
+
+	state_list = 0;
+	for(i=0;i<resume->length;i++)
 	{
-		printf("D: resume length %i\n", tmp_len);
-		for(cur_fns=buf_fns, cur_int = buf_int; cur_fns != NULL; cur_fns = cur_fns->next, cur_int = cur_int->next)
+		list_contents[i] = strdup(resume->entries[i].label != NULL ? resume->entries[i].label : resume->entries[i].uri);
+		list_uris[i] = strdup(resume->entries[i].uri);
+		resume_played[i] = resume->entries[i].played;
+		if(keep_uri != NULL && !strcmp(keep_uri, list_uris[i]))
 		{
-			mpd_send_list_meta(conn, cur_fns->value);
-			CHECK_CONNECTION(conn);
+			state_list = i;
+		}
+	}
 
-			while((entity = mpd_recv_entity(conn)) != NULL)
-			{
-				if(mpd_entity_get_type(entity)  ==  MPD_ENTITY_TYPE_SONG)
-				{
-					song = mpd_entity_get_song(entity);
-					value = la_mpd_song_get_filename(song);
+	list_length = resume->length;
 
-					tmp = mk_string_list();
-					tmp->value = format_resume_label(value, cur_int->value);
-					printf("D: resume %s\n", tmp->value);
+	state_list_rl_offset = 0;
+	state_list_path = NULL;
+}
 
-					if (cur == NULL)
-					{
-						buf = tmp;
-					}
-					else
-					{
-						cur->next = tmp;
-					}
-					cur = tmp;
-				}
-				mpd_entity_free(entity);
-			}
+static int
+fetch_resume(struct mpd_connection *conn)
+{
+	ResumeList* resume;
 
-			mpd_response_finish(conn);
-			CHECK_CONNECTION(conn);
-		}
-	}
+	resume = la_resume_cached();
 
-	if(!mpd_send_idle(conn))
+	if(resume == NULL)
 	{
-		LOG_ERROR("Unable to put mpd in idle mode%s\n","");
-		return -1;
-	}
+		// first time: nothing cached yet, ask MPD directly
+		CHECK_CONNECTION(conn);
+		mpd_run_noidle(conn);
 
-	list_length = 0;
-	free_list_state();
-	free(resume_played);
+		if(la_resume_build(conn, false, &resume))
+		{
+			LOG_ERROR("%s", mpd_connection_get_error_message(conn));
+			return -1;
+		}
+		la_resume_import(resume);
 
-	list_contents = calloc(tmp_len, sizeof(char*));
-	cur = buf;
-	for(tmpl = list_contents; cur != NULL; tmpl++)
-	{
-		*tmpl = cur->value;
-		tmp = cur;
-		cur = cur->next;
-		free(tmp);
-	}
-	resume_played = calloc(tmp_len, sizeof(int));
-	cur_int = buf_int;
-	for(tmpli = resume_played; cur_int != NULL; tmpli++)
-	{
-		*tmpli = cur_int->value;
-		tmp_int = cur_int;
-		cur_int = cur_int->next;
-		free(tmp_int);
-	}
-	list_uris = calloc(tmp_len, sizeof(char*));
-	cur = buf_fns;
-	for(tmpl = list_uris; cur != NULL; tmpl++)
-	{
-		*tmpl = cur->value;
-		tmp = cur;
-		cur = cur->next;
-		free(tmp);
+		if(!send_idle(conn))
+		{
+			LOG_ERROR("Unable to put mpd in idle mode%s\n","");
+			return -1;
+		}
+
+		resume = la_resume_cached();
+		if(resume == NULL)
+		{
+			return -1;
+		}
 	}
 
-	list_length = tmp_len;
+	// the stickers are only read again when the database changed
+	la_resume_refresh(false);
 
-	state_list = 0;
-	state_list_rl_offset = 0;
-	state_list_path = NULL;
+	load_resume_list(resume, NULL);
 
 	return 0;
 }
 
+static void
+on_resume_refreshed()
+{
+	char* keep_uri;
+
+	if(state == LA_STATE_RESUME)
+	{
+		keep_uri = list_length > 0 ? strdup(list_uris[state_list]) : NULL;
+		load_resume_list(la_resume_cached(), keep_uri);
+		free(keep_uri);
+
+		if(list_length > 0)
+		{
+			print_list(-1);
+		}
+	}
+}
+
 static int
 fetch_and_print_resume(struct mpd_connection *conn)
 {
@@ -1065,52 +1387,32 @@ fetch_and_print_resume(struct mpd_connection *conn)
 	}
 }
 
-static int
+static void
 print_current_time(unsigned int played, unsigned int total)
 {
-	int ret;
-	int len;
-	char* buf;
+	// up to the state in the last column
+	char buf[16];
+	size_t len;
+	int hours;
 
 	la_lcdPosition(0, 1);
 
-	len = 15;
-	buf = malloc(len);
-
-	if(buf == NULL)
-	{
-		perror("print_current_time allocate buf");
-		return -1;
-	}
-	
-	if(total > 3600)
-	{
-		ret = snprintf(buf, len, "%i:%02i:%02i/%i:%02i:%02i ",
-					played / 3600, (played % 3600) / 60, played % 60,
-					total / 3600, (total % 3600) / 60, total % 60);
-	}
-	else
-	{
-		ret = snprintf(buf, len, "%02i:%02i/%02i:%02i    ",
-					played / 60, played % 60,
-					total /  60, total % 60);		
-	}
-	
-	if(ret > 0)
-	{
-		la_lcdPuts(buf);
-	}
+	hours = total > 3600 ? 1 : 0;
+	len = la_fmt_time(buf, sizeof(buf), 0, played, hours);
+	len = la_fmt_str(buf, sizeof(buf), len, "/");
+	len = la_fmt_time(buf, sizeof(buf), len, total, hours);
+	la_fmt_pad(buf, sizeof(buf), len, sizeof(buf) - 1);
 
-	free(buf);
-	return -1;
+	la_lcdPuts(buf);
 }
 
 #define JUMP_SECS 60
 static int
-jump_backward_forward(struct mpd_connection* conn, bool backward)
+jump_backward_forward(struct mpd_connection* conn, bool backward, int steps)
 {
 	struct mpd_status *status;
 	unsigned int current, total;
+	unsigned int jump;
 
 	CHECK_CONNECTION(conn);
 	mpd_run_noidle(conn);
@@ -1129,11 +1431,12 @@ jump_backward_forward(struct mpd_connection* conn, bool backward)
 	mpd_response_finish(conn);
 	CHECK_CONNECTION(conn);
 
+	jump = JUMP_SECS * steps;
 	if(backward)
 	{
-		if(current > JUMP_SECS)
+		if(current > jump)
 		{
-			current = current - JUMP_SECS;
+			current = current - jump;
 		}
 		else
 		{
@@ -1142,9 +1445,9 @@ jump_backward_forward(struct mpd_connection* conn, bool backward)
 	}
 	else
 	{
-		if(current + JUMP_SECS < total)
+		if(current + jump < total)
 		{
-			current = current + JUMP_SECS;
+			current = current + jump;
 		}
 		else
 		{
@@ -1165,8 +1468,7 @@ jump_backward_forward(struct mpd_connection* conn, bool backward)
 		return -1;
 	}
 	
-	ignore_next_idle = true;
-	if(!mpd_send_idle(conn))
+	if(!send_idle(conn))
 	{
 		LOG_ERROR("Unable to put mpd in idle mode%s\n","");
 		return -1;
@@ -1176,15 +1478,15 @@ jump_backward_forward(struct mpd_connection* conn, bool backward)
 }
 
 static int
-jump_backward(struct mpd_connection* conn)
+jump_backward(struct mpd_connection* conn, int steps)
 {
-	return jump_backward_forward(conn, true);
+	return jump_backward_forward(conn, true, steps);
 }
 
 static int
-jump_forward(struct mpd_connection* conn)
+jump_forward(struct mpd_connection* conn, int steps)
 {
-	return jump_backward_forward(conn, false);
+	return jump_backward_forward(conn, false, steps);
 }
 
 static void
@@ -1203,6 +1505,12 @@ sigrt_handler(int sig, siginfo_t *si, void *uc)
    //signal(sig, SIG_IGN);
 }
 
+static void
+sigusr1_handler(int sig)
+{
+	stats_flag |= 1;
+}
+
 static void
 setup_timers()
 {
@@ -1220,9 +1528,18 @@ setup_timers()
 		exit(-1);
 	}
 
+	sa.sa_flags = 0;
+	sa.sa_handler = sigusr1_handler;
+	if (sigaction(SIGUSR1, &sa, NULL) == -1)
+	{
+		LOG_ERROR("sigaction: %s", strerror(errno));
+		exit(-1);
+	}
+
 	// bloqué en temps normal
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGRTMIN);
+	sigaddset(&mask, SIGUSR1);
 	if (sigprocmask(SIG_SETMASK, &mask, NULL) == -1)
 	{
 		LOG_ERROR("sigprocmask: %s", strerror(errno));
@@ -1259,7 +1576,7 @@ static void reset_timers()
 	its.it_interval.tv_sec = 0;
 	its.it_interval.tv_nsec = 0;
 
-	printf("D: reset_timers\n");
+	LOG_D("reset_timers");
 
 	if(timer_settime(timer_inactive, 0, &its, NULL))
 	{
@@ -1283,39 +1600,761 @@ static void reset_timers()
 	}
 }
 
-#define MAX_EVENTS 10
-static void wait_input_async(struct mpd_connection* conn, int mpd_fd, int* control_fds, int control_fds_count)
+static void
+arm_mpd_timer(long first_ms, long interval_s)
 {
-	struct epoll_event ev={0}, events[MAX_EVENTS];
-	int nfds, epollfd;
-	int n;
-	sigset_t mask;
-	int ret;
+	struct itimerspec its = {{0}};
 
-	sigemptyset(&mask);
+	its.it_value.tv_sec = first_ms / 1000;
+	its.it_value.tv_nsec = (first_ms % 1000) * 1000000;
+	its.it_interval.tv_sec = interval_s;
+	if(timerfd_settime(mpd_timer_fd, 0, &its, NULL) == -1)
+	{
+		perror("E: mpd timer");
+	}
+}
 
-	setup_timers();
+// 0 disarms
+static void
+arm_next_timer(long ms)
+{
+	struct itimerspec its = {{0}};
 
-	epollfd = epoll_create1(0);
-	if (epollfd == -1)
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	if(timerfd_settime(next_timer_fd, 0, &its, NULL) == -1)
 	{
-		perror("epoll_create1");
-		return;
+		perror("E: next episode timer");
 	}
+}
+
+static void
+set_mpd_keepalive(int fd)
+{
+	int on = 1;
+	int idle = 30;
+	int interval = 10;
+	int count = 3;
+
+	// half-open TCP connections are otherwise only noticed on the next command;
+	// the TCP options fail harmlessly on a unix socket
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+static int
+watch_mpd(struct mpd_connection* conn)
+{
+	struct epoll_event ev = {0};
+
+	mpd_watched_fd = mpd_async_get_fd(mpd_connection_get_async(conn));
+	set_mpd_keepalive(mpd_watched_fd);
 
 	ev.events = EPOLLIN;
-	ev.data.fd = mpd_fd;
-	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, mpd_fd, &ev) == -1)
+	ev.data.fd = mpd_watched_fd;
+	if(epoll_ctl(mpd_epollfd, EPOLL_CTL_ADD, mpd_watched_fd, &ev) == -1)
 	{
 		perror("epoll_ctl: mpd");
-		return;
+		return -1;
 	}
+	mpd_conn = conn;
+	arm_mpd_timer(MPD_PING_INTERVAL * 1000, MPD_PING_INTERVAL);
+	return 0;
+}
 
-	for(n=0; n<control_fds_count; n++)
+static void
+start_mpd_reconnect()
+{
+	if(mpd_conn == NULL)
 	{
+		return;
+	}
 
-		ev.events = EPOLLIN;
-		ev.data.fd = control_fds[n];
+	LOG_I("mpd connection lost, reconnecting");
+	la_stats_add(stats_mpd_reconnects, 1);
+	la_stats_start(&mpd_lost_at);
+
+	epoll_ctl(mpd_epollfd, EPOLL_CTL_DEL, mpd_watched_fd, NULL);
+	mpd_watched_fd = -1;
+	mpd_connection_free(mpd_conn);
+	mpd_conn = NULL;
+
+	if(state == LA_STATE_PLAYING)
+	{
+		la_lcdClear();
+		la_lcdHome();
+		la_lcdPuts("MPD...");
+	}
+
+	// menus, list and cursor are left alone: they are still valid afterwards
+	mpd_backoff_ms = MPD_RECONNECT_FIRST_DELAY_MS;
+	arm_mpd_timer(mpd_backoff_ms, 0);
+}
+
+static void
+try_mpd_reconnect()
+{
+	struct mpd_connection* conn;
+	struct timespec now;
+
+	conn = mpd_connection_new(NULL, 0, MPD_RECONNECT_TIMEOUT_MS);
+	if(conn == NULL || mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS)
+	{
+		if(conn != NULL)
+		{
+			LOG_D("mpd reconnect: %s", mpd_connection_get_error_message(conn));
+			mpd_connection_free(conn);
+		}
+		mpd_backoff_ms = mpd_backoff_ms * 2 > MPD_RECONNECT_MAX_DELAY_MS ? MPD_RECONNECT_MAX_DELAY_MS : mpd_backoff_ms * 2;
+		arm_mpd_timer(mpd_backoff_ms, 0);
+		return;
+	}
+	mpd_connection_set_timeout(conn, MPD_TIMEOUT_MS);
+
+	if(watch_mpd(conn))
+	{
+		mpd_connection_free(conn);
+		arm_mpd_timer(MPD_RECONNECT_MAX_DELAY_MS, 0);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	LOG_I("mpd reconnected in %lims",
+		(now.tv_sec - mpd_lost_at.tv_sec) * 1000 + (now.tv_nsec - mpd_lost_at.tv_nsec) / 1000000);
+	la_stats_since(stats_mpd_reconnect, &mpd_lost_at);
+
+	// mpd may have been restarted with another queue
+	radio_mode = is_radio_queue(conn);
+	shown_status.valid = false;
+	if(state == LA_STATE_PLAYING)
+	{
+		print_status(conn);
+	}
+
+	if(!send_idle(conn))
+	{
+		start_mpd_reconnect();
+	}
+}
+
+// called when a handler failed: returns -1 only if the loop must stop
+static int
+on_mpd_error(int ret)
+{
+	if(mpd_conn == NULL || mpd_connection_get_error(mpd_conn) == MPD_ERROR_SUCCESS)
+	{
+		// not an mpd problem: keep the old behaviour
+		return ret;
+	}
+
+	fprintf(stderr, "E: mpd: %s\n", mpd_connection_get_error_message(mpd_conn));
+	if(mpd_connection_clear_error(mpd_conn))
+	{
+		// refused command (missing file...): the connection is still fine
+		if(!send_idle(mpd_conn))
+		{
+			// already idle
+			mpd_connection_clear_error(mpd_conn);
+		}
+		return 0;
+	}
+
+	start_mpd_reconnect();
+	return 0;
+}
+
+static void
+on_mpd_timer()
+{
+	uint64_t count;
+	enum mpd_idle idle;
+	struct timespec start;
+
+	if(read(mpd_timer_fd, &count, sizeof(count)) != sizeof(count))
+	{
+		perror("E: mpd timerfd");
+	}
+
+	if(mpd_conn == NULL)
+	{
+		try_mpd_reconnect();
+		return;
+	}
+
+	// ping: leave idle and enter it again, without blocking for long
+	la_stats_start(&start);
+	mpd_connection_set_timeout(mpd_conn, MPD_PING_TIMEOUT_MS);
+	idle = mpd_run_noidle(mpd_conn);
+	mpd_connection_set_timeout(mpd_conn, MPD_TIMEOUT_MS);
+	la_stats_since(stats_mpd_ping, &start);
+
+	if(mpd_connection_get_error(mpd_conn) != MPD_ERROR_SUCCESS)
+	{
+		on_mpd_error(-1);
+		return;
+	}
+	if(idle)
+	{
+		dispatch_idle(mpd_conn, idle);
+	}
+	if(mpd_connection_get_error(mpd_conn) != MPD_ERROR_SUCCESS || !send_idle(mpd_conn))
+	{
+		on_mpd_error(-1);
+	}
+}
+
+// the last song of the queue ends soon: append the next unfinished
+// episode of its directory, so that mpd goes on without a gap, and
+// mark the ending one as played through in the same command list
+static int
+queue_next_episode(struct mpd_connection* conn)
+{
+	struct mpd_status *status;
+	struct mpd_song *song;
+	const char* uri;
+	const char* next;
+	char played_str[12];
+	char played_at[21];
+	char id_str[12];
+	char range[13];
+	unsigned total;
+	long remaining_ms;
+	bool last;
+	time_t now;
+	int played;
+	int id;
+
+	status = mpd_run_status(conn);
+	if(status == NULL)
+	{
+		return -1;
+	}
+	last = !radio_mode
+		&& mpd_status_get_state(status) == MPD_STATE_PLAY
+		&& mpd_status_get_song_pos(status) != -1
+		&& mpd_status_get_song_pos(status) + 1 == mpd_status_get_queue_length(status);
+	total = mpd_status_get_total_time(status);
+	remaining_ms = total * 1000L - mpd_status_get_elapsed_ms(status);
+	mpd_status_free(status);
+	mpd_response_finish(conn);
+
+	if(!last || total == 0)
+	{
+		return 0;
+	}
+	if(remaining_ms > NEXT_EPISODE_LEAD_MS + 1000)
+	{
+		// sought backwards without a player event reaching us yet
+		arm_next_timer(remaining_ms - NEXT_EPISODE_LEAD_MS);
+		return 0;
+	}
+
+	song = mpd_run_current_song(conn);
+	mpd_response_finish(conn);
+	if(song == NULL)
+	{
+		CHECK_CONNECTION(conn);
+		return 0;
+	}
+	uri = mpd_song_get_uri(song);
+
+	next = la_episodes_next(uri, &played);
+	if(next == NULL && la_episodes_loading())
+	{
+		// the pool is still reading the directory
+		mpd_song_free(song);
+		arm_next_timer(EPISODES_RETRY_MS);
+		return 0;
+	}
+	if(next == NULL)
+	{
+		LOG_D("no episode after %s", uri);
+		mpd_song_free(song);
+		CHECK_CONNECTION(conn);
+		return 0;
+	}
+	LOG_I("queueing %s at %i after %s", next, played, uri);
+
+	la_fmt_uint(played_str, sizeof(played_str), 0, total, 0, '0');
+	now = time(NULL);
+	la_fmt_uint(played_at, sizeof(played_at), 0, now, 0, '0');
+
+	mpd_command_list_begin(conn, true);
+	mpd_send_add_id(conn, next);
+	mpd_send_sticker_set(conn, "song", uri, "played", played_str);
+	mpd_send_sticker_set(conn, "song", uri, "played_at", played_at);
+	mpd_command_list_end(conn);
+	id = mpd_recv_song_id(conn);
+	if(!mpd_response_finish(conn) || id < 0)
+	{
+		LOG_ERROR("%s", mpd_connection_get_error_message(conn));
+		mpd_song_free(song);
+		return -1;
+	}
+	la_resume_update(uri, la_mpd_song_get_filename(song), total, total, now);
+	mpd_song_free(song);
+
+	if(played > 0)
+	{
+		// a started episode goes on from where it was left
+		la_fmt_uint(id_str, sizeof(id_str), 0, id, 0, '0');
+		la_fmt_str(range, sizeof(range), la_fmt_uint(range, sizeof(range), 0, played, 0, '0'), ":");
+		mpd_send_command(conn, "rangeid", id_str, range, NULL);
+		if(!mpd_response_finish(conn) && !mpd_connection_clear_error(conn))
+		{
+			LOG_ERROR("%s", mpd_connection_get_error_message(conn));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+on_next_timer()
+{
+	uint64_t count;
+	enum mpd_idle idle;
+
+	if(read(next_timer_fd, &count, sizeof(count)) != sizeof(count))
+	{
+		perror("E: next episode timerfd");
+	}
+
+	if(mpd_conn == NULL)
+	{
+		return;
+	}
+
+	idle = mpd_run_noidle(mpd_conn);
+	if(idle && mpd_connection_get_error(mpd_conn) == MPD_ERROR_SUCCESS)
+	{
+		dispatch_idle(mpd_conn, idle);
+	}
+	if(mpd_connection_get_error(mpd_conn) == MPD_ERROR_SUCCESS)
+	{
+		queue_next_episode(mpd_conn);
+	}
+	if(mpd_connection_get_error(mpd_conn) != MPD_ERROR_SUCCESS || !send_idle(mpd_conn))
+	{
+		on_mpd_error(-1);
+	}
+}
+
+// handlers leave mpd in idle mode
+static void
+replay_pending_idle()
+{
+	enum mpd_idle idle;
+
+	LOG_D("replaying idle events 0x%x", pending_idle);
+	idle = mpd_run_noidle(mpd_conn) | pending_idle;
+	pending_idle = 0;
+	if(mpd_connection_get_error(mpd_conn) == MPD_ERROR_SUCCESS)
+	{
+		dispatch_idle(mpd_conn, idle);
+	}
+	if(mpd_connection_get_error(mpd_conn) != MPD_ERROR_SUCCESS || !send_idle(mpd_conn))
+	{
+		on_mpd_error(-1);
+	}
+}
+
+static int
+run_control(Control control, int steps)
+{
+	struct timespec start;
+	bool was_playing;
+	int ret;
+
+	// from the key to the last byte sent to the display
+	la_stats_start(&start);
+	was_playing = state == LA_STATE_PLAYING;
+	control_steps = steps;
+	ret = control_handlers[control](control, mpd_conn);
+	control_steps = 1;
+	if(was_playing && state != LA_STATE_PLAYING)
+	{
+		shown_status.valid = false;
+	}
+	else if(ret >= 0 && state == LA_STATE_PLAYING && pending_idle)
+	{
+		replay_pending_idle();
+	}
+	if(list_job != NULL && state != LA_STATE_LIST)
+	{
+		cancel_list();
+	}
+	la_stats_since(control_stats[control], &start);
+	if(ret < 0)
+	{
+		return on_mpd_error(ret);
+	}
+	return ret;
+}
+
+// moving in a list that isn't there yet waits for it
+static bool
+defer_control(Control control, int steps)
+{
+	DeferredControl* last;
+
+	if(list_job == NULL || state != LA_STATE_LIST || control == LA_MENU || control > LA_OK)
+	{
+		return false;
+	}
+	last = deferred_count > 0 ? &deferred_controls[deferred_count - 1] : NULL;
+	if(last != NULL && last->control == control && control != LA_OK)
+	{
+		last->steps += steps;
+		return true;
+	}
+	if(deferred_count == MAX_DEFERRED_CONTROLS)
+	{
+		return false;
+	}
+	deferred_controls[deferred_count].control = control;
+	deferred_controls[deferred_count].steps = steps;
+	deferred_count++;
+	return true;
+}
+
+static void
+run_deferred_controls()
+{
+	DeferredControl controls[MAX_DEFERRED_CONTROLS];
+	int count;
+	int i;
+
+	count = deferred_count;
+	memcpy(controls, deferred_controls, count * sizeof(DeferredControl));
+	deferred_count = 0;
+	for(i=0;i<count && mpd_conn != NULL;i++)
+	{
+		// OK on a directory: the rest waits for the next list
+		if(!defer_control(controls[i].control, controls[i].steps))
+		{
+			run_control(controls[i].control, controls[i].steps);
+		}
+	}
+}
+
+static int
+dispatch_control(Control control, int steps, void* param)
+{
+	int i;
+
+	if(mpd_conn == NULL)
+	{
+		// no point in queueing: the state may be different afterwards
+		LOG_D("%s dropped while reconnecting to mpd", DEBUG_CONTROLS[control]);
+		la_stats_add(stats_controls_dropped, 1);
+		la_lcdPosition(0, 0);
+		la_lcdPuts("MPD...");
+		return 0;
+	}
+
+	// replayed one by one
+	for(i=0;i<steps;i++)
+	{
+		la_trace_record(LA_TRACE_CONTROL, control);
+	}
+
+	if(defer_control(control, steps))
+	{
+		return 0;
+	}
+	return run_control(control, steps);
+}
+
+static void
+on_control(Control control, ControlHandler fn)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "key %s", DEBUG_CONTROLS[control]);
+	control_stats[control] = la_stats_histogram(name);
+	control_handlers[control] = fn;
+	la_on_key(control, dispatch_control, NULL);
+}
+
+static void
+init_stats()
+{
+	stats_mpd_status = la_stats_histogram("mpd status");
+	stats_mpd_ping = la_stats_histogram("mpd ping");
+	stats_mpd_reconnect = la_stats_histogram("mpd reconnect");
+	stats_mpd_idle = la_stats_counter("mpd idle events");
+	stats_mpd_reconnects = la_stats_counter("mpd reconnects");
+	stats_controls_dropped = la_stats_counter("controls dropped");
+	// at rest, only the log flush should wake la up
+	stats_loop_wakeups = la_stats_rate("loop wakeups");
+}
+
+static bool
+status_unchanged(struct mpd_connection* conn)
+{
+	struct mpd_status *status;
+	bool same;
+
+	if(!shown_status.valid)
+	{
+		return false;
+	}
+	status = mpd_run_status(conn);
+	if(status == NULL)
+	{
+		return false;
+	}
+	same = mpd_status_get_song_id(status) == shown_status.song_id
+		&& mpd_status_get_state(status) == shown_status.state
+		&& mpd_status_get_elapsed_time(status) == shown_status.elapsed;
+	mpd_status_free(status);
+	mpd_response_finish(conn);
+	return same;
+}
+
+// the connection is out of idle mode while the handlers run
+
+static int
+on_idle_player(struct mpd_connection* conn)
+{
+	if(state != LA_STATE_PLAYING)
+	{
+		pending_idle |= MPD_IDLE_PLAYER;
+		return 0;
+	}
+	// the play, pause or seek we just sent, already on screen
+	if(status_unchanged(conn))
+	{
+		LOG_D("player idle: nothing new");
+		return 0;
+	}
+	LOG_D("player idle => status");
+	if(print_status(conn))
+	{
+		return -1;
+	}
+	return do_update_played(conn);
+}
+
+static int
+on_idle_mixer(struct mpd_connection* conn)
+{
+	if(state != LA_STATE_VOLUME)
+	{
+		return 0;
+	}
+	return print_volume(conn);
+}
+
+static int
+on_idle_database(struct mpd_connection* conn)
+{
+	// songs may have gone: the Resume list is read again in the background
+	la_resume_refresh(true);
+	la_episodes_invalidate();
+	return 0;
+}
+
+static int
+on_idle_next(struct mpd_connection* conn)
+{
+	struct mpd_status *status;
+	bool last;
+	long remaining_ms;
+
+	status = mpd_run_status(conn);
+	if(status == NULL)
+	{
+		return -1;
+	}
+	last = !radio_mode
+		&& mpd_status_get_state(status) == MPD_STATE_PLAY
+		&& mpd_status_get_total_time(status) > 0
+		&& mpd_status_get_song_pos(status) != -1
+		&& mpd_status_get_song_pos(status) + 1 == mpd_status_get_queue_length(status);
+	remaining_ms = mpd_status_get_total_time(status) * 1000L - mpd_status_get_elapsed_ms(status);
+	mpd_status_free(status);
+	mpd_response_finish(conn);
+
+	// stopped, paused or already followed by something: nothing to do
+	arm_next_timer(last ? (remaining_ms > NEXT_EPISODE_LEAD_MS ? remaining_ms - NEXT_EPISODE_LEAD_MS : 1) : 0);
+	return 0;
+}
+
+static int
+on_idle_group(struct mpd_connection* conn)
+{
+	// the rooms follow whatever changed here: keys or another client
+	return la_group_sync(conn);
+}
+
+typedef int (*IdleHandler)(struct mpd_connection* conn);
+
+// only these events wake the loop up: the sticker writes of
+// do_update_played() don't come back as events
+static const struct {
+	enum mpd_idle event;
+	IdleHandler handler;
+} idle_handlers[] = {
+	{ MPD_IDLE_PLAYER, on_idle_player },
+	{ MPD_IDLE_MIXER, on_idle_mixer },
+	{ MPD_IDLE_DATABASE, on_idle_database },
+	{ MPD_IDLE_PLAYER, on_idle_next },
+	{ MPD_IDLE_PLAYER | MPD_IDLE_MIXER, on_idle_group },
+};
+
+#define IDLE_HANDLERS_LENGTH (sizeof(idle_handlers) / sizeof(idle_handlers[0]))
+
+static bool
+send_idle(struct mpd_connection* conn)
+{
+	static enum mpd_idle mask = 0;
+	size_t i;
+
+	if(mask == 0)
+	{
+		for(i=0;i<IDLE_HANDLERS_LENGTH;i++)
+		{
+			mask |= idle_handlers[i].event;
+		}
+	}
+	return mpd_send_idle_mask(conn, mask);
+}
+
+// mpd errors are left for the caller, which goes back to idle mode
+static void
+dispatch_idle(struct mpd_connection* conn, enum mpd_idle idle)
+{
+	size_t i;
+
+	for(i=0;i<IDLE_HANDLERS_LENGTH;i++)
+	{
+		if((idle & idle_handlers[i].event) && idle_handlers[i].handler(conn) < 0)
+		{
+			return;
+		}
+	}
+}
+
+#define MAX_EVENTS 10
+static void wait_input_async(struct mpd_connection* conn, int pool_fd, int wifi_fd, int internet_fd, int stats_fd, int log_fd, int trace_fd, int* control_fds, int control_fds_count)
+{
+	struct epoll_event ev={0}, events[MAX_EVENTS];
+	int nfds, epollfd;
+	int n;
+	enum mpd_idle idle;
+	TraceType trace_type;
+	unsigned trace_value;
+	sigset_t mask;
+	int ret;
+
+	sigemptyset(&mask);
+
+	setup_timers();
+
+	epollfd = epoll_create1(0);
+	if (epollfd == -1)
+	{
+		perror("epoll_create1");
+		return;
+	}
+	mpd_epollfd = epollfd;
+
+	if (watch_mpd(conn))
+	{
+		return;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = mpd_timer_fd;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, mpd_timer_fd, &ev) == -1)
+	{
+		perror("epoll_ctl: mpd timer");
+		return;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = next_timer_fd;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, next_timer_fd, &ev) == -1)
+	{
+		perror("epoll_ctl: next episode timer");
+		return;
+	}
+
+	if(pool_fd != -1)
+	{
+		ev.events = EPOLLIN;
+		ev.data.fd = pool_fd;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, pool_fd, &ev) == -1)
+		{
+			perror("epoll_ctl: pool");
+			return;
+		}
+	}
+
+	if(wifi_fd != -1)
+	{
+		ev.events = EPOLLIN;
+		ev.data.fd = wifi_fd;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, wifi_fd, &ev) == -1)
+		{
+			perror("epoll_ctl: wifi");
+			return;
+		}
+	}
+
+	if(internet_fd != -1)
+	{
+		ev.events = EPOLLIN;
+		ev.data.fd = internet_fd;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, internet_fd, &ev) == -1)
+		{
+			perror("epoll_ctl: internet");
+			return;
+		}
+	}
+
+	if(stats_fd != -1)
+	{
+		ev.events = EPOLLIN;
+		ev.data.fd = stats_fd;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, stats_fd, &ev) == -1)
+		{
+			perror("epoll_ctl: stats");
+			return;
+		}
+	}
+
+	if(log_fd != -1)
+	{
+		ev.events = EPOLLIN;
+		ev.data.fd = log_fd;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, log_fd, &ev) == -1)
+		{
+			perror("epoll_ctl: log");
+			return;
+		}
+	}
+
+	if(trace_fd != -1)
+	{
+		ev.events = EPOLLIN;
+		ev.data.fd = trace_fd;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, trace_fd, &ev) == -1)
+		{
+			perror("epoll_ctl: trace");
+			return;
+		}
+	}
+
+	for(n=0; n<control_fds_count; n++)
+	{
+
+		ev.events = EPOLLIN;
+		ev.data.fd = control_fds[n];
 		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, control_fds[n], &ev) == -1)
 		{
 			perror("epoll_ctl: controls");
@@ -1324,7 +2363,7 @@ static void wait_input_async(struct mpd_connection* conn, int mpd_fd, int* contr
 
 	}
 
-	if(!mpd_send_idle(conn))
+	if(!send_idle(conn))
 	{
 		LOG_ERROR("Unable to put mpd in idle mode%s\n","");
 		return;
@@ -1335,6 +2374,8 @@ static void wait_input_async(struct mpd_connection* conn, int mpd_fd, int* contr
 	while(true)
 	{
 		nfds = epoll_pwait(epollfd, events, MAX_EVENTS, -1, &mask);
+		la_stats_add(stats_loop_wakeups, 1);
+		conn = mpd_conn;
 		if (nfds == -1) {
 			if(errno == EINTR)
 			{
@@ -1347,52 +2388,113 @@ static void wait_input_async(struct mpd_connection* conn, int mpd_fd, int* contr
 				else if(sleep_flag)
 				{
 					sleep_flag = 0;
-					if(do_sleep(conn))
+					if(conn != NULL && on_mpd_error(do_sleep(conn)))
 					{
 						return;
 					}
 				}
-				else
+				else if(stats_flag)
+				{
+					stats_flag = 0;
+					la_log_flush();
+					la_stats_dump(stdout);
+				}
+				else
+				{
+					LOG_ERROR("%s", "int by signal\n");
+					return;
+				}
+				continue;
+			}
+			else
+			{
+				perror("epoll_pwait");
+				continue;
+			}
+		}
+
+		for (n = 0; n < nfds; n++)
+		{
+			// may have been replaced by a reconnection
+			conn = mpd_conn;
+			if (events[n].data.fd == mpd_watched_fd)
+			{
+				if(events[n].events & (EPOLLERR | EPOLLHUP))
+				{
+					start_mpd_reconnect();
+				}
+				else
+				{
+					// whatever the screen: an unread answer keeps the socket readable
+					idle = mpd_recv_idle(conn, false);
+					if(idle)
+					{
+						la_trace_record(LA_TRACE_IDLE, idle);
+						la_stats_add(stats_mpd_idle, 1);
+						dispatch_idle(conn, idle);
+					}
+					if(mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS || !send_idle(conn))
+					{
+						on_mpd_error(-1);
+					}
+				}
+			}
+			else if (events[n].data.fd == mpd_timer_fd)
+			{
+				on_mpd_timer();
+			}
+			else if (events[n].data.fd == next_timer_fd)
+			{
+				on_next_timer();
+			}
+			else if (events[n].data.fd == pool_fd)
+			{
+				// Resume list, radio probes, listings
+				la_pool_handle();
+			}
+			else if (events[n].data.fd == wifi_fd)
+			{
+				if(on_mpd_error(on_wifi_changed(conn, wifi_fd)) < 0)
+				{
+					return;
+				}
+			}
+			else if (events[n].data.fd == internet_fd)
+			{
+				if(on_mpd_error(on_internet_changed(conn, la_internet_handle())) < 0)
 				{
-					LOG_ERROR("%s", "int by signal\n");
 					return;
 				}
-				continue;
 			}
-			else
+			else if (events[n].data.fd == stats_fd)
 			{
-				perror("epoll_pwait");
-				continue;
+				la_stats_handle();
 			}
-		}
-
-		for (n = 0; n < nfds; n++)
-		{
-			if (events[n].data.fd == mpd_fd)
+			else if (events[n].data.fd == log_fd)
+			{
+				la_log_handle();
+				// a recording la is usually stopped by a signal
+				la_trace_record_flush();
+			}
+			else if (events[n].data.fd == trace_fd)
 			{
-				if(state == LA_STATE_PLAYING)
+				// one event per wakeup lets mpd's answers in between
+				ret = la_trace_replay_next(&trace_type, &trace_value);
+				if(ret > 0)
 				{
-					if(mpd_recv_idle(conn, false))
-					{
-						if(ignore_next_idle)
-						{
-							printf("D: recv_idle IGNORE status\n");
-							ignore_next_idle = false;
-						}
-						else
-						{
-							printf("D: recv_idle => status\n");
-							print_status(conn);
-							do_update_played(conn);
-							ignore_next_idle = true; // do_update_played triggers idle ?
-						}
-					}
-					if(!mpd_send_idle(conn))
+					// mpd sends its own idle events in answer to the replayed keys
+					if(trace_type == LA_TRACE_CONTROL && trace_value < LA_CONTROL_LENGTH)
 					{
-						LOG_ERROR("Unable to put mpd in idle mode%s\n","");
-						return;
+						dispatch_control(trace_value, 1, NULL);
+						reset_timers();
 					}
 				}
+				if(ret < 0)
+				{
+					la_log_flush();
+					la_stats_dump(stdout);
+					return;
+				}
 			}
 			else
 			{
@@ -1427,9 +2529,8 @@ do_play(struct mpd_connection* conn)
 		return -1;
 	}
 
-	printf("D: do_play => status\n");
+	LOG_D("do_play => status");
 	print_status(conn);
-	ignore_next_idle = true;
 
 	return 0;
 }
@@ -1474,11 +2575,10 @@ do_playpause(Control ctrl, struct mpd_connection* conn)
 
 	if(state == LA_STATE_PLAYING)
 	{
-		printf("D: do_playpause => status\n");
+		LOG_D("do_playpause => status");
 		print_status(conn);
-		ignore_next_idle = true;
 	}
-	if(!mpd_send_idle(conn))
+	if(!send_idle(conn))
 	{
 		LOG_ERROR("Unable to put mpd in idle mode%s\n","");
 		return -1;
@@ -1501,7 +2601,7 @@ do_sleep(struct mpd_connection* conn)
 		return -1;
 	}
 
-	if(!mpd_send_idle(conn))
+	if(!send_idle(conn))
 	{
 		LOG_ERROR("Unable to put mpd in idle mode%s\n","");
 		return -1;
@@ -1621,7 +2721,7 @@ do_list_directory(struct mpd_connection* conn)
 	else
 	{
 		state_list_dir_index = state_list;
-		return fetch_and_print_list(conn, state_list_path);
+		return request_list(state_list_path, 0);
 	}
 }
 
@@ -1635,9 +2735,9 @@ do_menu(Control ctrl, struct mpd_connection* conn)
 		CHECK_CONNECTION(conn);
 		mpd_run_noidle(conn);
 		CHECK_CONNECTION(conn);
-		printf("D: do_menu => status\n");
+		LOG_D("do_menu => status");
 		print_status(conn);
-		if(!mpd_send_idle(conn))
+		if(!send_idle(conn))
 		{
 			LOG_ERROR("Unable to put mpd in idle mode%s\n","");
 			return -1;
@@ -1652,16 +2752,7 @@ do_menu(Control ctrl, struct mpd_connection* conn)
 		}
 		else
 		{
-			if(fetch_list(conn, NULL) == -1)
-			{
-				return -1;
-			}
-			if(state_list_dir_index < list_length)
-			{
-				state_list = state_list_dir_index;
-			}
-			print_list(-1);
-			return 0;
+			return request_list(NULL, state_list_dir_index);
 		}
 	default:
 		state = LA_STATE_MENU;
@@ -1676,50 +2767,60 @@ static int
 do_up(Control ctrl, struct mpd_connection* conn)
 {
 	int old_state_menu, old_state_list;
+	int i;
 
 	switch(state)
 	{
 
 	case LA_STATE_MENU:
 		old_state_menu = state_menu;
-		if(state_menu == 0)
+		for(i=0;i<control_steps;i++)
 		{
-			state_menu = MENU_LENGTH - 1;
-		}
-		else
-		{
-			state_menu--;
+			if(state_menu == 0)
+			{
+				state_menu = MENU_LENGTH - 1;
+			}
+			else
+			{
+				state_menu--;
+			}
 		}
 		print_menu(old_state_menu);
 		break;
 
 	case LA_STATE_PLAYING:
-		jump_backward(conn);
+		jump_backward(conn, control_steps);
 		break;
 
 	case LA_STATE_LIST:
 	case LA_STATE_RADIO:
 	case LA_STATE_RESUME:
 		old_state_list = state_list;
-		if(state_list == 0)
+		for(i=0;i<control_steps;i++)
 		{
-			state_list = list_length - 1;
-		}
-		else
-		{
-			state_list--;
+			if(state_list == 0)
+			{
+				state_list = list_length - 1;
+			}
+			else
+			{
+				state_list--;
+			}
 		}
 		print_list(old_state_list);
 		break;
 
 	case LA_STATE_ADD_REPLACE:
-		if(state_add_replace == 0)
+		for(i=0;i<control_steps;i++)
 		{
-			state_add_replace = 1;
-		}
-		else
-		{
-			state_add_replace = 0;
+			if(state_add_replace == 0)
+			{
+				state_add_replace = 1;
+			}
+			else
+			{
+				state_add_replace = 0;
+			}
 		}
 		print_add_replace(false);
 		break;
@@ -1742,21 +2843,21 @@ do_down(Control ctrl, struct mpd_connection* conn)
 	{
 	case LA_STATE_MENU:
 		old_state_menu = state_menu;
-		state_menu = (state_menu + 1) % MENU_LENGTH;
+		state_menu = (state_menu + control_steps) % MENU_LENGTH;
 		print_menu(old_state_menu);
 		break;
 	case LA_STATE_PLAYING:
-		jump_forward(conn);
+		jump_forward(conn, control_steps);
 		break;
 	case LA_STATE_LIST:
 	case LA_STATE_RADIO:
 	case LA_STATE_RESUME:
 		old_state_list = state_list;
-		state_list = (state_list + 1) % list_length;
+		state_list = (state_list + control_steps) % list_length;
 		print_list(old_state_list);
 		break;
 	case LA_STATE_ADD_REPLACE:
-		state_add_replace = (state_add_replace + 1) % ADD_REPLACE_LENGTH;
+		state_add_replace = (state_add_replace + control_steps) % ADD_REPLACE_LENGTH;
 		print_add_replace();
 		break;
 
@@ -1773,30 +2874,34 @@ static int
 do_left(Control ctrl, struct mpd_connection* conn)
 {
 	size_t len;
+	int i;
 	switch(state)
 	{
 	case LA_STATE_LIST:
 	case LA_STATE_RADIO:
 	case LA_STATE_RESUME:
 		len = strlen(list_contents[state_list]);
-		if(state_list_rl_offset > 10)
-		{
-			state_list_rl_offset -= 10;
-		}
-		else if(state_list_rl_offset > 0)
+		for(i=0;i<control_steps;i++)
 		{
-			state_list_rl_offset = 0;
-		}
-		else
-		{
-			state_list_rl_offset = len - (len % 10);
+			if(state_list_rl_offset > 10)
+			{
+				state_list_rl_offset -= 10;
+			}
+			else if(state_list_rl_offset > 0)
+			{
+				state_list_rl_offset = 0;
+			}
+			else
+			{
+				state_list_rl_offset = len - (len % 10);
+			}
 		}
 
 		print_list(-2);
 		break;
 
 	case LA_STATE_VOLUME:
-		return do_change_volume(conn, -1, false);
+		return do_change_volume(conn, -control_steps, false);
 
 	default:
 		return 0;
@@ -1808,6 +2913,7 @@ static int
 do_right(Control ctrl, struct mpd_connection* conn)
 {
 	size_t len;
+	int i;
 
 	switch(state)
 	{
@@ -1815,20 +2921,23 @@ do_right(Control ctrl, struct mpd_connection* conn)
 	case LA_STATE_RADIO:
 	case LA_STATE_RESUME:
 		len = strlen(list_contents[state_list]);
-		if(state_list_rl_offset < len - 10)
-		{
-			state_list_rl_offset += 10;
-		}
-		else
+		for(i=0;i<control_steps;i++)
 		{
-			state_list_rl_offset = 0;
+			if(state_list_rl_offset < len - 10)
+			{
+				state_list_rl_offset += 10;
+			}
+			else
+			{
+				state_list_rl_offset = 0;
+			}
 		}
 
 		print_list(-2);
 		break;
 
 	case LA_STATE_VOLUME:
-		return do_change_volume(conn, 1, false);
+		return do_change_volume(conn, control_steps, false);
 
 	default:
 		return 0;
@@ -1850,7 +2959,7 @@ do_ok(Control ctrl, struct mpd_connection* conn)
 			return fetch_and_print_resume(conn);
 		case 1:
 			state = LA_STATE_LIST;
-			return fetch_and_print_list(conn, NULL);
+			return request_list(NULL, 0);
 		case 2:
 			state = LA_STATE_VOLUME;
 			return fetch_and_print_volume(conn);
@@ -1861,7 +2970,8 @@ do_ok(Control ctrl, struct mpd_connection* conn)
 			state  = LA_STATE_SETTINGS;
 			state_settings = 0;
 			print_settings();
-			break;
+			// a too old verdict is probed again, printed once known
+			return on_internet_changed(conn, la_internet_probe(false));
 		case 5:
 			return do_shutdown(conn);
 		default:
@@ -1882,7 +2992,7 @@ do_ok(Control ctrl, struct mpd_connection* conn)
 		}
 		break;
 	case LA_STATE_RADIO:
-		return do_replace_playing_with_selected(conn, true);
+		return do_play_radio(conn, list_radios_order[state_list]);
 
 	case LA_STATE_ADD_REPLACE:
 		return do_replace_playing_with_selected(conn, state_add_replace == 0);
@@ -1961,9 +3071,15 @@ do_stop(Control ctrl, struct mpd_connection* conn)
 
 	mpd_status_free(status);
 
+	// give the podcasts back
+	if(leave_radio_mode(conn, true))
+	{
+		return -1;
+	}
+
 	la_lcdHome();
 	la_lcdPuts("    MPD STOPPED    ");
-	if(!mpd_send_idle(conn))
+	if(!send_idle(conn))
 	{
 		LOG_ERROR("Unable to put mpd in idle mode%s\n","");
 		return -1;
@@ -1974,47 +3090,21 @@ do_stop(Control ctrl, struct mpd_connection* conn)
 static int
 do_internet_status()
 {
-	CURL *curl;
-	CURLcode res;
-	char errbuf[CURL_ERROR_SIZE] = {0};
-
 	la_lcdPosition(0, 1);
 	la_lcdPuts("INTERNET...");
-	la_lcdPosition(0, 12);
-
-	curl = curl_easy_init();
+	la_lcdPosition(12, 1);
 
-	if(curl)
+	// cached verdict, refreshed when entering the settings
+	switch(la_internet_status())
 	{
-		curl_easy_setopt(curl, CURLOPT_URL, list_radios_uris[0]);
-		curl_easy_setopt(curl, CURLOPT_HEADER, 1);
-		curl_easy_setopt(curl, CURLOPT_NOBODY, 1);
-		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 2L);
-		curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
-		res = curl_easy_perform(curl);
-		curl_easy_cleanup(curl);
-
-		if(res != CURLE_OK)
-		{
-			size_t len = strlen(errbuf);
-			fprintf(stderr, "E: libcurl: (%d) ", res);
-			if(len)
-			{
-				fprintf(stderr, "%s%s", errbuf,
-					((errbuf[len - 1] != '\n') ? "\n" : ""));
-			}
-			else
-			{
-				fprintf(stderr, "%s\n", curl_easy_strerror(res));
-			}
-			la_lcdPuts("KO");
-			return -1;
-		}
+	case LA_INTERNET_OK:
 		la_lcdPuts("OK");
 		return 0;
-  	}else{
-  		fprintf(stderr, "E: couldn't initialize curl\n");
-  		la_lcdPuts("KO");
+	case LA_INTERNET_KO:
+		la_lcdPuts("KO");
+		return -1;
+	default:
+		la_lcdPuts("?");
 		return -1;
 	}
 }
@@ -2022,68 +3112,125 @@ do_internet_status()
 static int
 do_wifi_status()
 {
-	char* argv[4] = { "/usr/sbin/ifplugstatus" , "-q", DEFAULT_WLAN_ITF, NULL};
-	pid_t child_pid;
-	int child_status;
-	pid_t tpid;
-
 	la_lcdClear();
 	la_lcdHome();
 	la_lcdPuts("WIFI...");
+	la_lcdPosition(12, 0);
 
-	child_pid = fork();
-	if(child_pid == 0) {
-
-		execvp(argv[0], argv);
+	if(la_wifi_has_address())
+	{
+		la_lcdPuts("OK");
+		return do_internet_status();
+	}
+	else if(la_wifi_has_link())
+	{
+		la_lcdPuts("IP?");
+	}
+	else
+	{
+		la_lcdPuts("KO");
+	}
+	return -1;
+}
 
-		printf("E: Unknown command: %s\n", argv[0]);
-		exit(0);
+static int
+play_pending_stream(struct mpd_connection* conn)
+{
+	if(!pending_stream_play || la_internet_status() != LA_INTERNET_OK || conn == NULL)
+	{
+		return 0;
 	}
-	else {
-		do {
-			tpid = wait(&child_status);
-		} while(tpid != child_pid);
 
-		if(WIFEXITED(child_status)){
-			child_status = WEXITSTATUS(child_status);
-			printf("I: ifplugstatus %d\n", child_status);
-			la_lcdPosition(12, 0);
-			if(child_status == 2){
-				la_lcdPuts("OK");
-				return do_internet_status();
-			}else{
-				la_lcdPuts("KO");
-			}
-		}else{
-			fprintf(stderr, "E: ifplugstatus didn't terminate normally\n");
+	pending_stream_play = false;
+	LOG_D("internet OK => play");
+
+	CHECK_CONNECTION(conn);
+	mpd_run_noidle(conn);
+
+	if(state == LA_STATE_PLAYING)
+	{
+		if(do_play(conn))
+		{
 			return -1;
 		}
 	}
+	else
+	{
+		// don't pull the user out of the menus
+		mpd_run_play(conn);
+		CHECK_CONNECTION(conn);
+	}
+
+	if(!send_idle(conn))
+	{
+		LOG_ERROR("Unable to put mpd in idle mode%s\n","");
+		return -1;
+	}
 	return 0;
 }
 
+static int
+on_internet_changed(struct mpd_connection* conn, int changed)
+{
+	if(changed <= 0)
+	{
+		return changed;
+	}
+
+	if(state == LA_STATE_SETTINGS)
+	{
+		print_settings();
+	}
+
+	if(la_internet_status() == LA_INTERNET_OK)
+	{
+		la_radios_probe(false);
+	}
+
+	return play_pending_stream(conn);
+}
+
+static int
+on_wifi_changed(struct mpd_connection* conn, int wifi_fd)
+{
+	int ret;
+
+	ret = la_wifi_handle(wifi_fd);
+	if(ret <= 0)
+	{
+		return ret;
+	}
+
+	if(state == LA_STATE_SETTINGS)
+	{
+		print_settings();
+	}
+
+	// the route to the outside may have changed
+	return on_internet_changed(conn, la_internet_probe(true));
+}
+
 
 static int
 do_radio(Control control, struct mpd_connection* conn)
 {
 	int radio;
+	// presets are the first stations of the registry, in file order
 	switch(control)
 	{
-		case LA_RADIO_INTER:
+		case LA_RADIO_1:
 			radio = 0;
 			break;
-		case LA_RADIO_RENNES:
+		case LA_RADIO_2:
 			radio = 1;
 			break;
-		case LA_RADIO_CANALB:
+		case LA_RADIO_3:
 			radio = 2;
 			break;
 		default:
 			radio = 0;
 	}
-	return do_replace_playing_with_uri(conn,
-	                                   true,
-	                                   list_radios_uris[radio]);
+	return do_play_radio(conn, radio);
 }
 
 
@@ -2093,8 +3240,7 @@ do_predefined_podcast(Control control, struct mpd_connection* conn)
 	if(control == LA_PODCAST_DEGUSTER)
 	{
 		state = LA_STATE_LIST;
-		return fetch_and_print_list(conn,
-			"Podcasts/On va déguster");
+		return request_list("Podcasts/On va déguster", 0);
 	}
 
 	printf("E: Invalid control for do_predefined_podcast: %i\n", control);
@@ -2105,52 +3251,159 @@ int
 run()
 {
 	struct mpd_connection *conn = NULL;
-	int mpd_fd;
+	int pool_fd;
+	int wifi_fd;
+	int internet_fd;
+	int stats_fd;
+	int log_fd;
+	int trace_fd = -1;
+	const char* group_file;
 	int fdControlCount;
 	int* fdControls;
+	const char* keymap_file;
 	int play_ok = 1; // mettre à 0 pour reprendre
-	int i;
+	pthread_t mpd_thread;
+	MpdConnectResult mpd_result = { NULL, -1 };
+	int ret = 0;
+
+	la_boot_start();
+	init_stats();
+	// debug messages go to memory, and to the log file every few seconds
+	log_fd = la_log_init();
+
+	if(trace_replay_path != NULL && la_trace_replay_open(trace_replay_path, trace_speed))
+	{
+		return -1;
+	}
+
+	// mpd is usually starting at the same time as us: wait for it while the
+	// controls and the display are set up
+	if(pthread_create(&mpd_thread, NULL, connect_to_mpd_thread, &mpd_result))
+	{
+		perror("E: mpd connect thread");
+		return -1;
+	}
 
+	// before the display: on the pi, the lcd is driven through the
+	// serial link or the wiringPi setup of the controls
+	keymap_file = getenv("LA_KEYMAP");
+	la_keymap_load(keymap_file != NULL ? keymap_file : DEFAULT_KEYMAP_FILE);
 	if(la_init_controls(&fdControls, &fdControlCount))
 	{
 		fprintf(stderr, "E: init controls\n");
+		pthread_join(mpd_thread, NULL);
+		if(mpd_result.conn != NULL)
+		{
+			mpd_connection_free(mpd_result.conn);
+		}
 		return -1;
 	}
+	la_boot_mark("controls");
 
 	if(la_init_ecran())
 	{
 		fprintf(stderr, "E: init ecran\n");
-		return -1;
+		ret = -1;
+	}
+	else
+	{
+		la_lcdClear();
+		la_lcdHome();
+		la_lcdPuts("LecteurAudio");
+		la_lcdPosition(0, 1);
+		la_lcdPuts("Demarrage...");
+		la_boot_mark("display");
 	}
 
-	if(connect_to_mpd(&conn)){
+	if(ret == 0 && la_radios_load(DEFAULT_RADIOS_FILE, DEFAULT_RADIOS_CACHE))
+	{
+		fprintf(stderr, "E: no radio\n");
+		ret = -1;
+	}
+
+	pthread_join(mpd_thread, NULL);
+	conn = mpd_result.conn;
+	if(ret == 0 && mpd_result.ret)
+	{
+		LOG_ERROR("%s\n", "MPD KO");
+		ret = -1;
+	}
+	if(ret)
+	{
+		if(conn != NULL)
+		{
+			mpd_connection_free(conn);
+		}
 		la_exit();
 		return -1;
 	}
+	la_boot_mark("mpd");
+	mpd_conn = conn;
 
-	mpd_fd = mpd_async_get_fd(mpd_connection_get_async(conn));
+	mpd_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	next_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(mpd_timer_fd == -1 || next_timer_fd == -1)
+	{
+		perror("E: mpd timerfd");
+		mpd_connection_free(conn);
+		la_exit();
+		return -1;
+	}
 
-	printf("D: run => status\n");
+	LOG_D("run => status");
 	print_status(conn);
+	la_boot_mark("status");
+
+	// blocking jobs, their results come back through pool_fd
+	pool_fd = la_pool_init();
 
-	la_on_key(LA_PLAYPAUSE, (Callback)do_playpause, conn);
-	la_on_key(LA_MENU, (Callback)do_menu, conn);
-	la_on_key(LA_UP, (Callback)do_up, conn);
-	la_on_key(LA_DOWN, (Callback)do_down, conn);
-	la_on_key(LA_LEFT, (Callback)do_left, conn);
-	la_on_key(LA_RIGHT, (Callback)do_right, conn);
-	la_on_key(LA_OK, (Callback)do_ok, conn);
-	la_on_key(LA_STOP, (Callback)do_stop, conn);
-	la_on_key(LA_EXIT, (Callback)do_stop, conn);
-	la_on_key(LA_RADIO_INTER, (Callback)do_radio, conn);
-	la_on_key(LA_RADIO_RENNES, (Callback)do_radio, conn);
-	la_on_key(LA_RADIO_CANALB, (Callback)do_radio, conn);
-	la_on_key(LA_PODCAST_DEGUSTER, (Callback)do_predefined_podcast, conn);
+	// resume positions (and gpodder.net ones) are fetched in the background
+	la_resume_init(DEFAULT_RESUME_INDEX, on_resume_refreshed);
+	// also writes the positions left unsynced by the previous run
+	la_resume_refresh(false);
 
+	on_control(LA_PLAYPAUSE, do_playpause);
+	on_control(LA_MENU, do_menu);
+	on_control(LA_UP, do_up);
+	on_control(LA_DOWN, do_down);
+	on_control(LA_LEFT, do_left);
+	on_control(LA_RIGHT, do_right);
+	on_control(LA_OK, do_ok);
+	on_control(LA_STOP, do_stop);
+	on_control(LA_EXIT, do_stop);
+	on_control(LA_RADIO_1, do_radio);
+	on_control(LA_RADIO_2, do_radio);
+	on_control(LA_RADIO_3, do_radio);
+	on_control(LA_PODCAST_DEGUSTER, do_predefined_podcast);
+
+	// link and address changes arrive through netlink, no need to poll
+	wifi_fd = la_wifi_init(DEFAULT_WLAN_ITF);
+
+	// non-blocking probe of the first radio's server
+	internet_fd = la_internet_init(la_radios_get(0)->uri);
+	if(la_wifi_has_address())
+	{
+		la_internet_probe(false);
+	}
+
+	// stations are probed once the internet is known to be there
+	la_radios_init(on_radios_probed);
+	la_boot_mark("network");
+
+	radio_mode = is_radio_queue(conn);
+
+	pending_stream_play = false;
 	if(is_stream_in_queue(conn))
 	{
-		for(i=0;  i<10 && ((play_ok = do_wifi_status()) != 0); i++){
-			sleep(1);
+		if(la_internet_status() == LA_INTERNET_OK)
+		{
+			play_ok = 0;
+		}
+		else
+		{
+			// a stream needs the network: play it as soon as the probe succeeds
+			LOG_D("waiting for internet to play the stream");
+			pending_stream_play = true;
 		}
 	}
 	if(play_ok == 0)
@@ -2158,11 +3411,54 @@ run()
 		do_play(conn);
 	}
 
-	wait_input_async(conn, mpd_fd, fdControls, fdControlCount);
+	// cat the socket (e.g. socat - UNIX:/run/la.stats) to read the stats
+	stats_fd = la_stats_init(DEFAULT_STATS_SOCKET);
+
+	la_boot_mark("ready");
+	la_boot_summary();
+
+	// LA_GROUP=file for a group of local mpd (or mock_mpd) instances
+	group_file = getenv("LA_GROUP");
+	la_group_init(group_file != NULL ? group_file : DEFAULT_GROUP_FILE);
+
+	if(trace_replay_path != NULL)
+	{
+		trace_fd = la_trace_replay_start();
+		if(trace_fd == -1)
+		{
+			ret = -1;
+		}
+	}
+
+	if(ret == 0)
+	{
+		wait_input_async(conn, pool_fd, wifi_fd, internet_fd, stats_fd, log_fd, trace_fd, fdControls, fdControlCount);
+	}
+	// the loop may have ended up with another connection, or none
+	conn = mpd_conn;
+	mpd_conn = NULL;
+	close(mpd_timer_fd);
+	mpd_timer_fd = -1;
+	close(next_timer_fd);
+	next_timer_fd = -1;
 
-	mpd_connection_free(conn);
+	la_trace_replay_close();
+	// the jobs still running use the resume index
+	la_pool_exit();
+	la_group_exit();
+	la_episodes_exit();
+	la_stats_exit();
+	la_internet_exit();
+	la_wifi_exit();
+	la_resume_exit();
+	if(conn != NULL)
+	{
+		mpd_connection_free(conn);
+	}
 	la_exit();
-	return 0;
+	la_keymap_exit();
+	la_log_exit();
+	return ret;
 }
 
 int
@@ -2211,7 +3507,7 @@ run_in_background()
 		}
 		setlinebuf(stdout);
 		setlinebuf(stderr);
-		printf("I: I'm a daemon now\n");
+		LOG_I("I'm a daemon now");
 		ret = save_pid();
 		if(ret)
 		{
@@ -2227,6 +3523,7 @@ run_in_background()
 					return -1;
 				}
 				ret = run();
+				la_log_flush();
 				if(ret)
 				{
 					sleep(5);
@@ -2263,28 +3560,87 @@ usage(int argc, char** argv, int code)
 		progname = "la";
 	}
 	printf(
-		"Usage: %s [-b]\n"
+		"Usage: %s [-b] [-r FILE | -p FILE [-s SPEED]] [-d FILE]\n"
 		"LecteurAudio: a homemade media player\n"
 		"  -b, --background    daemonize\n"
+		"  -r, --record FILE   record keys and mpd events to FILE\n"
+		"  -p, --replay FILE   replay the keys recorded in FILE, then exit\n"
+		"  -s, --speed SPEED   replay SPEED times faster, 0 for no delays (default 1)\n"
+		"  -d, --dump FILE     print a recorded trace\n"
 		"  -h, --help          print this help\n", progname);
 	return code;
 }
 
 int
 main(int argc, char ** argv){
-	if(argc > 1 &&
-		(!strcmp("-h", argv[1]) || !strcmp("--help", argv[1])))
+	static const struct option options[] = {
+		{ "background", no_argument, NULL, 'b' },
+		{ "record", required_argument, NULL, 'r' },
+		{ "replay", required_argument, NULL, 'p' },
+		{ "speed", required_argument, NULL, 's' },
+		{ "dump", required_argument, NULL, 'd' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	bool background = false;
+	const char* record_path = NULL;
+	char* end;
+	int opt;
+	int ret;
+
+	while((opt = getopt_long(argc, argv, "br:p:s:d:h", options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'b':
+			background = true;
+			break;
+		case 'r':
+			record_path = optarg;
+			break;
+		case 'p':
+			trace_replay_path = optarg;
+			break;
+		case 's':
+			trace_speed = strtod(optarg, &end);
+			if(*end != '\0' || trace_speed < 0)
+			{
+				return usage(argc, argv, -1);
+			}
+			break;
+		case 'd':
+			return la_trace_dump(optarg) ? 1 : 0;
+		case 'h':
+			return usage(argc, argv, 0);
+		default:
+			return usage(argc, argv, -1);
+		}
+	}
+	// a replay ends the loop, the daemon would start it over and over
+	if(optind < argc || (background && trace_replay_path != NULL)
+		|| (record_path != NULL && trace_replay_path != NULL))
+	{
+		return usage(argc, argv, -1);
+	}
+
+	// opened now: the daemon runs in /
+	if(record_path != NULL && la_trace_record_open(record_path))
 	{
-		return usage(argc, argv, 0);
+		return 1;
 	}
-	if(argc == 2 &&
-		(!strcmp("-b", argv[1]) || !strcmp("--background", argv[1])))
+
+	// before any thread may use curl
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+
+	if(background)
 	{
-		return run_in_background();
+		ret = run_in_background();
 	}
-	if(argc > 1)
+	else
 	{
-		return usage(argc, argv, -1);
+		ret = run();
+		la_log_flush();
 	}
-	return run();
+	la_trace_record_close();
+	return ret;
 }
@@ -0,0 +1,1059 @@
+/* mock_mpd.c
+   Copyright 2015 Eric Le Lay
+   This file is part of LecteurAudio.
+
+    LecteurAudio is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LecteurAudio is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LecteurAudio.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Just enough of the MPD protocol for la, on a unix socket, with a fake
+   library of podcasts. Used by bench_run (make bench).
+
+   usage: mock_mpd -s socket [-l latency_ms] [-n library_size]
+
+   "x-bench-stats" answers the commands and bytes exchanged with the other
+   clients since the start.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_CLIENTS 16
+#define MAX_ARGS 16
+#define MAX_QUEUE 256
+#define MAX_STICKERS 4096
+#define MAX_PLAYLISTS 8
+#define IN_BUFFER_SIZE 8192
+#define EPISODES_PER_SHOW 20
+
+#define IDLE_PLAYER 1
+#define IDLE_PLAYLIST 2
+#define IDLE_MIXER 4
+#define IDLE_STICKER 8
+#define IDLE_STORED_PLAYLIST 16
+#define IDLE_DATABASE 32
+#define IDLE_ALL 63
+
+static const char* idle_names[] = { "player", "playlist", "mixer", "sticker", "stored_playlist", "database" };
+
+#define ACK_ARG 2
+#define ACK_UNKNOWN 5
+#define ACK_NO_EXIST 50
+#define ACK_EXIST 56
+
+typedef struct {
+	char* data;
+	size_t len;
+	size_t size;
+} Out;
+
+typedef struct {
+	int fd;
+	char in[IN_BUFFER_SIZE];
+	size_t in_len;
+	bool idle;
+	unsigned idle_mask;
+	unsigned pending;
+	// command list being received
+	bool in_list;
+	bool list_ok;
+	char** list;
+	size_t list_len;
+	// bench_run's own connection, not counted
+	bool control;
+} Client;
+
+typedef struct {
+	char* uri;
+	char* title;
+	char* artist;
+	int duration;
+} Song;
+
+typedef struct {
+	char* uri;
+	int id;
+} QueueEntry;
+
+typedef struct {
+	char* uri;
+	char* name;
+	char* value;
+} Sticker;
+
+typedef struct {
+	char* name;
+	char** uris;
+	size_t len;
+} Playlist;
+
+typedef enum { PLAYER_STOP, PLAYER_PLAY, PLAYER_PAUSE } PlayerState;
+
+static Client clients[MAX_CLIENTS];
+static int latency_ms = 0;
+
+static Song* library;
+static size_t library_len;
+static size_t shows;
+
+static QueueEntry queue[MAX_QUEUE];
+static size_t queue_len = 0;
+static int next_id = 1;
+static unsigned queue_version = 1;
+
+static PlayerState player = PLAYER_PAUSE;
+static int current = 0;
+static int elapsed = 0;
+static time_t play_start;
+static int volume = 50;
+
+static Sticker stickers[MAX_STICKERS];
+static size_t stickers_len = 0;
+
+static Playlist playlists[MAX_PLAYLISTS];
+
+static unsigned long stats_commands = 0;
+static unsigned long stats_bytes_in = 0;
+static unsigned long stats_bytes_out = 0;
+
+static void
+out_printf(Out* out, const char* fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	while(1)
+	{
+		va_start(ap, fmt);
+		len = vsnprintf(out->data + out->len, out->size - out->len, fmt, ap);
+		va_end(ap);
+		if(out->len + len < out->size)
+		{
+			out->len += len;
+			return;
+		}
+		out->size = out->size * 2 + len;
+		out->data = realloc(out->data, out->size);
+		if(out->data == NULL)
+		{
+			perror("E: mock_mpd out");
+			exit(1);
+		}
+	}
+}
+
+static void
+send_out(Client* c, Out* out)
+{
+	size_t sent = 0;
+	ssize_t ret;
+
+	while(sent < out->len)
+	{
+		ret = send(c->fd, out->data + sent, out->len - sent, MSG_NOSIGNAL);
+		if(ret <= 0)
+		{
+			if(ret == -1 && errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		sent += ret;
+	}
+	if(!c->control)
+	{
+		stats_bytes_out += sent;
+	}
+	out->len = 0;
+}
+
+static void
+make_library(size_t size)
+{
+	size_t i;
+
+	shows = (size + EPISODES_PER_SHOW - 1) / EPISODES_PER_SHOW;
+	library_len = size;
+	library = calloc(size, sizeof(Song));
+	for(i=0;i<size;i++)
+	{
+		if(asprintf(&library[i].uri, "Podcasts/Show %02li/Episode %03li.mp3",
+				i / EPISODES_PER_SHOW, i % EPISODES_PER_SHOW) == -1
+			|| asprintf(&library[i].title, "Episode %li of show %li",
+				i % EPISODES_PER_SHOW, i / EPISODES_PER_SHOW) == -1
+			|| asprintf(&library[i].artist, "Show %02li", i / EPISODES_PER_SHOW) == -1)
+		{
+			perror("E: mock_mpd library");
+			exit(1);
+		}
+		library[i].duration = 600 + (i * 37) % 3000;
+	}
+}
+
+static Song*
+find_song(const char* uri)
+{
+	size_t i;
+
+	for(i=0;i<library_len;i++)
+	{
+		if(!strcmp(library[i].uri, uri))
+		{
+			return library + i;
+		}
+	}
+	return NULL;
+}
+
+static void
+changed(unsigned events)
+{
+	int i;
+
+	for(i=0;i<MAX_CLIENTS;i++)
+	{
+		if(clients[i].fd != -1)
+		{
+			clients[i].pending |= events;
+		}
+	}
+}
+
+static int
+current_elapsed()
+{
+	if(player == PLAYER_PLAY)
+	{
+		return elapsed + (time(NULL) - play_start);
+	}
+	return elapsed;
+}
+
+static void
+print_song(Out* out, const char* uri, int pos, int id)
+{
+	Song* song;
+
+	out_printf(out, "file: %s\n", uri);
+	song = find_song(uri);
+	if(song != NULL)
+	{
+		out_printf(out, "Time: %i\nArtist: %s\nTitle: %s\n", song->duration, song->artist, song->title);
+	}
+	if(pos >= 0)
+	{
+		out_printf(out, "Pos: %i\nId: %i\n", pos, id);
+	}
+}
+
+static void
+queue_add(const char* uri)
+{
+	if(queue_len == MAX_QUEUE)
+	{
+		return;
+	}
+	queue[queue_len].uri = strdup(uri);
+	queue[queue_len].id = next_id++;
+	queue_len++;
+	queue_version++;
+}
+
+static void
+queue_clear()
+{
+	size_t i;
+
+	for(i=0;i<queue_len;i++)
+	{
+		free(queue[i].uri);
+	}
+	queue_len = 0;
+	queue_version++;
+	player = PLAYER_STOP;
+	current = 0;
+	elapsed = 0;
+}
+
+static Playlist*
+find_playlist(const char* name)
+{
+	int i;
+
+	for(i=0;i<MAX_PLAYLISTS;i++)
+	{
+		if(playlists[i].name != NULL && !strcmp(playlists[i].name, name))
+		{
+			return playlists + i;
+		}
+	}
+	return NULL;
+}
+
+static Sticker*
+find_sticker(const char* uri, const char* name)
+{
+	size_t i;
+
+	for(i=0;i<stickers_len;i++)
+	{
+		if(!strcmp(stickers[i].uri, uri) && !strcmp(stickers[i].name, name))
+		{
+			return stickers + i;
+		}
+	}
+	return NULL;
+}
+
+static void
+set_sticker(const char* uri, const char* name, const char* value)
+{
+	Sticker* s;
+
+	s = find_sticker(uri, name);
+	if(s == NULL)
+	{
+		if(stickers_len == MAX_STICKERS)
+		{
+			return;
+		}
+		s = stickers + stickers_len++;
+		s->uri = strdup(uri);
+		s->name = strdup(name);
+	}
+	else
+	{
+		free(s->value);
+	}
+	s->value = strdup(value);
+}
+
+static void
+list_directory(Out* out, const char* path)
+{
+	char prefix[64];
+	size_t i;
+
+	for(i=0;i<shows;i++)
+	{
+		snprintf(prefix, sizeof(prefix), "Podcasts/Show %02li", i);
+		if(!strcmp(path, "Podcasts"))
+		{
+			out_printf(out, "directory: %s\n", prefix);
+		}
+	}
+	for(i=0;i<library_len;i++)
+	{
+		if(!strncmp(library[i].uri, path, strlen(path))
+			&& library[i].uri[strlen(path)] == '/'
+			&& strchr(library[i].uri + strlen(path) + 1, '/') == NULL)
+		{
+			print_song(out, library[i].uri, -1, 0);
+		}
+	}
+}
+
+// returns 0 or an ACK code, with the message in err
+static int
+execute(Client* c, int argc, char** argv, Out* out, char* err, size_t err_len)
+{
+	const char* cmd = argv[0];
+	Playlist* pl;
+	Sticker* s;
+	size_t i;
+	int n;
+
+#define ARGS(min) \
+	if(argc < (min) + 1) \
+	{ \
+		snprintf(err, err_len, "wrong number of arguments for \"%s\"", cmd); \
+		return ACK_ARG; \
+	}
+
+	if(!strcmp(cmd, "ping") || !strcmp(cmd, "noidle"))
+	{
+		// noidle is answered by the idle handling
+	}
+	else if(!strcmp(cmd, "status"))
+	{
+		out_printf(out, "volume: %i\nrepeat: 0\nrandom: 0\nsingle: 0\nconsume: 0\n"
+			"playlist: %u\nplaylistlength: %li\nstate: %s\n",
+			volume, queue_version, queue_len,
+			player == PLAYER_PLAY ? "play" : player == PLAYER_PAUSE ? "pause" : "stop");
+		if(queue_len > 0)
+		{
+			out_printf(out, "song: %i\nsongid: %i\n", current, queue[current].id);
+		}
+		if(player != PLAYER_STOP && queue_len > 0)
+		{
+			Song* song = find_song(queue[current].uri);
+			out_printf(out, "time: %i:%i\nelapsed: %i.000\n", current_elapsed(),
+				song != NULL ? song->duration : 0, current_elapsed());
+		}
+	}
+	else if(!strcmp(cmd, "currentsong"))
+	{
+		if(queue_len > 0)
+		{
+			print_song(out, queue[current].uri, current, queue[current].id);
+		}
+	}
+	else if(!strcmp(cmd, "playlistinfo"))
+	{
+		for(i=0;i<queue_len;i++)
+		{
+			if(argc < 2 || atoi(argv[1]) == i)
+			{
+				print_song(out, queue[i].uri, i, queue[i].id);
+			}
+		}
+	}
+	else if(!strcmp(cmd, "add"))
+	{
+		ARGS(1);
+		if(strstr(argv[1], "://") == NULL && find_song(argv[1]) == NULL)
+		{
+			snprintf(err, err_len, "No such song");
+			return ACK_NO_EXIST;
+		}
+		queue_add(argv[1]);
+		changed(IDLE_PLAYLIST);
+	}
+	else if(!strcmp(cmd, "clear"))
+	{
+		queue_clear();
+		changed(IDLE_PLAYLIST | IDLE_PLAYER);
+	}
+	else if(!strcmp(cmd, "play"))
+	{
+		if(argc > 1)
+		{
+			n = atoi(argv[1]);
+			if(n < 0 || n >= queue_len)
+			{
+				snprintf(err, err_len, "Bad song index");
+				return ACK_ARG;
+			}
+			if(n != current)
+			{
+				elapsed = 0;
+			}
+			current = n;
+		}
+		if(queue_len > 0)
+		{
+			if(player != PLAYER_PLAY)
+			{
+				play_start = time(NULL);
+			}
+			player = PLAYER_PLAY;
+		}
+		changed(IDLE_PLAYER);
+	}
+	else if(!strcmp(cmd, "pause"))
+	{
+		if(player == PLAYER_PLAY && (argc < 2 || atoi(argv[1])))
+		{
+			elapsed = current_elapsed();
+			player = PLAYER_PAUSE;
+		}
+		else if(player == PLAYER_PAUSE && (argc < 2 || !atoi(argv[1])))
+		{
+			play_start = time(NULL);
+			player = PLAYER_PLAY;
+		}
+		changed(IDLE_PLAYER);
+	}
+	else if(!strcmp(cmd, "stop"))
+	{
+		player = PLAYER_STOP;
+		elapsed = 0;
+		changed(IDLE_PLAYER);
+	}
+	else if(!strcmp(cmd, "seek"))
+	{
+		ARGS(2);
+		current = atoi(argv[1]) < queue_len ? atoi(argv[1]) : 0;
+		elapsed = atoi(argv[2]);
+		play_start = time(NULL);
+		changed(IDLE_PLAYER);
+	}
+	else if(!strcmp(cmd, "seekcur"))
+	{
+		// group rooms seek to the millisecond, the mock to the second
+		ARGS(1);
+		elapsed = atoi(argv[1]);
+		play_start = time(NULL);
+		changed(IDLE_PLAYER);
+	}
+	else if(!strcmp(cmd, "setvol"))
+	{
+		ARGS(1);
+		volume = atoi(argv[1]);
+		changed(IDLE_MIXER);
+	}
+	else if(!strcmp(cmd, "volume"))
+	{
+		ARGS(1);
+		volume += atoi(argv[1]);
+		volume = volume < 0 ? 0 : volume > 100 ? 100 : volume;
+		changed(IDLE_MIXER);
+	}
+	else if(!strcmp(cmd, "lsinfo"))
+	{
+		if(argc < 2 || !strcmp(argv[1], "") || !strcmp(argv[1], "/"))
+		{
+			out_printf(out, "directory: Podcasts\n");
+		}
+		else if(!strcmp(argv[1], "Podcasts") || !strncmp(argv[1], "Podcasts/Show ", 14))
+		{
+			list_directory(out, argv[1]);
+		}
+		else
+		{
+			snprintf(err, err_len, "No such directory");
+			return ACK_NO_EXIST;
+		}
+	}
+	else if(!strcmp(cmd, "search") || !strcmp(cmd, "find"))
+	{
+		ARGS(2);
+		for(i=0;i<library_len;i++)
+		{
+			if((!strcmp(cmd, "find") && !strcmp(library[i].uri, argv[2]))
+				|| (!strcmp(cmd, "search") && strstr(library[i].uri, argv[2]) != NULL))
+			{
+				print_song(out, library[i].uri, -1, 0);
+			}
+		}
+	}
+	else if(!strcmp(cmd, "sticker"))
+	{
+		ARGS(3);
+		if(!strcmp(argv[1], "set"))
+		{
+			ARGS(5);
+			set_sticker(argv[3], argv[4], argv[5]);
+			changed(IDLE_STICKER);
+		}
+		else if(!strcmp(argv[1], "get"))
+		{
+			ARGS(4);
+			s = find_sticker(argv[3], argv[4]);
+			if(s == NULL)
+			{
+				snprintf(err, err_len, "no such sticker");
+				return ACK_NO_EXIST;
+			}
+			out_printf(out, "sticker: %s=%s\n", s->name, s->value);
+		}
+		else if(!strcmp(argv[1], "find"))
+		{
+			ARGS(4);
+			for(i=0;i<stickers_len;i++)
+			{
+				if(!strcmp(stickers[i].name, argv[4])
+					&& !strncmp(stickers[i].uri, argv[3], strlen(argv[3])))
+				{
+					out_printf(out, "file: %s\nsticker: %s=%s\n", stickers[i].uri,
+						stickers[i].name, stickers[i].value);
+				}
+			}
+		}
+		else
+		{
+			snprintf(err, err_len, "bad request");
+			return ACK_ARG;
+		}
+	}
+	else if(!strcmp(cmd, "save"))
+	{
+		ARGS(1);
+		if(find_playlist(argv[1]) != NULL)
+		{
+			snprintf(err, err_len, "Playlist already exists");
+			return ACK_EXIST;
+		}
+		pl = NULL;
+		for(n=0;pl == NULL && n<MAX_PLAYLISTS;n++)
+		{
+			if(playlists[n].name == NULL)
+			{
+				pl = playlists + n;
+			}
+		}
+		if(pl == NULL)
+		{
+			snprintf(err, err_len, "too many playlists");
+			return ACK_EXIST;
+		}
+		pl->name = strdup(argv[1]);
+		pl->len = queue_len;
+		pl->uris = calloc(queue_len, sizeof(char*));
+		for(i=0;i<queue_len;i++)
+		{
+			pl->uris[i] = strdup(queue[i].uri);
+		}
+		changed(IDLE_STORED_PLAYLIST);
+	}
+	else if(!strcmp(cmd, "load"))
+	{
+		ARGS(1);
+		pl = find_playlist(argv[1]);
+		if(pl == NULL)
+		{
+			snprintf(err, err_len, "No such playlist");
+			return ACK_NO_EXIST;
+		}
+		for(i=0;i<pl->len;i++)
+		{
+			queue_add(pl->uris[i]);
+		}
+		changed(IDLE_PLAYLIST);
+	}
+	else if(!strcmp(cmd, "rm"))
+	{
+		ARGS(1);
+		pl = find_playlist(argv[1]);
+		if(pl == NULL)
+		{
+			snprintf(err, err_len, "No such playlist");
+			return ACK_NO_EXIST;
+		}
+		for(i=0;i<pl->len;i++)
+		{
+			free(pl->uris[i]);
+		}
+		free(pl->uris);
+		free(pl->name);
+		memset(pl, 0, sizeof(Playlist));
+		changed(IDLE_STORED_PLAYLIST);
+	}
+	else if(!strcmp(cmd, "x-bench-stats"))
+	{
+		c->control = true;
+		out_printf(out, "commands: %lu\nbytes_in: %lu\nbytes_out: %lu\n",
+			stats_commands, stats_bytes_in, stats_bytes_out);
+	}
+	else
+	{
+		snprintf(err, err_len, "unknown command \"%s\"", cmd);
+		return ACK_UNKNOWN;
+	}
+
+#undef ARGS
+
+	return 0;
+}
+
+static int
+tokenize(char* line, char** argv)
+{
+	int argc = 0;
+	char* r = line;
+	char* w;
+
+	while(*r != '\0' && argc < MAX_ARGS)
+	{
+		while(*r == ' ' || *r == '\t')
+		{
+			r++;
+		}
+		if(*r == '\0')
+		{
+			break;
+		}
+		if(*r == '"')
+		{
+			argv[argc++] = w = ++r;
+			while(*r != '\0' && *r != '"')
+			{
+				if(*r == '\\' && r[1] != '\0')
+				{
+					r++;
+				}
+				*w++ = *r++;
+			}
+			if(*r == '"')
+			{
+				r++;
+			}
+			*w = '\0';
+		}
+		else
+		{
+			argv[argc++] = r;
+			while(*r != '\0' && *r != ' ' && *r != '\t')
+			{
+				r++;
+			}
+			if(*r != '\0')
+			{
+				*r++ = '\0';
+			}
+		}
+	}
+	return argc;
+}
+
+// "idle player mixer" or "idle \"player\" \"mixer\"", everything if none
+static unsigned
+idle_mask(char* args)
+{
+	char* saveptr;
+	char* name;
+	unsigned mask = 0;
+	bool any = false;
+	int i;
+
+	while((name = strtok_r(args, " \"", &saveptr)) != NULL)
+	{
+		args = NULL;
+		any = true;
+		for(i=0;i<sizeof(idle_names)/sizeof(char*);i++)
+		{
+			if(!strcmp(name, idle_names[i]))
+			{
+				mask |= 1 << i;
+			}
+		}
+	}
+	return any ? mask : IDLE_ALL;
+}
+
+static void
+answer_idle(Client* c, Out* out)
+{
+	int i;
+
+	for(i=0;i<sizeof(idle_names)/sizeof(char*);i++)
+	{
+		if(c->pending & c->idle_mask & (1 << i))
+		{
+			out_printf(out, "changed: %s\n", idle_names[i]);
+		}
+	}
+	out_printf(out, "OK\n");
+	// the other events wait for an idle that asks for them
+	c->pending &= ~c->idle_mask;
+	c->idle = false;
+}
+
+static void
+run_commands(Client* c, char** lines, size_t count, bool list_ok, Out* out)
+{
+	struct timespec delay;
+	char* argv[MAX_ARGS];
+	char err[256];
+	size_t i;
+	int argc;
+	int ret;
+
+	if(latency_ms > 0)
+	{
+		delay.tv_sec = latency_ms / 1000;
+		delay.tv_nsec = (latency_ms % 1000) * 1000000L;
+		nanosleep(&delay, NULL);
+	}
+
+	for(i=0;i<count;i++)
+	{
+		argc = tokenize(lines[i], argv);
+		if(argc == 0)
+		{
+			continue;
+		}
+		if(!c->control && strcmp(argv[0], "x-bench-stats"))
+		{
+			stats_commands++;
+		}
+		ret = execute(c, argc, argv, out, err, sizeof(err));
+		if(ret)
+		{
+			out_printf(out, "ACK [%i@%li] {%s} %s\n", ret, (long)i, argv[0], err);
+			return;
+		}
+		if(list_ok)
+		{
+			out_printf(out, "list_OK\n");
+		}
+	}
+	out_printf(out, "OK\n");
+}
+
+static void
+free_list(Client* c)
+{
+	size_t i;
+
+	for(i=0;i<c->list_len;i++)
+	{
+		free(c->list[i]);
+	}
+	free(c->list);
+	c->list = NULL;
+	c->list_len = 0;
+	c->in_list = false;
+}
+
+static void
+close_client(Client* c)
+{
+	close(c->fd);
+	free_list(c);
+	memset(c, 0, sizeof(Client));
+	c->fd = -1;
+}
+
+// returns false when the client must be closed
+static bool
+handle_line(Client* c, char* line, Out* out)
+{
+	char* one[1];
+
+	if(c->idle)
+	{
+		if(!strcmp(line, "noidle"))
+		{
+			answer_idle(c, out);
+			return true;
+		}
+		fprintf(stderr, "E: mock_mpd: '%s' while idle\n", line);
+		return false;
+	}
+
+	if(c->in_list)
+	{
+		if(!strcmp(line, "command_list_end"))
+		{
+			run_commands(c, c->list, c->list_len, c->list_ok, out);
+			free_list(c);
+		}
+		else
+		{
+			c->list = realloc(c->list, (c->list_len + 1) * sizeof(char*));
+			c->list[c->list_len++] = strdup(line);
+		}
+		return true;
+	}
+
+	if(!strcmp(line, "command_list_begin") || !strcmp(line, "command_list_ok_begin"))
+	{
+		c->in_list = true;
+		c->list_ok = !strcmp(line, "command_list_ok_begin");
+		return true;
+	}
+	if(!strncmp(line, "idle", 4) && (line[4] == '\0' || line[4] == ' '))
+	{
+		if(!c->control)
+		{
+			stats_commands++;
+		}
+		c->idle = true;
+		c->idle_mask = idle_mask(line + 4);
+		if(c->pending & c->idle_mask)
+		{
+			answer_idle(c, out);
+		}
+		return true;
+	}
+	if(!strcmp(line, "close"))
+	{
+		return false;
+	}
+
+	one[0] = line;
+	run_commands(c, one, 1, false, out);
+	return true;
+}
+
+static bool
+handle_input(Client* c, Out* out)
+{
+	ssize_t len;
+	char* start;
+	char* nl;
+
+	len = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len - 1, 0);
+	if(len <= 0)
+	{
+		return false;
+	}
+	if(!c->control)
+	{
+		stats_bytes_in += len;
+	}
+	c->in_len += len;
+	c->in[c->in_len] = '\0';
+
+	start = c->in;
+	while((nl = strchr(start, '\n')) != NULL)
+	{
+		*nl = '\0';
+		if(!handle_line(c, start, out))
+		{
+			return false;
+		}
+		send_out(c, out);
+		start = nl + 1;
+	}
+	c->in_len -= start - c->in;
+	memmove(c->in, start, c->in_len);
+
+	if(c->in_len == sizeof(c->in) - 1)
+	{
+		fprintf(stderr, "E: mock_mpd: line too long\n");
+		return false;
+	}
+	return true;
+}
+
+static int
+usage(const char* progname)
+{
+	fprintf(stderr, "usage: %s -s socket [-l latency_ms] [-n library_size]\n", progname);
+	return 1;
+}
+
+int
+main(int argc, char** argv)
+{
+	struct sockaddr_un sa = {0};
+	struct pollfd fds[MAX_CLIENTS + 1];
+	const char* path = NULL;
+	Out out = {0};
+	int listen_fd;
+	int opt;
+	int fd;
+	int i;
+
+	while((opt = getopt(argc, argv, "s:l:n:")) != -1)
+	{
+		switch(opt)
+		{
+		case 's':
+			path = optarg;
+			break;
+		case 'l':
+			latency_ms = atoi(optarg);
+			break;
+		case 'n':
+			make_library(atoi(optarg));
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+	if(path == NULL || strlen(path) >= sizeof(sa.sun_path))
+	{
+		return usage(argv[0]);
+	}
+	if(library == NULL)
+	{
+		make_library(200);
+	}
+
+	// something to resume from, paused like after a reboot
+	queue_add(library[0].uri);
+	set_sticker(library[1].uri, "played", "120");
+	set_sticker(library[1].uri, "played_at", "1");
+
+	for(i=0;i<MAX_CLIENTS;i++)
+	{
+		clients[i].fd = -1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	unlink(path);
+	if(listen_fd == -1 || bind(listen_fd, (struct sockaddr*)&sa, sizeof(sa)) == -1
+		|| listen(listen_fd, 8) == -1)
+	{
+		fprintf(stderr, "E: mock_mpd %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	while(1)
+	{
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		for(i=0;i<MAX_CLIENTS;i++)
+		{
+			fds[i + 1].fd = clients[i].fd;
+			fds[i + 1].events = POLLIN;
+		}
+
+		if(poll(fds, MAX_CLIENTS + 1, -1) == -1)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			perror("E: mock_mpd poll");
+			return 1;
+		}
+
+		if(fds[0].revents & POLLIN)
+		{
+			fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			for(i=0;fd != -1 && i<MAX_CLIENTS && clients[i].fd != -1;i++);
+			if(fd != -1 && i < MAX_CLIENTS)
+			{
+				clients[i].fd = fd;
+				out_printf(&out, "OK MPD 0.19.0\n");
+				send_out(clients + i, &out);
+			}
+			else if(fd != -1)
+			{
+				close(fd);
+			}
+		}
+
+		for(i=0;i<MAX_CLIENTS;i++)
+		{
+			if(fds[i + 1].fd != -1 && fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+			{
+				if(!handle_input(clients + i, &out))
+				{
+					close_client(clients + i);
+				}
+			}
+		}
+
+		// wake up the idle clients which have something new
+		for(i=0;i<MAX_CLIENTS;i++)
+		{
+			if(clients[i].fd != -1 && clients[i].idle && (clients[i].pending & clients[i].idle_mask))
+			{
+				answer_idle(clients + i, &out);
+				send_out(clients + i, &out);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,331 @@
+#include "pool.h"
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <mpd/client.h>
+
+/* Worker threads for the blocking jobs of the event loop: mpd listings,
+   sticker writes, http. Jobs wait in a FIFO under a mutex, the threads
+   push what they finished on a lock-free stack and wake the loop
+   through an eventfd; la_pool_handle() then calls the PoolDone
+   callbacks, in the order the jobs finished. */
+
+// one thread per core, at least two so that a long probe doesn't hold
+// listings back on a single core Pi
+#define POOL_MIN_THREADS 2
+#define POOL_MAX_THREADS 4
+#define POOL_MPD_TIMEOUT_MS 30000
+// mpd drops idle clients after a minute by default
+#define POOL_MPD_REUSE_SECS 30
+// finished jobs kept for the next submits, by the event loop only
+#define POOL_SPARE_JOBS 8
+
+struct PoolJob {
+	PoolWork work;
+	PoolDone done;
+	void* arg;
+	int ret;
+	atomic_bool cancelled;
+	struct PoolJob* next;
+};
+
+static pthread_t threads[POOL_MAX_THREADS];
+static int threads_count = 0;
+static int pool_fd = -1;
+
+// submitted jobs, in order
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static PoolJob* queue_head = NULL;
+static PoolJob* queue_tail = NULL;
+static bool stopping = false;
+
+// finished jobs, the last one first
+static _Atomic(PoolJob*) completed = NULL;
+// a sticker sync starts at every saved position: no allocation for it
+static PoolJob* spare = NULL;
+static int spare_count = 0;
+
+static __thread struct mpd_connection* thread_mpd = NULL;
+static __thread time_t thread_mpd_used = 0;
+
+static void
+complete(PoolJob* job)
+{
+	PoolJob* head;
+	uint64_t one = 1;
+
+	head = atomic_load(&completed);
+	do
+	{
+		job->next = head;
+	}
+	while(!atomic_compare_exchange_weak(&completed, &head, job));
+
+	if(write(pool_fd, &one, sizeof(one)) != sizeof(one))
+	{
+		perror("E: pool notify");
+	}
+}
+
+static void*
+pool_thread(void* arg)
+{
+	PoolJob* job;
+
+	while(true)
+	{
+		pthread_mutex_lock(&queue_lock);
+		while(queue_head == NULL && !stopping)
+		{
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		}
+		if(stopping)
+		{
+			pthread_mutex_unlock(&queue_lock);
+			break;
+		}
+		job = queue_head;
+		queue_head = job->next;
+		if(queue_head == NULL)
+		{
+			queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&queue_lock);
+
+		// cancelled while waiting: the result isn't wanted anymore
+		if(!atomic_load(&job->cancelled))
+		{
+			job->ret = job->work(job->arg);
+		}
+		complete(job);
+	}
+
+	if(thread_mpd != NULL)
+	{
+		mpd_connection_free(thread_mpd);
+		thread_mpd = NULL;
+	}
+	return NULL;
+}
+
+int
+la_pool_init()
+{
+	long cores;
+	int count;
+
+	pool_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(pool_fd == -1)
+	{
+		perror("E: pool eventfd");
+		return -1;
+	}
+
+	cores = sysconf(_SC_NPROCESSORS_ONLN);
+	count = cores < POOL_MIN_THREADS ? POOL_MIN_THREADS : cores > POOL_MAX_THREADS ? POOL_MAX_THREADS : cores;
+	for(threads_count=0;threads_count<count;threads_count++)
+	{
+		if(pthread_create(threads + threads_count, NULL, pool_thread, NULL))
+		{
+			fprintf(stderr, "E: unable to start pool thread\n");
+			break;
+		}
+	}
+	if(threads_count == 0)
+	{
+		close(pool_fd);
+		pool_fd = -1;
+		return -1;
+	}
+	LOG_D("pool of %i threads", threads_count);
+	return pool_fd;
+}
+
+// NULL if the pool isn't running: done is called at once, as cancelled
+PoolJob*
+la_pool_submit(PoolWork work, PoolDone done, void* arg)
+{
+	PoolJob* job;
+
+	job = NULL;
+	if(threads_count != 0 && spare != NULL)
+	{
+		job = spare;
+		spare = job->next;
+		spare_count--;
+		job->next = NULL;
+	}
+	else if(threads_count != 0)
+	{
+		job = calloc(1, sizeof(PoolJob));
+	}
+	if(job == NULL)
+	{
+		fprintf(stderr, "E: unable to submit job\n");
+		done(arg, -1, true);
+		return NULL;
+	}
+	job->work = work;
+	job->done = done;
+	job->arg = arg;
+	job->ret = -1;
+	atomic_init(&job->cancelled, false);
+
+	pthread_mutex_lock(&queue_lock);
+	if(queue_tail == NULL)
+	{
+		queue_head = job;
+	}
+	else
+	{
+		queue_tail->next = job;
+	}
+	queue_tail = job;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	return job;
+}
+
+// until its PoolDone has run: a running job finishes, but is reported
+// as cancelled
+void
+la_pool_cancel(PoolJob* job)
+{
+	if(job != NULL)
+	{
+		atomic_store(&job->cancelled, true);
+	}
+}
+
+static void
+run_completed(bool cancel)
+{
+	PoolJob* job;
+	PoolJob* next;
+	PoolJob* ordered;
+
+	job = atomic_exchange(&completed, NULL);
+	ordered = NULL;
+	while(job != NULL)
+	{
+		next = job->next;
+		job->next = ordered;
+		ordered = job;
+		job = next;
+	}
+
+	for(job=ordered;job!=NULL;job=next)
+	{
+		next = job->next;
+		job->done(job->arg, job->ret, cancel || atomic_load(&job->cancelled));
+		if(!cancel && spare_count < POOL_SPARE_JOBS)
+		{
+			job->next = spare;
+			spare = job;
+			spare_count++;
+		}
+		else
+		{
+			free(job);
+		}
+	}
+}
+
+void
+la_pool_handle()
+{
+	uint64_t count;
+
+	if(read(pool_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+	{
+		perror("E: pool eventfd");
+	}
+	run_completed(false);
+}
+
+void
+la_pool_exit()
+{
+	PoolJob* job;
+	int i;
+
+	if(pool_fd == -1)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&queue_lock);
+	stopping = true;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	for(i=0;i<threads_count;i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	threads_count = 0;
+
+	// the arguments of what never ran are freed too
+	while((job = queue_head) != NULL)
+	{
+		queue_head = job->next;
+		job->done(job->arg, -1, true);
+		free(job);
+	}
+	queue_tail = NULL;
+	run_completed(true);
+	while((job = spare) != NULL)
+	{
+		spare = job->next;
+		free(job);
+	}
+	spare_count = 0;
+
+	close(pool_fd);
+	pool_fd = -1;
+}
+
+// the calling worker's own connection, NULL if mpd can't be reached
+struct mpd_connection*
+la_pool_mpd()
+{
+	time_t now;
+
+	now = time(NULL);
+	if(thread_mpd != NULL && (now - thread_mpd_used > POOL_MPD_REUSE_SECS
+		|| (mpd_connection_get_error(thread_mpd) != MPD_ERROR_SUCCESS
+			&& !mpd_connection_clear_error(thread_mpd))))
+	{
+		mpd_connection_free(thread_mpd);
+		thread_mpd = NULL;
+	}
+
+	if(thread_mpd == NULL)
+	{
+		thread_mpd = mpd_connection_new(NULL, 0, POOL_MPD_TIMEOUT_MS);
+		if(thread_mpd == NULL)
+		{
+			fprintf(stderr, "E: pool mpd: Out of memory\n");
+			return NULL;
+		}
+		if(mpd_connection_get_error(thread_mpd) != MPD_ERROR_SUCCESS)
+		{
+			fprintf(stderr, "E: pool mpd: %s\n", mpd_connection_get_error_message(thread_mpd));
+			mpd_connection_free(thread_mpd);
+			thread_mpd = NULL;
+			return NULL;
+		}
+	}
+	thread_mpd_used = now;
+	return thread_mpd;
+}
@@ -0,0 +1,24 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+
+#include <mpd/client.h>
+
+// runs in a worker thread, the result goes to PoolDone
+typedef int (*PoolWork)(void* arg);
+// runs in the event loop, also for cancelled jobs so that arg is freed
+typedef void (*PoolDone)(void* arg, int ret, bool cancelled);
+
+typedef struct PoolJob PoolJob;
+
+int la_pool_init();
+void la_pool_handle();
+void la_pool_exit();
+
+PoolJob* la_pool_submit(PoolWork work, PoolDone done, void* arg);
+void la_pool_cancel(PoolJob* job);
+
+struct mpd_connection* la_pool_mpd();
+
+#endif        //  #ifndef POOL_H
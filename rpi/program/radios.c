@@ -0,0 +1,618 @@
+#define _GNU_SOURCE
+#include "radios.h"
+#include "log.h"
+#include "stats.h"
+#include "pool.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <curl/curl.h>
+
+// don't probe again for 30 minutes unless asked to
+#define PROBE_INTERVAL 1800
+#define PROBE_CONNECT_TIMEOUT 3L
+#define PROBE_TIMEOUT 8L
+#define PROBE_BODY_SIZE 4096
+#define MAX_REDIRS 5L
+// playlists followed from a station before giving up on it
+#define MAX_PLAYLIST_DEPTH 3
+
+typedef struct {
+	const char* uri;
+	const char* name;
+} DefaultRadio;
+
+static const DefaultRadio default_radios[] = {
+	{ "http://direct.franceinter.fr/live/franceinter-midfi.mp3", "France Inter" },
+	{ "http://sv2.vestaradio.com:5750/;stream.mp3", "Radio Rennes" },
+	{ "http://stream.levillage.org/canalb?1362308951917.mp3", "Canal B" }
+};
+
+typedef struct {
+	char* resolved_uri;
+	bool available;
+	long connect_ms;
+} ProbeResult;
+
+typedef struct {
+	CURL* curl;
+	size_t station;
+	bool playlist;
+	// playlists already followed to get here
+	int depth;
+	char body[PROBE_BODY_SIZE];
+	size_t body_len;
+} Probe;
+
+static Radio* radios = NULL;
+static size_t radios_count = 0;
+static char* radios_cache_path = NULL;
+static unsigned generation = 0;
+
+static PoolJob* job = NULL;
+static void (*on_probed)() = NULL;
+static time_t last_probe = 0;
+
+static int stats_probe = -1;
+static int stats_probe_ko = -1;
+
+static void
+add_radio(const char* uri, const char* name)
+{
+	Radio* tmp;
+
+	tmp = realloc(radios, (radios_count + 1) * sizeof(Radio));
+	if(tmp == NULL)
+	{
+		perror("E: add_radio");
+		return;
+	}
+	radios = tmp;
+
+	memset(radios + radios_count, 0, sizeof(Radio));
+	radios[radios_count].uri = strdup(uri);
+	radios[radios_count].name = strdup(name);
+	radios[radios_count].connect_ms = -1;
+	radios_count++;
+}
+
+static char*
+trim(char* line)
+{
+	char* end;
+
+	while(isspace(*line))
+	{
+		line++;
+	}
+	end = line + strlen(line);
+	while(end > line && isspace(end[-1]))
+	{
+		end--;
+	}
+	*end = '\0';
+	return line;
+}
+
+static void
+load_cache(const char* path)
+{
+	FILE* f;
+	char* line = NULL;
+	size_t line_len = 0;
+	char uri[1024];
+	char resolved[1024];
+	int available;
+	long connect_ms;
+	int i;
+
+	f = fopen(path, "r");
+	if(f == NULL)
+	{
+		return;
+	}
+
+	// <uri> <resolved uri> <available> <connect ms>
+	while(getline(&line, &line_len, f) > 0)
+	{
+		if(sscanf(line, "%1023s %1023s %i %li", uri, resolved, &available, &connect_ms) != 4)
+		{
+			continue;
+		}
+		for(i=0;i<radios_count;i++)
+		{
+			if(!strcmp(radios[i].uri, uri))
+			{
+				radios[i].resolved_uri = strdup(resolved);
+				radios[i].available = available;
+				radios[i].connect_ms = connect_ms;
+			}
+		}
+	}
+
+	free(line);
+	fclose(f);
+}
+
+static void
+save_cache()
+{
+	FILE* f;
+	int i;
+
+	if(radios_cache_path == NULL)
+	{
+		return;
+	}
+
+	f = fopen(radios_cache_path, "w");
+	if(f == NULL)
+	{
+		fprintf(stderr, "E: unable to save %s: %s\n", radios_cache_path, strerror(errno));
+		return;
+	}
+	for(i=0;i<radios_count;i++)
+	{
+		if(radios[i].resolved_uri != NULL)
+		{
+			fprintf(f, "%s %s %i %li\n", radios[i].uri, radios[i].resolved_uri,
+				radios[i].available, radios[i].connect_ms);
+		}
+	}
+	fclose(f);
+}
+
+int
+la_radios_load(const char* path, const char* cache_path)
+{
+	FILE* f;
+	char* line = NULL;
+	size_t line_len = 0;
+	char* uri;
+	char* name;
+	int i;
+
+	f = fopen(path, "r");
+	if(f == NULL)
+	{
+		LOG_I("no %s, using the default radios", path);
+		for(i=0;i<sizeof(default_radios)/sizeof(DefaultRadio);i++)
+		{
+			add_radio(default_radios[i].uri, default_radios[i].name);
+		}
+	}
+	else
+	{
+		// <uri> <name>, the first ones are the presets of the remote
+		while(getline(&line, &line_len, f) > 0)
+		{
+			uri = trim(line);
+			if(*uri == '\0' || *uri == '#')
+			{
+				continue;
+			}
+			name = uri + strcspn(uri, " \t");
+			if(*name != '\0')
+			{
+				*name = '\0';
+				name = trim(name + 1);
+			}
+			add_radio(uri, *name != '\0' ? name : uri);
+		}
+		free(line);
+		fclose(f);
+	}
+
+	if(cache_path != NULL)
+	{
+		radios_cache_path = strdup(cache_path);
+		load_cache(cache_path);
+	}
+
+	LOG_I("%li radios", radios_count);
+	return radios_count > 0 ? 0 : -1;
+}
+
+size_t
+la_radios_count()
+{
+	return radios_count;
+}
+
+Radio*
+la_radios_get(size_t i)
+{
+	return i < radios_count ? radios + i : NULL;
+}
+
+const char*
+la_radios_uri(size_t i)
+{
+	if(i >= radios_count)
+	{
+		return NULL;
+	}
+	return radios[i].resolved_uri != NULL ? radios[i].resolved_uri : radios[i].uri;
+}
+
+int
+la_radios_find(const char* uri)
+{
+	int i;
+
+	for(i=0;i<radios_count;i++)
+	{
+		if(!strcmp(radios[i].uri, uri)
+			|| (radios[i].resolved_uri != NULL && !strcmp(radios[i].resolved_uri, uri)))
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int
+rank(const Radio* r)
+{
+	if(!r->probed && r->resolved_uri == NULL) return 1;
+	return r->available ? 0 : 2;
+}
+
+static int
+compare_availability(const void* a, const void* b)
+{
+	const Radio* ra = radios + *(const size_t*)a;
+	const Radio* rb = radios + *(const size_t*)b;
+
+	if(rank(ra) != rank(rb))
+	{
+		return rank(ra) - rank(rb);
+	}
+	if(rank(ra) == 0 && ra->connect_ms != rb->connect_ms)
+	{
+		return ra->connect_ms < rb->connect_ms ? -1 : 1;
+	}
+	return *(const size_t*)a < *(const size_t*)b ? -1 : 1;
+}
+
+size_t
+la_radios_sorted(size_t* order)
+{
+	size_t i;
+
+	for(i=0;i<radios_count;i++)
+	{
+		order[i] = i;
+	}
+	qsort(order, radios_count, sizeof(size_t), compare_availability);
+	return radios_count;
+}
+
+unsigned
+la_radios_generation()
+{
+	return generation;
+}
+
+static bool
+is_playlist_type(const char* value)
+{
+	size_t len;
+
+	if(value == NULL)
+	{
+		return false;
+	}
+	if(strcasestr(value, "scpls") != NULL || strcasestr(value, "mpegurl") != NULL)
+	{
+		return true;
+	}
+	// file extension, ignoring the query string
+	len = strcspn(value, "?#");
+	return (len > 4 && !strncasecmp(value + len - 4, ".pls", 4))
+		|| (len > 4 && !strncasecmp(value + len - 4, ".m3u", 4))
+		|| (len > 5 && !strncasecmp(value + len - 5, ".m3u8", 5));
+}
+
+static size_t
+probe_write(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+	Probe* probe = userdata;
+	char* content_type = NULL;
+	size_t len = size * nmemb;
+
+	curl_easy_getinfo(probe->curl, CURLINFO_CONTENT_TYPE, &content_type);
+	probe->playlist = probe->playlist || is_playlist_type(content_type);
+
+	if(!probe->playlist)
+	{
+		// audio is flowing: that's all we wanted to know
+		return 0;
+	}
+
+	if(len > PROBE_BODY_SIZE - 1 - probe->body_len)
+	{
+		len = PROBE_BODY_SIZE - 1 - probe->body_len;
+	}
+	memcpy(probe->body + probe->body_len, ptr, len);
+	probe->body_len += len;
+	probe->body[probe->body_len] = '\0';
+
+	return len == size * nmemb ? len : 0;
+}
+
+static char*
+parse_playlist(char* body)
+{
+	char* line;
+	char* saveptr;
+	char* value;
+
+	for(line = strtok_r(body, "\r\n", &saveptr); line != NULL; line = strtok_r(NULL, "\r\n", &saveptr))
+	{
+		line = trim(line);
+		// .pls: File1=http://...
+		if(!strncasecmp(line, "File", 4) && (value = strchr(line, '=')) != NULL)
+		{
+			return strdup(trim(value + 1));
+		}
+		// .m3u: first line which is not a comment
+		if(strstr(line, "://") != NULL && *line != '#' && strchr(line, '=') == NULL)
+		{
+			return strdup(line);
+		}
+	}
+	return NULL;
+}
+
+static Probe*
+start_probe(CURLM* multi, size_t station, const char* uri, int depth)
+{
+	Probe* probe;
+
+	probe = calloc(1, sizeof(Probe));
+	if(probe == NULL)
+	{
+		return NULL;
+	}
+
+	probe->station = station;
+	probe->depth = depth;
+	probe->playlist = is_playlist_type(uri);
+	probe->curl = curl_easy_init();
+	if(probe->curl == NULL)
+	{
+		free(probe);
+		return NULL;
+	}
+
+	curl_easy_setopt(probe->curl, CURLOPT_URL, uri);
+	curl_easy_setopt(probe->curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(probe->curl, CURLOPT_MAXREDIRS, MAX_REDIRS);
+	curl_easy_setopt(probe->curl, CURLOPT_CONNECTTIMEOUT, PROBE_CONNECT_TIMEOUT);
+	curl_easy_setopt(probe->curl, CURLOPT_TIMEOUT, PROBE_TIMEOUT);
+	curl_easy_setopt(probe->curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(probe->curl, CURLOPT_WRITEFUNCTION, probe_write);
+	curl_easy_setopt(probe->curl, CURLOPT_WRITEDATA, probe);
+	curl_easy_setopt(probe->curl, CURLOPT_PRIVATE, probe);
+
+	curl_multi_add_handle(multi, probe->curl);
+	return probe;
+}
+
+static void
+finish_probe(CURLM* multi, Probe* probe, CURLcode res, ProbeResult* results)
+{
+	ProbeResult* result = results + probe->station;
+	char* effective_uri = NULL;
+	char* stream_uri;
+	double connect_time = 0;
+	long code = 0;
+
+	curl_easy_getinfo(probe->curl, CURLINFO_RESPONSE_CODE, &code);
+	curl_easy_getinfo(probe->curl, CURLINFO_EFFECTIVE_URL, &effective_uri);
+	curl_easy_getinfo(probe->curl, CURLINFO_CONNECT_TIME, &connect_time);
+
+	// CURLE_WRITE_ERROR: we stopped reading the stream ourselves
+	if((res == CURLE_OK || res == CURLE_WRITE_ERROR) && code >= 200 && code < 300)
+	{
+		free(result->resolved_uri);
+		result->resolved_uri = strdup(effective_uri);
+		result->connect_ms = (long)(connect_time * 1000);
+		result->available = true;
+
+		if(probe->playlist)
+		{
+			result->available = false;
+			stream_uri = parse_playlist(probe->body);
+			if(stream_uri == NULL)
+			{
+				fprintf(stderr, "E: radio %s: empty playlist\n", radios[probe->station].name);
+			}
+			else if(probe->depth >= MAX_PLAYLIST_DEPTH)
+			{
+				// most likely playlists pointing to each other
+				fprintf(stderr, "E: radio %s: playlists nested too deep at %s\n", radios[probe->station].name, stream_uri);
+				result->connect_ms = -1;
+				free(stream_uri);
+			}
+			else
+			{
+				LOG_D("radio %s: playlist => %s", radios[probe->station].name, stream_uri);
+				start_probe(multi, probe->station, stream_uri, probe->depth + 1);
+				free(stream_uri);
+			}
+		}
+	}
+	else
+	{
+		fprintf(stderr, "E: radio %s: (%d) %s, HTTP %li\n", radios[probe->station].name,
+			res, curl_easy_strerror(res), code);
+		result->available = false;
+		result->connect_ms = -1;
+	}
+
+	curl_multi_remove_handle(multi, probe->curl);
+	curl_easy_cleanup(probe->curl);
+	free(probe);
+}
+
+static int
+radios_work(void* arg)
+{
+	ProbeResult* results = arg;
+	CURLM* multi;
+	CURLMsg* msg;
+	Probe* probe;
+	int running;
+	int pending;
+	size_t i;
+
+	multi = curl_multi_init();
+	if(multi == NULL)
+	{
+		fprintf(stderr, "E: radios job: curl_multi_init\n");
+		return -1;
+	}
+	else
+	{
+		// every station at once: the slowest one bounds the whole probe
+		for(i=0;i<radios_count;i++)
+		{
+			start_probe(multi, i, radios[i].uri, 0);
+		}
+
+		do
+		{
+			curl_multi_perform(multi, &running);
+			while((msg = curl_multi_info_read(multi, &pending)) != NULL)
+			{
+				if(msg->msg == CURLMSG_DONE)
+				{
+					curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&probe);
+					finish_probe(multi, probe, msg->data.result, results);
+					// a playlist may have started a new probe
+					running = 1;
+				}
+			}
+			if(running)
+			{
+				curl_multi_wait(multi, NULL, 0, 1000, NULL);
+			}
+		} while(running);
+
+		curl_multi_cleanup(multi);
+	}
+
+	return 0;
+}
+
+static void
+free_results(ProbeResult* results)
+{
+	size_t i;
+
+	for(i=0;i<radios_count;i++)
+	{
+		free(results[i].resolved_uri);
+	}
+	free(results);
+}
+
+// probed is called from the event loop once the stations were probed
+int
+la_radios_init(void (*probed)())
+{
+	stats_probe = la_stats_histogram("probe radio connect");
+	stats_probe_ko = la_stats_counter("probe radio KO");
+	on_probed = probed;
+	return 0;
+}
+
+static void
+radios_done(void* arg, int ret, bool cancelled)
+{
+	ProbeResult* results = arg;
+	bool changed;
+	size_t i;
+
+	job = NULL;
+	if(cancelled || ret)
+	{
+		free_results(results);
+		return;
+	}
+
+	changed = false;
+	for(i=0;i<radios_count;i++)
+	{
+		radios[i].probed = true;
+		radios[i].available = results[i].available;
+		radios[i].connect_ms = results[i].connect_ms;
+		if(results[i].resolved_uri != NULL)
+		{
+			if(radios[i].resolved_uri == NULL || strcmp(radios[i].resolved_uri, results[i].resolved_uri))
+			{
+				changed = true;
+			}
+			free(radios[i].resolved_uri);
+			radios[i].resolved_uri = results[i].resolved_uri;
+		}
+		LOG_I("radio %s %s %lims %s", radios[i].name,
+			radios[i].available ? "OK" : "KO", radios[i].connect_ms, la_radios_uri(i));
+		if(radios[i].available)
+		{
+			la_stats_record_us(stats_probe, radios[i].connect_ms * 1000);
+		}
+		else
+		{
+			la_stats_add(stats_probe_ko, 1);
+		}
+	}
+	free(results);
+
+	if(changed)
+	{
+		generation++;
+	}
+	save_cache();
+	if(on_probed != NULL)
+	{
+		on_probed();
+	}
+}
+
+int
+la_radios_probe(bool force)
+{
+	ProbeResult* results;
+
+	if(job != NULL || radios_count == 0)
+	{
+		return 0;
+	}
+	if(!force && last_probe != 0 && time(NULL) - last_probe < PROBE_INTERVAL)
+	{
+		return 0;
+	}
+
+	results = calloc(radios_count, sizeof(ProbeResult));
+	if(results == NULL)
+	{
+		perror("E: radios probe");
+		return -1;
+	}
+
+	last_probe = time(NULL);
+	job = la_pool_submit(radios_work, radios_done, results);
+	if(job == NULL)
+	{
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef RADIOS_H
+#define RADIOS_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct {
+	char* name;
+	char* uri;
+	// final stream URL, once playlists and redirects are followed
+	char* resolved_uri;
+	bool probed;
+	bool available;
+	long connect_ms;
+} Radio;
+
+int la_radios_load(const char* path, const char* cache_path);
+size_t la_radios_count();
+Radio* la_radios_get(size_t i);
+const char* la_radios_uri(size_t i);
+int la_radios_find(const char* uri);
+size_t la_radios_sorted(size_t* order);
+unsigned la_radios_generation();
+
+int la_radios_init(void (*probed)());
+int la_radios_probe(bool force);
+
+#endif        //  #ifndef RADIOS_H
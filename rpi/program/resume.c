@@ -0,0 +1,666 @@
+#include "resume.h"
+#include "resume_index.h"
+#include "pool.h"
+#include "gpodder.h"
+#include "log.h"
+#include "fmt.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpd/client.h>
+
+// don't ask gpodder.net more than once every 15 minutes
+#define GPODDER_SYNC_INTERVAL 900
+// entries of the Resume list
+#define RESUME_LIST_LENGTH 50
+// positions written to the stickers per command list
+#define STICKER_SYNC_BATCH 32
+
+static ResumeList* cached = NULL;
+
+typedef struct {
+	bool with_gpodder;
+	bool scan;
+	ResumeList* result;
+} ResumeJob;
+
+// one job at a time, saved positions start one every time: not on the heap
+static ResumeJob resume_job;
+static PoolJob* job = NULL;
+static void (*on_refreshed)() = NULL;
+// asked for while the job was running
+static bool refresh_pending = false;
+static bool refresh_pending_scan = false;
+static time_t last_gpodder_sync = 0;
+
+static const char*
+get_basename(const char* uri)
+{
+	const char* value;
+
+	value = strrchr(uri, '/');
+	if(value == NULL)
+	{
+		return uri;
+	}
+	return value + 1;
+}
+
+// in place: it runs for every position saved
+static void
+entry_relabel(ResumeEntry* entry)
+{
+	const char* name;
+	char* label;
+	size_t size;
+	size_t len;
+
+	name = entry->title != NULL ? entry->title : get_basename(entry->uri);
+	size = strlen(name)+1+3*(2+1)+1;
+	if(size > entry->label_size)
+	{
+		label = realloc(entry->label, size);
+		if(label == NULL)
+		{
+			perror("entry_relabel allocate label");
+			return;
+		}
+		entry->label = label;
+		entry->label_size = size;
+	}
+
+	len = la_fmt_str(entry->label, size, 0, name);
+	len = la_fmt_str(entry->label, size, len, " ");
+	la_fmt_time(entry->label, size, len, entry->played, 2);
+}
+
+static ResumeEntry*
+list_find(ResumeList* list, const char* uri)
+{
+	size_t i;
+
+	for(i=0;i<list->length;i++)
+	{
+		if(!strcmp(list->entries[i].uri, uri))
+		{
+			return list->entries + i;
+		}
+	}
+	return NULL;
+}
+
+static ResumeEntry*
+list_add(ResumeList* list, const char* uri, int played)
+{
+	ResumeEntry* entries;
+	ResumeEntry* entry;
+
+	entries = realloc(list->entries, (list->length + 1) * sizeof(ResumeEntry));
+	if(entries == NULL)
+	{
+		perror("list_add allocate entry");
+		return NULL;
+	}
+	list->entries = entries;
+
+	entry = list->entries + list->length;
+	list->length++;
+
+	entry->uri = strdup(uri);
+	entry->title = NULL;
+	entry->label = NULL;
+	entry->label_size = 0;
+	entry->played = played;
+	entry->duration = 0;
+	entry->played_at = 0;
+	return entry;
+}
+
+static void
+entry_free(ResumeEntry* entry)
+{
+	free(entry->uri);
+	free(entry->title);
+	free(entry->label);
+}
+
+static int
+compare_played_at(const void* a, const void* b)
+{
+	const ResumeEntry* ea = a;
+	const ResumeEntry* eb = b;
+
+	if(ea->played_at > eb->played_at) return -1;
+	if(ea->played_at < eb->played_at) return 1;
+	return 0;
+}
+
+void
+la_resume_list_free(ResumeList* list)
+{
+	size_t i;
+
+	if(list == NULL)
+	{
+		return;
+	}
+
+	for(i=0;i<list->length;i++)
+	{
+		entry_free(list->entries + i);
+	}
+	free(list->entries);
+	free(list);
+}
+
+static int
+fetch_stickers(struct mpd_connection* conn, const char* name, ResumeList* list, bool create)
+{
+	struct mpd_pair* pair;
+	const char* value;
+	size_t name_len;
+	char* uri;
+	ResumeEntry* entry;
+
+	uri = NULL;
+
+	if(!mpd_send_sticker_find(conn, "song", "", name))
+	{
+		return -1;
+	}
+
+	while((pair = mpd_recv_pair(conn)) != NULL)
+	{
+		if(!strcmp(pair->name, "file"))
+		{
+			free(uri);
+			uri = strdup(pair->value);
+		}
+		else if(uri != NULL)
+		{
+			value = mpd_parse_sticker(pair->value, &name_len);
+			if(value == NULL)
+			{
+				fprintf(stderr, "E: parsing sticker %s\n", pair->value);
+			}
+			else if(create)
+			{
+				list_add(list, uri, atoi(value));
+			}
+			else if((entry = list_find(list, uri)) != NULL)
+			{
+				entry->played_at = atol(value);
+			}
+		}
+		mpd_return_pair(conn, pair);
+	}
+	free(uri);
+
+	mpd_response_finish(conn);
+	return mpd_connection_get_error(conn) == MPD_ERROR_SUCCESS ? 0 : -1;
+}
+
+static int
+fetch_titles(struct mpd_connection* conn, ResumeList* list)
+{
+	struct mpd_entity* entity;
+	const struct mpd_song* song;
+	const char* value;
+	size_t i;
+
+	for(i=0;i<list->length;i++)
+	{
+		mpd_send_list_meta(conn, list->entries[i].uri);
+
+		while((entity = mpd_recv_entity(conn)) != NULL)
+		{
+			if(mpd_entity_get_type(entity) == MPD_ENTITY_TYPE_SONG)
+			{
+				song = mpd_entity_get_song(entity);
+				value = mpd_song_get_tag(song, MPD_TAG_TITLE, 0);
+				if(value != NULL && list->entries[i].title == NULL)
+				{
+					list->entries[i].title = strdup(value);
+				}
+				list->entries[i].duration = mpd_song_get_duration(song);
+			}
+			mpd_entity_free(entity);
+		}
+
+		mpd_response_finish(conn);
+		if(mpd_connection_get_error(conn) == MPD_ERROR_SERVER)
+		{
+			// the file is gone from the library: keep its file name
+			LOG_D("resume no song %s", list->entries[i].uri);
+			mpd_connection_clear_error(conn);
+		}
+		else if(mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS)
+		{
+			return -1;
+		}
+
+		entry_relabel(list->entries + i);
+	}
+	return 0;
+}
+
+static char*
+find_local_uri(struct mpd_connection* conn, ResumeList* list, const char* filename)
+{
+	struct mpd_song* song;
+	const char* value;
+	char* uri;
+	size_t i;
+
+	for(i=0;i<list->length;i++)
+	{
+		if(!strcmp(get_basename(list->entries[i].uri), filename))
+		{
+			return strdup(list->entries[i].uri);
+		}
+	}
+
+	uri = NULL;
+
+	mpd_search_db_songs(conn, false);
+	mpd_search_add_uri_constraint(conn, MPD_OPERATOR_DEFAULT, filename);
+	mpd_search_commit(conn);
+
+	while((song = mpd_recv_song(conn)) != NULL)
+	{
+		value = mpd_song_get_uri(song);
+		if(uri == NULL && value != NULL && !strcmp(get_basename(value), filename))
+		{
+			uri = strdup(value);
+		}
+		mpd_song_free(song);
+	}
+
+	mpd_response_finish(conn);
+	if(mpd_connection_get_error(conn) == MPD_ERROR_SERVER)
+	{
+		mpd_connection_clear_error(conn);
+	}
+	return uri;
+}
+
+static void
+merge_gpodder(struct mpd_connection* conn, ResumeList* list)
+{
+	EnCours* encours;
+	size_t encours_length;
+	ResumeEntry* entry;
+	char* uri;
+	size_t i;
+
+	if(get_en_cours(&encours, &encours_length))
+	{
+		fprintf(stderr, "E: gpodder sync failed\n");
+		return;
+	}
+
+	for(i=0;i<encours_length;i++)
+	{
+		uri = find_local_uri(conn, list, encours[i].filename);
+		if(uri == NULL)
+		{
+			LOG_D("gpodder %s not in library", encours[i].filename);
+			continue;
+		}
+
+		entry = list_find(list, uri);
+		if(entry == NULL)
+		{
+			entry = list_add(list, uri, encours[i].position);
+			if(entry != NULL)
+			{
+				entry->played_at = encours[i].timestamp;
+			}
+		}
+		else if(encours[i].timestamp > entry->played_at)
+		{
+			LOG_D("gpodder %s %i => %i", uri, entry->played, encours[i].position);
+			entry->played = encours[i].position;
+			entry->played_at = encours[i].timestamp;
+		}
+		free(uri);
+	}
+
+	free_en_cours(encours, encours_length);
+}
+
+int
+la_resume_build(struct mpd_connection* conn, bool with_gpodder, ResumeList** res)
+{
+	ResumeList* list;
+
+	list = calloc(1, sizeof(ResumeList));
+	if(list == NULL)
+	{
+		perror("la_resume_build allocate list");
+		return -1;
+	}
+
+	if(fetch_stickers(conn, "played", list, true)
+		|| fetch_stickers(conn, "played_at", list, false))
+	{
+		la_resume_list_free(list);
+		return -1;
+	}
+
+	if(with_gpodder)
+	{
+		merge_gpodder(conn, list);
+	}
+
+	if(fetch_titles(conn, list))
+	{
+		la_resume_list_free(list);
+		return -1;
+	}
+
+	qsort(list->entries, list->length, sizeof(ResumeEntry), compare_played_at);
+
+	LOG_D("resume length %li", list->length);
+	*res = list;
+	return 0;
+}
+
+// positions saved by la go to the stickers, for the other mpd clients
+static int
+sync_stickers(struct mpd_connection* conn)
+{
+	ResumeRecord* records;
+	char played[12];
+	char played_at[21];
+	size_t n;
+	size_t i;
+
+	records = malloc(STICKER_SYNC_BATCH * sizeof(ResumeRecord));
+	if(records == NULL)
+	{
+		perror("E: sync_stickers");
+		return -1;
+	}
+
+	do
+	{
+		n = la_resume_index_dirty(records, STICKER_SYNC_BATCH);
+		if(n == 0)
+		{
+			break;
+		}
+
+		mpd_command_list_begin(conn, false);
+		for(i=0;i<n;i++)
+		{
+			la_fmt_uint(played, sizeof(played), 0, records[i].played, 0, '0');
+			la_fmt_uint(played_at, sizeof(played_at), 0, records[i].played_at, 0, '0');
+			mpd_send_sticker_set(conn, "song", records[i].uri, "played", played);
+			mpd_send_sticker_set(conn, "song", records[i].uri, "played_at", played_at);
+		}
+		mpd_command_list_end(conn);
+		if(!mpd_response_finish(conn))
+		{
+			// no sticker database: the positions stay in the index
+			fprintf(stderr, "E: resume worker: %s\n", mpd_connection_get_error_message(conn));
+			free(records);
+			return mpd_connection_clear_error(conn) ? 0 : -1;
+		}
+		LOG_D("resume %zu positions written to the stickers", n);
+
+		for(i=0;i<n;i++)
+		{
+			la_resume_index_clean(records + i);
+		}
+	}
+	while(n == STICKER_SYNC_BATCH);
+
+	free(records);
+	return 0;
+}
+
+static int
+resume_work(void* arg)
+{
+	ResumeJob* j = arg;
+	struct mpd_connection* conn;
+
+	conn = la_pool_mpd();
+	if(conn == NULL)
+	{
+		return -1;
+	}
+	if(sync_stickers(conn)
+		|| (j->scan && la_resume_build(conn, j->with_gpodder, &j->result)))
+	{
+		fprintf(stderr, "E: resume job: %s\n", mpd_connection_get_error_message(conn));
+		return -1;
+	}
+	return 0;
+}
+
+static void
+resume_done(void* arg, int ret, bool cancelled)
+{
+	ResumeJob* j = arg;
+	ResumeList* list;
+
+	job = NULL;
+	list = j->result;
+	j->result = NULL;
+	if(cancelled)
+	{
+		la_resume_list_free(list);
+		return;
+	}
+
+	if(refresh_pending)
+	{
+		refresh_pending = false;
+		la_resume_refresh(refresh_pending_scan);
+		refresh_pending_scan = false;
+	}
+	// NULL when only synced, or failed: nothing new to show
+	if(list != NULL)
+	{
+		la_resume_import(list);
+		if(on_refreshed != NULL)
+		{
+			on_refreshed();
+		}
+	}
+}
+
+// refreshed is called from the event loop when the Resume list changed
+int
+la_resume_init(const char* index_path, void (*refreshed)())
+{
+	on_refreshed = refreshed;
+	return la_resume_index_open(index_path);
+}
+
+// after la_pool_exit(): no job uses the index anymore
+void
+la_resume_exit()
+{
+	la_resume_index_close();
+}
+
+// scan: read all the stickers again, otherwise only when the index
+// has never seen them or gpodder.net is due
+int
+la_resume_refresh(bool scan)
+{
+	bool with_gpodder;
+
+	if(job != NULL)
+	{
+		refresh_pending = true;
+		refresh_pending_scan |= scan;
+		return 0;
+	}
+
+	with_gpodder = getenv("GPODDER_USER") != NULL
+		&& time(NULL) - last_gpodder_sync >= GPODDER_SYNC_INTERVAL;
+
+	memset(&resume_job, 0, sizeof(resume_job));
+	resume_job.with_gpodder = with_gpodder;
+	resume_job.scan = scan || with_gpodder || !la_resume_index_imported();
+	job = la_pool_submit(resume_work, resume_done, &resume_job);
+	if(job == NULL)
+	{
+		return -1;
+	}
+
+	if(with_gpodder)
+	{
+		last_gpodder_sync = time(NULL);
+	}
+	return 0;
+}
+
+// the latest positions of the index
+static ResumeList*
+list_from_index()
+{
+	ResumeRecord* records;
+	ResumeEntry* entry;
+	ResumeList* list;
+	size_t n;
+	size_t i;
+
+	list = calloc(1, sizeof(ResumeList));
+	records = malloc(RESUME_LIST_LENGTH * sizeof(ResumeRecord));
+	if(list == NULL || records == NULL)
+	{
+		perror("E: list_from_index");
+		free(list);
+		free(records);
+		return NULL;
+	}
+
+	n = la_resume_index_top(records, RESUME_LIST_LENGTH);
+	for(i=0;i<n;i++)
+	{
+		entry = list_add(list, records[i].uri, records[i].played);
+		if(entry == NULL)
+		{
+			break;
+		}
+		entry->duration = records[i].duration;
+		entry->played_at = records[i].played_at;
+		if(records[i].title[0] != '\0')
+		{
+			entry->title = strdup(records[i].title);
+		}
+		entry_relabel(entry);
+	}
+
+	free(records);
+	return list;
+}
+
+static void
+set_cached(ResumeList* list)
+{
+	if(list != cached)
+	{
+		la_resume_list_free(cached);
+		cached = list;
+	}
+}
+
+ResumeList*
+la_resume_cached()
+{
+	// the index answers alone once it has read the stickers
+	if(cached == NULL && la_resume_index_imported())
+	{
+		cached = list_from_index();
+	}
+	return cached;
+}
+
+// positions saved by la since the stickers were read win, as they
+// are newer
+void
+la_resume_import(ResumeList* list)
+{
+	size_t i;
+
+	for(i=0;i<list->length;i++)
+	{
+		la_resume_index_put(list->entries[i].uri, list->entries[i].title, list->entries[i].played,
+			list->entries[i].duration, list->entries[i].played_at, false);
+	}
+	la_resume_index_set_imported();
+	la_resume_list_free(list);
+
+	set_cached(list_from_index());
+}
+
+// returns -1 if the index didn't take it, then not saved to the stickers
+int
+la_resume_update(const char* uri, const char* title, int played, int duration, time_t played_at)
+{
+	ResumeEntry* entry;
+	ResumeEntry moved;
+	int ret;
+
+	ret = la_resume_index_put(uri, title, played, duration, played_at, true);
+
+	if(cached == NULL)
+	{
+		return ret;
+	}
+
+	entry = list_find(cached, uri);
+	if(duration <= 0 && entry != NULL)
+	{
+		duration = entry->duration;
+	}
+	if(duration > 0 && played + LA_RESUME_END_MARGIN_SECS >= duration)
+	{
+		// finished: out of the list, as for the index
+		if(entry != NULL)
+		{
+			entry_free(entry);
+			memmove(entry, entry + 1, (cached->entries + cached->length - entry - 1) * sizeof(ResumeEntry));
+			cached->length--;
+		}
+		return ret;
+	}
+
+	if(entry == NULL)
+	{
+		entry = list_add(cached, uri, played);
+		if(entry == NULL)
+		{
+			return ret;
+		}
+	}
+	if(entry->title == NULL && title != NULL)
+	{
+		entry->title = strdup(title);
+	}
+	entry->played = played;
+	entry->duration = duration;
+	entry->played_at = played_at;
+	entry_relabel(entry);
+
+	// played last: to the front, the others keep their order
+	moved = *entry;
+	memmove(cached->entries + 1, cached->entries, (entry - cached->entries) * sizeof(ResumeEntry));
+	cached->entries[0] = moved;
+
+	// as long as a list read from the index
+	while(cached->length > RESUME_LIST_LENGTH)
+	{
+		entry_free(cached->entries + --cached->length);
+	}
+	return ret;
+}
@@ -0,0 +1,38 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <mpd/client.h>
+
+typedef struct {
+	char* uri;
+	char* title;
+	char* label;
+	size_t label_size;
+	int played;
+	// 0 if unknown
+	int duration;
+	time_t played_at;
+} ResumeEntry;
+
+typedef struct {
+	ResumeEntry* entries;
+	size_t length;
+} ResumeList;
+
+int la_resume_init(const char* index_path, void (*refreshed)());
+void la_resume_exit();
+
+int la_resume_build(struct mpd_connection* conn, bool with_gpodder, ResumeList** res);
+int la_resume_refresh(bool scan);
+
+ResumeList* la_resume_cached();
+void la_resume_import(ResumeList* list);
+int la_resume_update(const char* uri, const char* title, int played, int duration, time_t played_at);
+
+void la_resume_list_free(ResumeList* list);
+
+#endif        //  #ifndef RESUME_H
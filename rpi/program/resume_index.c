@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+#include "resume_index.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Positions of the episodes, kept by la itself in a file mapped in
+   memory: an open addressing hash table of fixed size records keyed by
+   the uri. Saving a position writes its record in place; the resume
+   worker copies the dirty records to the mpd stickers later on.
+
+   Without the file (no path, read-only filesystem), the same table is
+   kept in anonymous memory for the life of la. */
+
+#define INDEX_MAGIC "LARESUM1"
+#define INDEX_FIRST_CAPACITY 256
+// the table doubles past 3/4 full: probes stay short
+#define INDEX_MAX_COUNT(capacity) ((capacity) / 4 * 3)
+
+typedef struct {
+	char magic[8];
+	uint32_t capacity;
+	uint32_t count;
+	// the stickers were read once: the index can answer alone
+	uint8_t imported;
+	uint8_t reserved[sizeof(ResumeRecord) - 17];
+} IndexHeader;
+
+// the resume worker syncs from its own thread
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char* index_path = NULL;
+static IndexHeader* header = NULL;
+static ResumeRecord* records = NULL;
+static size_t mapping_size = 0;
+
+static uint64_t
+hash_uri(const char* uri)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	while(*uri != '\0')
+	{
+		hash ^= (unsigned char)*uri++;
+		hash *= 1099511628211ULL;
+	}
+	// 0 marks free slots
+	return hash != 0 ? hash : 1;
+}
+
+static size_t
+find_slot(ResumeRecord* table, uint32_t capacity, uint64_t hash, const char* uri)
+{
+	size_t i;
+
+	i = hash & (capacity - 1);
+	while(table[i].hash != 0 && (table[i].hash != hash || strcmp(table[i].uri, uri)))
+	{
+		i = (i + 1) & (capacity - 1);
+	}
+	return i;
+}
+
+static IndexHeader*
+map_index(int fd, uint32_t capacity, size_t* size)
+{
+	void* mapping;
+
+	*size = sizeof(IndexHeader) + (size_t)capacity * sizeof(ResumeRecord);
+	if(fd == -1)
+	{
+		mapping = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	else
+	{
+		if(ftruncate(fd, *size) == -1)
+		{
+			perror("E: resume index size");
+			return NULL;
+		}
+		mapping = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if(mapping == MAP_FAILED)
+	{
+		perror("E: resume index mmap");
+		return NULL;
+	}
+	return mapping;
+}
+
+// into a new file renamed over the old one: a crash leaves either table
+static int
+grow()
+{
+	IndexHeader* grown;
+	ResumeRecord* table;
+	char* tmp_path;
+	size_t size;
+	uint32_t capacity;
+	uint32_t i;
+	int fd;
+
+	capacity = header->capacity * 2;
+	fd = -1;
+	tmp_path = NULL;
+	if(index_path != NULL)
+	{
+		if(asprintf(&tmp_path, "%s.tmp", index_path) == -1)
+		{
+			return -1;
+		}
+		fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if(fd == -1)
+		{
+			fprintf(stderr, "E: resume index %s: %s\n", tmp_path, strerror(errno));
+			free(tmp_path);
+			return -1;
+		}
+	}
+
+	grown = map_index(fd, capacity, &size);
+	if(grown == NULL)
+	{
+		if(fd != -1)
+		{
+			close(fd);
+			unlink(tmp_path);
+		}
+		free(tmp_path);
+		return -1;
+	}
+
+	memcpy(grown, header, sizeof(IndexHeader));
+	grown->capacity = capacity;
+	table = (ResumeRecord*)(grown + 1);
+	for(i=0;i<header->capacity;i++)
+	{
+		if(records[i].hash != 0)
+		{
+			table[find_slot(table, capacity, records[i].hash, records[i].uri)] = records[i];
+		}
+	}
+
+	if(fd != -1)
+	{
+		if(rename(tmp_path, index_path) == -1)
+		{
+			perror("E: resume index rename");
+		}
+		close(fd);
+		free(tmp_path);
+	}
+
+	munmap(header, mapping_size);
+	header = grown;
+	records = table;
+	mapping_size = size;
+	LOG_D("resume index grown to %u slots", capacity);
+	return 0;
+}
+
+// returns the capacity of a valid file, 0 otherwise
+static uint32_t
+check_file(int fd)
+{
+	IndexHeader h;
+	struct stat st;
+
+	if(fstat(fd, &st) == -1 || st.st_size == 0)
+	{
+		return 0;
+	}
+	if(pread(fd, &h, sizeof(h), 0) != sizeof(h)
+		|| memcmp(h.magic, INDEX_MAGIC, sizeof(h.magic))
+		|| h.capacity == 0 || (h.capacity & (h.capacity - 1)) != 0
+		|| (size_t)st.st_size != sizeof(IndexHeader) + (size_t)h.capacity * sizeof(ResumeRecord))
+	{
+		fprintf(stderr, "E: resume index is corrupt, starting afresh\n");
+		return 0;
+	}
+	return h.capacity;
+}
+
+int
+la_resume_index_open(const char* path)
+{
+	uint32_t capacity;
+	int fd;
+
+	fd = -1;
+	capacity = 0;
+	if(path != NULL)
+	{
+		fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if(fd == -1)
+		{
+			fprintf(stderr, "E: resume index %s: %s, positions kept in memory only\n", path, strerror(errno));
+		}
+		else
+		{
+			capacity = check_file(fd);
+			if(capacity == 0 && ftruncate(fd, 0) == -1)
+			{
+				perror("E: resume index truncate");
+			}
+		}
+	}
+
+	header = map_index(fd, capacity != 0 ? capacity : INDEX_FIRST_CAPACITY, &mapping_size);
+	if(fd != -1)
+	{
+		// the mapping stays
+		close(fd);
+	}
+	if(header == NULL)
+	{
+		return -1;
+	}
+	if(capacity == 0)
+	{
+		memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+		header->capacity = INDEX_FIRST_CAPACITY;
+	}
+	records = (ResumeRecord*)(header + 1);
+	if(fd != -1)
+	{
+		index_path = strdup(path);
+	}
+
+	LOG_D("resume index: %u positions", header->count);
+	return 0;
+}
+
+void
+la_resume_index_close()
+{
+	if(header == NULL)
+	{
+		return;
+	}
+	if(index_path != NULL && msync(header, mapping_size, MS_SYNC) == -1)
+	{
+		perror("E: resume index sync");
+	}
+	munmap(header, mapping_size);
+	header = NULL;
+	records = NULL;
+	free(index_path);
+	index_path = NULL;
+}
+
+bool
+la_resume_index_imported()
+{
+	bool imported;
+
+	pthread_mutex_lock(&lock);
+	imported = header != NULL && header->imported;
+	pthread_mutex_unlock(&lock);
+	return imported;
+}
+
+void
+la_resume_index_set_imported()
+{
+	pthread_mutex_lock(&lock);
+	if(header != NULL)
+	{
+		header->imported = 1;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+// local: saved by la, to be written to the stickers; otherwise read
+// from the stickers or gpodder.net, and kept only if newer
+int
+la_resume_index_put(const char* uri, const char* title, int played, int duration, time_t played_at, bool local)
+{
+	ResumeRecord* record;
+	uint64_t hash;
+	bool fresh;
+
+	if(header == NULL || strlen(uri) >= LA_RESUME_INDEX_URI_SIZE)
+	{
+		return -1;
+	}
+	hash = hash_uri(uri);
+
+	pthread_mutex_lock(&lock);
+	if(header->count + 1 > INDEX_MAX_COUNT(header->capacity) && grow())
+	{
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+
+	record = records + find_slot(records, header->capacity, hash, uri);
+	fresh = record->hash == 0;
+	if(fresh)
+	{
+		record->hash = hash;
+		strcpy(record->uri, uri);
+		header->count++;
+	}
+	if(local || fresh || played_at > record->played_at)
+	{
+		record->played = played;
+		record->played_at = played_at;
+		record->dirty = local;
+	}
+	if(duration > 0)
+	{
+		record->duration = duration;
+	}
+	if(title != NULL && record->title[0] == '\0')
+	{
+		snprintf(record->title, sizeof(record->title), "%s", title);
+	}
+	record->finished = record->duration > 0 && record->played + LA_RESUME_END_MARGIN_SECS >= record->duration;
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+bool
+la_resume_index_get(const char* uri, ResumeRecord* record)
+{
+	ResumeRecord* found;
+	bool ret;
+
+	if(header == NULL)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock(&lock);
+	found = records + find_slot(records, header->capacity, hash_uri(uri), uri);
+	ret = found->hash != 0;
+	if(ret)
+	{
+		*record = *found;
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+// the k episodes played last and not finished, the latest first
+size_t
+la_resume_index_top(ResumeRecord* top, size_t k)
+{
+	ResumeRecord* record;
+	size_t n;
+	size_t i;
+	size_t j;
+
+	n = 0;
+	if(header == NULL || k == 0)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	for(i=0;i<header->capacity;i++)
+	{
+		record = records + i;
+		if(record->hash == 0 || record->finished
+			|| (n == k && record->played_at <= top[k-1].played_at))
+		{
+			continue;
+		}
+		// the oldest one kept falls off when full
+		j = n < k ? n++ : k - 1;
+		while(j > 0 && top[j-1].played_at < record->played_at)
+		{
+			top[j] = top[j-1];
+			j--;
+		}
+		top[j] = *record;
+	}
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+size_t
+la_resume_index_dirty(ResumeRecord* dirty, size_t max)
+{
+	size_t n;
+	size_t i;
+
+	n = 0;
+	if(header == NULL)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	for(i=0;i<header->capacity && n<max;i++)
+	{
+		if(records[i].hash != 0 && records[i].dirty)
+		{
+			dirty[n++] = records[i];
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+// unless saved again since it was copied
+void
+la_resume_index_clean(const ResumeRecord* record)
+{
+	ResumeRecord* found;
+
+	pthread_mutex_lock(&lock);
+	found = records + find_slot(records, header->capacity, record->hash, record->uri);
+	if(found->hash != 0 && found->played == record->played && found->played_at == record->played_at)
+	{
+		found->dirty = 0;
+	}
+	pthread_mutex_unlock(&lock);
+}
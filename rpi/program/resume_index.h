@@ -0,0 +1,42 @@
+#ifndef RESUME_INDEX_H
+#define RESUME_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LA_RESUME_INDEX_URI_SIZE 384
+#define LA_RESUME_INDEX_TITLE_SIZE 96
+// an episode played up to that close to its end is finished
+#define LA_RESUME_END_MARGIN_SECS 30
+
+// one slot of the index file, 512 bytes
+typedef struct {
+	// FNV-1a of the uri, 0 for a free slot
+	uint64_t hash;
+	int64_t played_at;
+	int32_t played;
+	// 0 if unknown
+	int32_t duration;
+	uint8_t finished;
+	// not written to the mpd stickers yet
+	uint8_t dirty;
+	uint8_t reserved[6];
+	char title[LA_RESUME_INDEX_TITLE_SIZE];
+	char uri[LA_RESUME_INDEX_URI_SIZE];
+} ResumeRecord;
+
+int la_resume_index_open(const char* path);
+void la_resume_index_close();
+
+bool la_resume_index_imported();
+void la_resume_index_set_imported();
+
+int la_resume_index_put(const char* uri, const char* title, int played, int duration, time_t played_at, bool local);
+bool la_resume_index_get(const char* uri, ResumeRecord* record);
+size_t la_resume_index_top(ResumeRecord* records, size_t k);
+size_t la_resume_index_dirty(ResumeRecord* records, size_t max);
+void la_resume_index_clean(const ResumeRecord* record);
+
+#endif        //  #ifndef RESUME_INDEX_H
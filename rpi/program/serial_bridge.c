@@ -1,4 +1,5 @@
 #include "controles.h"
+#include "keymap.h"
 #include "ecran.h"
 
 #include <sys/stat.h>
@@ -11,6 +12,7 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
 
 #include <iconv.h> 
 
@@ -26,6 +28,11 @@ static FILE* fArduino = NULL;
 static char* buf;
 static size_t buf_len;
 
+// input event frames of the firmware, as in magneto_arduino_serial.c
+#define FRAME_SOH 0x01
+#define FRAME_LEN 12
+#define FRAME_FLAG_REPEAT 0x01
+
 static iconv_t conv;
 static const size_t conv_buf_len = 64;
 static char conv_buf[64];
@@ -261,12 +268,67 @@ void la_ecran_change_state(bool sleep)
 	//NOOP
 }
 
+static int
+input_frame()
+{
+	uint8_t frame[FRAME_LEN];
+	uint8_t check = 0;
+	uint32_t code;
+	int c;
+	int i;
+
+	frame[0] = FRAME_SOH;
+	if(fread(frame + 1, 1, FRAME_LEN - 1, fArduino) != FRAME_LEN - 1)
+	{
+		fprintf(stderr, "E: nothing read from arduino\n");
+		return -1;
+	}
+	for(i=1;i<FRAME_LEN-1;i++)
+	{
+		check ^= frame[i];
+	}
+	if(check != frame[FRAME_LEN-1])
+	{
+		fprintf(stderr, "E: corrupt input event from arduino\n");
+		return 0;
+	}
+
+	code = frame[3] | (frame[4] << 8) | (frame[5] << 16) | ((uint32_t)frame[6] << 24);
+	fprintf(stdout, "IR: %08X%s\n", code, frame[2] & FRAME_FLAG_REPEAT ? " repeat" : "");
+	if(frame[2] & FRAME_FLAG_REPEAT)
+	{
+		return 0;
+	}
+	c = la_keymap_lookup_code(code);
+	if(c == -1)
+	{
+		fprintf(stderr, "unsupported code: %08X\n", code);
+		return 0;
+	}
+
+	if(callbacks[c] != NULL)
+	{
+		return callbacks[c](c, 1, callback_params[c]);
+	}
+	return 0;
+}
+
 int la_control_input_one(int fd)
 {
-	Control c;
+	int c;
 	int len;
-	const char* cmd;
 
+	// binary input events of the firmware, between its text lines
+	c = getc(fArduino);
+	if(c == FRAME_SOH)
+	{
+		return input_frame();
+	}
+	else if(c == EOF || ungetc(c, fArduino) == EOF)
+	{
+		fprintf(stderr, "E: nothing read from arduino\n");
+		return -1;
+	}
 
 	len = getline(&buf, &buf_len, fArduino);
 	if(len == 0)
@@ -288,9 +350,21 @@ int la_control_input_one(int fd)
 		fprintf(stdout, "%s", buf);
 	}
 
+	buf[len - 1] = '\0';
+	if(len > 1 && buf[len - 2] == '\r')
+	{
+		buf[len - 2] = '\0';
+	}
+	c = la_keymap_lookup(buf + 4);
+	if(c == -1)
+	{
+		fprintf(stderr, "unsupported command: '%s'\n", buf + 4);
+		return 0;
+	}
+
 	if(callbacks[c] != NULL)
 	{
-		return callbacks[c](c, callback_params[c]);
+		return callbacks[c](c, 1, callback_params[c]);
 	}
 	return 0;
 }
@@ -0,0 +1,312 @@
+#define _GNU_SOURCE
+#include "stats.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_STATS 64
+// bucket i holds durations below 2^(i+1) us, the last one everything above 8s
+#define STATS_BUCKETS 24
+#define STATS_BUFFER_SIZE 16384
+
+typedef struct {
+	const char* name;
+	bool histogram;
+	// counters that also show their rate since the previous dump
+	bool rate;
+	struct timespec rate_since;
+	uint64_t rate_sum;
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint32_t buckets[STATS_BUCKETS];
+} Stat;
+
+static Stat stats[MAX_STATS];
+static int stats_count = 0;
+
+static int stats_fd = -1;
+static char* stats_path = NULL;
+static char stats_buffer[STATS_BUFFER_SIZE];
+
+static int
+stats_register(const char* name, bool histogram)
+{
+	int i;
+
+	for(i=0;i<stats_count;i++)
+	{
+		if(!strcmp(stats[i].name, name))
+		{
+			return i;
+		}
+	}
+	if(stats_count == MAX_STATS)
+	{
+		fprintf(stderr, "E: too many stats, ignoring %s\n", name);
+		return -1;
+	}
+	stats[stats_count].name = strdup(name);
+	stats[stats_count].histogram = histogram;
+	clock_gettime(CLOCK_MONOTONIC, &stats[stats_count].rate_since);
+	return stats_count++;
+}
+
+int
+la_stats_counter(const char* name)
+{
+	return stats_register(name, false);
+}
+
+int
+la_stats_histogram(const char* name)
+{
+	return stats_register(name, true);
+}
+
+int
+la_stats_rate(const char* name)
+{
+	int id;
+
+	id = stats_register(name, false);
+	if(id >= 0)
+	{
+		stats[id].rate = true;
+	}
+	return id;
+}
+
+void
+la_stats_add(int id, long n)
+{
+	if(id < 0)
+	{
+		return;
+	}
+	stats[id].count++;
+	stats[id].sum += n;
+}
+
+void
+la_stats_record_us(int id, long us)
+{
+	Stat* s;
+	int bucket;
+
+	if(id < 0)
+	{
+		return;
+	}
+	if(us < 0)
+	{
+		us = 0;
+	}
+
+	s = stats + id;
+	s->count++;
+	s->sum += us;
+	if(us > s->max)
+	{
+		s->max = us;
+	}
+
+	bucket = us < 2 ? 0 : 63 - __builtin_clzll((unsigned long long)us);
+	if(bucket >= STATS_BUCKETS)
+	{
+		bucket = STATS_BUCKETS - 1;
+	}
+	s->buckets[bucket]++;
+}
+
+void
+la_stats_start(struct timespec* start)
+{
+	clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+void
+la_stats_since(int id, const struct timespec* start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	la_stats_record_us(id, (now.tv_sec - start->tv_sec) * 1000000
+		+ (now.tv_nsec - start->tv_nsec) / 1000);
+}
+
+// upper bound of the bucket holding the given percentile
+static long
+percentile(const Stat* s, int pct)
+{
+	uint64_t seen = 0;
+	uint64_t target;
+	int i;
+
+	target = (s->count * pct + 99) / 100;
+	for(i=0;i<STATS_BUCKETS;i++)
+	{
+		seen += s->buckets[i];
+		if(seen >= target)
+		{
+			return i == STATS_BUCKETS - 1 ? (long)s->max : (2L << i);
+		}
+	}
+	return s->max;
+}
+
+static size_t
+format_stats()
+{
+	size_t len = 0;
+	struct timespec now;
+	double elapsed;
+	Stat* s;
+	int i;
+	int b;
+
+#define APPEND(...) \
+	if(len < sizeof(stats_buffer)) \
+	{ \
+		len += snprintf(stats_buffer + len, sizeof(stats_buffer) - len, __VA_ARGS__); \
+	}
+
+	for(i=0;i<stats_count;i++)
+	{
+		s = stats + i;
+		if(s->rate)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			elapsed = (now.tv_sec - s->rate_since.tv_sec)
+				+ (now.tv_nsec - s->rate_since.tv_nsec) / 1e9;
+			APPEND("%s %llu %.2f/s\n", s->name, (unsigned long long)s->sum,
+				elapsed > 0 ? (s->sum - s->rate_sum) / elapsed : 0.0);
+			s->rate_since = now;
+			s->rate_sum = s->sum;
+			continue;
+		}
+		if(!s->histogram)
+		{
+			APPEND("%s %llu\n", s->name, (unsigned long long)s->sum);
+			continue;
+		}
+
+		APPEND("%s count=%llu", s->name, (unsigned long long)s->count);
+		if(s->count > 0)
+		{
+			APPEND(" avg=%lluus p50<%lius p99<%lius max=%lluus |",
+				(unsigned long long)(s->sum / s->count),
+				percentile(s, 50), percentile(s, 99),
+				(unsigned long long)s->max);
+			for(b=0;b<STATS_BUCKETS;b++)
+			{
+				if(s->buckets[b])
+				{
+					APPEND(" <%li:%u", 2L << b, s->buckets[b]);
+				}
+			}
+		}
+		APPEND("\n");
+	}
+
+#undef APPEND
+
+	return len < sizeof(stats_buffer) ? len : sizeof(stats_buffer) - 1;
+}
+
+void
+la_stats_dump(FILE* f)
+{
+	size_t len;
+
+	len = format_stats();
+	fprintf(f, "I: stats\n");
+	fwrite(stats_buffer, 1, len, f);
+	fflush(f);
+}
+
+int
+la_stats_init(const char* socket_path)
+{
+	struct sockaddr_un sa = {0};
+
+	if(strlen(socket_path) >= sizeof(sa.sun_path))
+	{
+		fprintf(stderr, "E: stats socket path too long: %s\n", socket_path);
+		return -1;
+	}
+
+	stats_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(stats_fd == -1)
+	{
+		perror("E: stats socket");
+		return -1;
+	}
+
+	// left over by a previous run
+	unlink(socket_path);
+
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, socket_path);
+	if(bind(stats_fd, (struct sockaddr*)&sa, sizeof(sa)) == -1
+		|| listen(stats_fd, 4) == -1)
+	{
+		fprintf(stderr, "E: stats socket %s: %s\n", socket_path, strerror(errno));
+		close(stats_fd);
+		stats_fd = -1;
+		return -1;
+	}
+	stats_path = strdup(socket_path);
+
+	return stats_fd;
+}
+
+// answers the pending clients with a dump and hangs up
+int
+la_stats_handle()
+{
+	size_t len;
+	ssize_t sent;
+	int fd;
+
+	while((fd = accept4(stats_fd, NULL, NULL, SOCK_CLOEXEC)) != -1)
+	{
+		len = format_stats();
+		// the dump fits in the socket buffer: don't wait for slow readers
+		sent = send(fd, stats_buffer, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(sent != (ssize_t)len)
+		{
+			fprintf(stderr, "E: stats client: sent %li/%li\n", (long)sent, (long)len);
+		}
+		close(fd);
+	}
+
+	if(errno != EAGAIN && errno != EWOULDBLOCK)
+	{
+		perror("E: stats accept");
+		return -1;
+	}
+	return 0;
+}
+
+void
+la_stats_exit()
+{
+	if(stats_fd != -1)
+	{
+		close(stats_fd);
+		stats_fd = -1;
+	}
+	if(stats_path != NULL)
+	{
+		unlink(stats_path);
+		free(stats_path);
+		stats_path = NULL;
+	}
+}
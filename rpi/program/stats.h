@@ -0,0 +1,20 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <time.h>
+
+int la_stats_counter(const char* name);
+int la_stats_histogram(const char* name);
+int la_stats_rate(const char* name);
+void la_stats_add(int id, long n);
+void la_stats_record_us(int id, long us);
+void la_stats_start(struct timespec* start);
+void la_stats_since(int id, const struct timespec* start);
+
+int la_stats_init(const char* socket_path);
+int la_stats_handle();
+void la_stats_dump(FILE* f);
+void la_stats_exit();
+
+#endif        //  #ifndef STATS_H
@@ -0,0 +1,268 @@
+#include "trace.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "controles.h"
+
+#define TRACE_MAGIC "LATRACE1"
+#define TRACE_MAGIC_LEN 8
+
+// 8 bytes per event, little endian like the Pi and the dev machines
+typedef struct {
+	uint32_t ms;
+	uint8_t type;
+	uint8_t reserved;
+	uint16_t value;
+} __attribute__ ((packed)) TraceRecord;
+
+static FILE* record_file = NULL;
+static struct timespec record_start;
+
+static TraceRecord* replay_records = NULL;
+static size_t replay_count = 0;
+static size_t replay_next = 0;
+static double replay_speed = 1.0;
+static struct timespec replay_start;
+static int replay_fd = -1;
+
+static uint32_t
+ms_since(const struct timespec* start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+int
+la_trace_record_open(const char* path)
+{
+	record_file = fopen(path, "w");
+	if(record_file == NULL)
+	{
+		fprintf(stderr, "E: unable to record to %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	// stdio buffers the records: one write(2) every 512 events
+	setvbuf(record_file, NULL, _IOFBF, 4096);
+	fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, record_file);
+	clock_gettime(CLOCK_MONOTONIC, &record_start);
+	return 0;
+}
+
+void
+la_trace_record(TraceType type, unsigned value)
+{
+	TraceRecord r;
+
+	if(record_file == NULL)
+	{
+		return;
+	}
+	r.ms = ms_since(&record_start);
+	r.type = type;
+	r.reserved = 0;
+	r.value = value;
+	fwrite(&r, sizeof(r), 1, record_file);
+}
+
+void
+la_trace_record_flush()
+{
+	if(record_file != NULL)
+	{
+		fflush(record_file);
+	}
+}
+
+void
+la_trace_record_close()
+{
+	if(record_file != NULL)
+	{
+		fclose(record_file);
+		record_file = NULL;
+	}
+}
+
+static int
+load(const char* path)
+{
+	FILE* f;
+	char magic[TRACE_MAGIC_LEN];
+	long size;
+
+	f = fopen(path, "r");
+	if(f == NULL)
+	{
+		fprintf(stderr, "E: unable to read %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if(fread(magic, 1, TRACE_MAGIC_LEN, f) != TRACE_MAGIC_LEN
+		|| memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN))
+	{
+		fprintf(stderr, "E: %s is not a trace\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f) - TRACE_MAGIC_LEN;
+	fseek(f, TRACE_MAGIC_LEN, SEEK_SET);
+
+	// a session killed while recording may end with half a record
+	replay_count = size / sizeof(TraceRecord);
+	replay_records = malloc(replay_count * sizeof(TraceRecord) + 1);
+	if(replay_records == NULL
+		|| fread(replay_records, sizeof(TraceRecord), replay_count, f) != replay_count)
+	{
+		fprintf(stderr, "E: unable to load %s\n", path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+int
+la_trace_replay_open(const char* path, double speed)
+{
+	if(load(path))
+	{
+		return -1;
+	}
+	replay_speed = speed;
+	replay_next = 0;
+	LOG_I("trace %s: %zu events, speed %g", path, replay_count, speed);
+	return 0;
+}
+
+static void
+arm()
+{
+	struct itimerspec its = {{0}};
+	double at_ms;
+	int64_t ns;
+
+	if(replay_next >= replay_count)
+	{
+		// the end, at once: the next wakeup returns -1
+		at_ms = 0;
+	}
+	else
+	{
+		// as fast as possible: right after the previous event is handled
+		at_ms = replay_speed > 0 ? replay_records[replay_next].ms / replay_speed : 0;
+	}
+
+	// not in a long: 2s of nanoseconds overflow it on the pi
+	ns = replay_start.tv_nsec + (int64_t)(at_ms * 1000000);
+	its.it_value.tv_sec = replay_start.tv_sec + ns / 1000000000;
+	its.it_value.tv_nsec = ns % 1000000000;
+	// absolute time: late handlers don't shift the following events
+	if(timerfd_settime(replay_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+	{
+		perror("E: trace timerfd");
+	}
+}
+
+// returns the timer to watch in the event loop
+int
+la_trace_replay_start()
+{
+	replay_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(replay_fd == -1)
+	{
+		perror("E: trace timerfd");
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &replay_start);
+	// timer values of 0 disarm it
+	replay_start.tv_nsec += 1;
+	if(replay_start.tv_nsec == 1000000000)
+	{
+		replay_start.tv_sec++;
+		replay_start.tv_nsec = 0;
+	}
+	arm();
+	return replay_fd;
+}
+
+// returns 1 with the next due event, 0 if none is due yet, -1 at the end
+int
+la_trace_replay_next(TraceType* type, unsigned* value)
+{
+	uint64_t count;
+
+	if(read(replay_fd, &count, sizeof(count)) != sizeof(count))
+	{
+		return 0;
+	}
+	if(replay_next >= replay_count)
+	{
+		return -1;
+	}
+
+	*type = replay_records[replay_next].type;
+	*value = replay_records[replay_next].value;
+	replay_next++;
+
+	if(replay_next >= replay_count)
+	{
+		LOG_I("trace replayed in %ims", ms_since(&replay_start));
+	}
+	arm();
+	return 1;
+}
+
+void
+la_trace_replay_close()
+{
+	if(replay_fd != -1)
+	{
+		close(replay_fd);
+		replay_fd = -1;
+	}
+	free(replay_records);
+	replay_records = NULL;
+	replay_count = 0;
+}
+
+int
+la_trace_dump(const char* path)
+{
+	size_t i;
+	TraceRecord* r;
+
+	if(load(path))
+	{
+		return -1;
+	}
+	for(i=0;i<replay_count;i++)
+	{
+		r = replay_records + i;
+		if(r->type == LA_TRACE_CONTROL && r->value < LA_CONTROL_LENGTH)
+		{
+			printf("%8u.%03u %s\n", r->ms / 1000, r->ms % 1000, DEBUG_CONTROLS[r->value]);
+		}
+		else if(r->type == LA_TRACE_IDLE)
+		{
+			printf("%8u.%03u idle 0x%x\n", r->ms / 1000, r->ms % 1000, r->value);
+		}
+		else
+		{
+			printf("%8u.%03u ? %u %u\n", r->ms / 1000, r->ms % 1000, r->type, r->value);
+		}
+	}
+	la_trace_replay_close();
+	return 0;
+}
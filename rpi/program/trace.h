@@ -0,0 +1,23 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+typedef enum {
+	LA_TRACE_CONTROL = 1,
+	LA_TRACE_IDLE = 2
+} TraceType;
+
+int la_trace_record_open(const char* path);
+void la_trace_record(TraceType type, unsigned value);
+void la_trace_record_flush();
+void la_trace_record_close();
+
+int la_trace_replay_open(const char* path, double speed);
+int la_trace_replay_start();
+int la_trace_replay_next(TraceType* type, unsigned* value);
+void la_trace_replay_close();
+
+int la_trace_dump(const char* path);
+
+#endif        //  #ifndef TRACE_H
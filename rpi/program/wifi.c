@@ -0,0 +1,322 @@
+#include "wifi.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#define MAX_ADDRESSES 8
+
+typedef struct {
+	unsigned char family;
+	unsigned char addr[16];
+} Address;
+
+static char wifi_itf[IF_NAMESIZE];
+static int wifi_index = 0;
+static bool wifi_link = false;
+static Address wifi_addresses[MAX_ADDRESSES];
+static int wifi_addresses_count = 0;
+static int wifi_fd = -1;
+
+static char nl_buf[8192] __attribute__ ((aligned(__alignof__(struct nlmsghdr))));
+
+static bool
+handle_link(struct nlmsghdr* nlh)
+{
+	struct ifinfomsg* ifi;
+	struct rtattr* rta;
+	int len;
+	bool old_link;
+	bool ours;
+
+	ifi = NLMSG_DATA(nlh);
+	ours = wifi_index != 0 && ifi->ifi_index == wifi_index;
+
+	len = IFLA_PAYLOAD(nlh);
+	for(rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+	{
+		if(rta->rta_type == IFLA_IFNAME)
+		{
+			ours = !strncmp(RTA_DATA(rta), wifi_itf, IF_NAMESIZE);
+		}
+	}
+
+	if(!ours)
+	{
+		return false;
+	}
+
+	old_link = wifi_link;
+	if(nlh->nlmsg_type == RTM_DELLINK)
+	{
+		wifi_index = 0;
+		wifi_link = false;
+		wifi_addresses_count = 0;
+		return true;
+	}
+
+	wifi_index = ifi->ifi_index;
+	wifi_link = (ifi->ifi_flags & IFF_RUNNING) != 0;
+	return old_link != wifi_link;
+}
+
+static int
+find_address(const Address* a)
+{
+	int i;
+
+	for(i=0;i<wifi_addresses_count;i++)
+	{
+		if(wifi_addresses[i].family == a->family
+			&& !memcmp(wifi_addresses[i].addr, a->addr, sizeof(a->addr)))
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+static bool
+handle_addr(struct nlmsghdr* nlh)
+{
+	struct ifaddrmsg* ifa;
+	struct rtattr* rta;
+	Address a = {0};
+	bool found;
+	int len;
+	int i;
+
+	ifa = NLMSG_DATA(nlh);
+	if(wifi_index == 0 || ifa->ifa_index != wifi_index)
+	{
+		return false;
+	}
+	// link-local addresses don't take us anywhere
+	if(ifa->ifa_scope != RT_SCOPE_UNIVERSE)
+	{
+		return false;
+	}
+
+	found = false;
+	len = IFA_PAYLOAD(nlh);
+	for(rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+	{
+		if((rta->rta_type == IFA_LOCAL || (rta->rta_type == IFA_ADDRESS && !found))
+			&& RTA_PAYLOAD(rta) <= sizeof(a.addr))
+		{
+			a.family = ifa->ifa_family;
+			memset(a.addr, 0, sizeof(a.addr));
+			memcpy(a.addr, RTA_DATA(rta), RTA_PAYLOAD(rta));
+			found = true;
+		}
+	}
+
+	if(!found)
+	{
+		return false;
+	}
+
+	i = find_address(&a);
+	if(nlh->nlmsg_type == RTM_NEWADDR)
+	{
+		if(i != -1 || wifi_addresses_count == MAX_ADDRESSES)
+		{
+			return false;
+		}
+		wifi_addresses[wifi_addresses_count++] = a;
+	}
+	else
+	{
+		if(i == -1)
+		{
+			return false;
+		}
+		wifi_addresses[i] = wifi_addresses[--wifi_addresses_count];
+	}
+	return true;
+}
+
+// returns 1 if the state changed, 2 at the end of a dump
+static int
+process(int len)
+{
+	struct nlmsghdr* nlh;
+	int ret = 0;
+
+	for(nlh = (struct nlmsghdr*)nl_buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len))
+	{
+		switch(nlh->nlmsg_type)
+		{
+		case NLMSG_DONE:
+			return ret | 2;
+		case NLMSG_ERROR:
+			fprintf(stderr, "E: netlink error\n");
+			return ret | 2;
+		case RTM_NEWLINK:
+		case RTM_DELLINK:
+			if(handle_link(nlh)) ret |= 1;
+			break;
+		case RTM_NEWADDR:
+		case RTM_DELADDR:
+			if(handle_addr(nlh)) ret |= 1;
+			break;
+		default:
+			break;
+		}
+	}
+	return ret;
+}
+
+static int
+dump(int fd, int type, int family)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct rtgenmsg g;
+	} req = {{0}};
+	int len;
+	int ret;
+
+	req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.g));
+	req.nlh.nlmsg_type = type;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq = type;
+	req.g.rtgen_family = family;
+
+	if(send(fd, &req, req.nlh.nlmsg_len, 0) == -1)
+	{
+		perror("E: netlink dump request");
+		return -1;
+	}
+
+	do
+	{
+		len = recv(fd, nl_buf, sizeof(nl_buf), 0);
+		if(len <= 0)
+		{
+			perror("E: netlink dump");
+			return -1;
+		}
+		ret = process(len);
+	} while(!(ret & 2));
+
+	return 0;
+}
+
+static int
+dump_all()
+{
+	int fd;
+	int ret;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if(fd == -1)
+	{
+		perror("E: netlink dump socket");
+		return -1;
+	}
+
+	wifi_link = false;
+	wifi_addresses_count = 0;
+	ret = dump(fd, RTM_GETLINK, AF_PACKET) || dump(fd, RTM_GETADDR, AF_UNSPEC);
+	close(fd);
+
+	LOG_I("wifi %s link %s, %i address(es)", wifi_itf,
+		wifi_link ? "up" : "down", wifi_addresses_count);
+	return ret ? -1 : 0;
+}
+
+int
+la_wifi_init(const char* itf)
+{
+	struct sockaddr_nl sa = {0};
+
+	strncpy(wifi_itf, itf, IF_NAMESIZE - 1);
+	wifi_index = if_nametoindex(itf);
+
+	// subscribe before the dump so that no change is missed in between
+	wifi_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if(wifi_fd == -1)
+	{
+		perror("E: netlink socket");
+		return -1;
+	}
+
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if(bind(wifi_fd, (struct sockaddr*)&sa, sizeof(sa)) == -1)
+	{
+		perror("E: netlink bind");
+		close(wifi_fd);
+		wifi_fd = -1;
+		return -1;
+	}
+
+	dump_all();
+
+	return wifi_fd;
+}
+
+void
+la_wifi_exit()
+{
+	if(wifi_fd != -1)
+	{
+		close(wifi_fd);
+		wifi_fd = -1;
+	}
+}
+
+int
+la_wifi_handle(int fd)
+{
+	int len;
+	int changed = 0;
+
+	while((len = recv(fd, nl_buf, sizeof(nl_buf), MSG_DONTWAIT)) > 0)
+	{
+		changed |= process(len) & 1;
+	}
+
+	if(len == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+	{
+		// we may have missed some messages (ENOBUFS: the socket overran):
+		// not worth stopping la for, start again from a fresh state
+		if(errno == ENOBUFS)
+		{
+			fprintf(stderr, "E: netlink overrun, dumping again\n");
+		}
+		else
+		{
+			perror("E: netlink recv");
+		}
+		dump_all();
+		changed = 1;
+	}
+
+	if(changed)
+	{
+		LOG_I("wifi %s link %s, %i address(es)", wifi_itf,
+			wifi_link ? "up" : "down", wifi_addresses_count);
+	}
+	return changed;
+}
+
+bool
+la_wifi_has_link()
+{
+	return wifi_link;
+}
+
+bool
+la_wifi_has_address()
+{
+	return wifi_link && wifi_addresses_count > 0;
+}
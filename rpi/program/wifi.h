@@ -0,0 +1,13 @@
+#ifndef WIFI_H
+#define WIFI_H
+
+#include <stdbool.h>
+
+int la_wifi_init(const char* itf);
+int la_wifi_handle(int fd);
+void la_wifi_exit();
+
+bool la_wifi_has_link();
+bool la_wifi_has_address();
+
+#endif        //  #ifndef WIFI_H